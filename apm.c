@@ -113,6 +113,8 @@ static const char *bzb_types[] =
 };
 
 static int	apm_load(const struct disk *, const struct part *, void **);
+static void	apm_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	apm_setup(struct disk *, struct map *);
 static int	apm_info(const struct map *, FILE *);
 static int	apm_index(const struct part *, char *, size_t);
@@ -122,21 +124,29 @@ static void	apm_bounds(const struct up_apm_p *, int64_t *, int64_t *);
 static int	apm_find(const struct disk *, int64_t, int64_t,
     int64_t *, int64_t *);
 
+static const struct map_sig apm_sigs[] = {
+	{ APM_OFFSET, 0, "PM", 2, 0 },
+	{ 0 }
+};
+
 void
-up_apm_register(void)
+up_apm_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = "Apple partition map";
+	funcs.name = "apm";
 	funcs.load = apm_load;
+	funcs.footprint = apm_footprint;
+	funcs.sigs = apm_sigs;
 	funcs.setup = apm_setup;
 	funcs.print_header = apm_info;
 	funcs.get_index = apm_index;
 	funcs.print_extrahdr = apm_extrahdr;
 	funcs.print_extra = apm_extra;
 
-	up_map_register(UP_MAP_APM, &funcs);
+	up_map_register(ctx, UP_MAP_APM, &funcs);
 }
 
 static int
@@ -158,7 +168,7 @@ apm_load(const struct disk *disk, const struct part *parent, void **priv)
 		return (res);
 
 	/* allocate apm struct and buffer for raw map */
-	if ((apm = xalloc(1, sizeof(*apm), XA_ZERO)) == NULL)
+	if ((apm = up_map_alloc(disk, sizeof(*apm))) == NULL)
 		return (-1);
 	apm->size = UP_DISK_1SECT(disk) * size;
 	apm->firstsect = start;
@@ -169,6 +179,14 @@ apm_load(const struct disk *disk, const struct part *parent, void **priv)
 	return (1);
 }
 
+static void
+apm_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	*head = APM_OFFSET + 1;
+	*tail = 0;
+}
+
 static int
 apm_setup(struct disk *disk, struct map *map)
 {
@@ -184,7 +202,7 @@ apm_setup(struct disk *disk, struct map *map)
 	apm->tmpbuf = data;
 
 	for (i = 0; i < apm->size / UP_DISK_1SECT(disk); i++) {
-		if ((part = xalloc(1, sizeof(*part), XA_ZERO)) == NULL)
+		if ((part = up_map_alloc(disk, sizeof(*part))) == NULL)
 			return (-1);
 		memcpy(&part->part, data + i * UP_DISK_1SECT(disk),
 		    sizeof(part->part));
@@ -195,10 +213,8 @@ apm_setup(struct disk *disk, struct map *map)
 		if (APM_MAGIC != UP_BETOH16(part->part.sig))
 			flags |= UP_PART_EMPTY;
 
-		if (!up_map_add(map, start, size, flags, part)) {
-			free(part);
+		if (!up_map_add(map, start, size, flags, part))
 			return (-1);
-		}
 	}
 
 	return (1);
@@ -207,12 +223,13 @@ apm_setup(struct disk *disk, struct map *map)
 static int
 apm_info(const struct map *map, FILE *stream)
 {
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	/* XXX display driver info here like pdisk does? */
 	if (fprintf(stream, "%s at ", up_map_label(map)) < 0 ||
-	    printsect_verbose(UP_MAP_VIRTADDR(map), stream)  < 0 ||
+	    up_printsect_verbose(map->disk, UP_MAP_VIRTADDR(map),
+		stream) < 0 ||
 	    fprintf(stream, " of %s:\n", UP_DISK_PATH(map->disk)) < 0)
 		return (-1);
 	return (1);
@@ -230,10 +247,10 @@ static int
 apm_extrahdr(const struct map *map, FILE *stream)
 {
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
-        if (UP_NOISY(EXTRA))
+        if (UP_NOISY(map->disk->ctx, EXTRA))
 		return (fprintf(stream, " %-24s %-24s %-10s %s",
 			"Type", "Name", "Status", "A/UX boot data"));
         else
@@ -247,7 +264,7 @@ apm_extra(const struct part *part, FILE *stream)
 	struct up_apm_p *raw;
 	char type[sizeof(raw->type)+1], name[sizeof(raw->name)+1];
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = part->priv;
@@ -257,7 +274,7 @@ apm_extra(const struct part *part, FILE *stream)
 	memcpy(name, raw->name, sizeof raw->name);
 	name[sizeof(name)-1] = '\0';
 
-	if (!UP_NOISY(EXTRA))
+	if (!UP_NOISY(part->map->disk->ctx, EXTRA))
 		return (fprintf(stream, " %-24s %s", type, name));
 
 	if (fprintf(stream, " %-24s %-24s 0x%08x",
@@ -315,13 +332,15 @@ apm_find(const struct disk *disk, int64_t start, int64_t size,
     {
         if(up_disk_check1sect(disk, start + off + APM_OFFSET))
             return 0;
-        buf = up_disk_getsect(disk, start + off + APM_OFFSET);
-        if(!buf)
+        /* a sector in a hole is all zeros and can't have the magic */
+        if(up_disk_ishole(disk, start + off + APM_OFFSET, 1))
+            buf = NULL;
+        else if(!(buf = up_disk_getsect(disk, start + off + APM_OFFSET)))
             return -1;
-        if(APM_MAGIC != UP_BETOH16(buf->sig))
+        if(!buf || APM_MAGIC != UP_BETOH16(buf->sig))
         {
-            if(off && UP_NOISY(QUIET))
-                up_err("could not find %s partition in sectors %"
+            if(off && UP_NOISY(disk->ctx, QUIET))
+                up_err(disk->ctx, "could not find %s partition in sectors %"
                        PRId64" to %"PRId64, APM_MAP_PART_TYPE,
                        start + APM_OFFSET, start + off + APM_OFFSET);
             return 0;
@@ -333,13 +352,13 @@ apm_find(const struct disk *disk, int64_t start, int64_t size,
             if(start + APM_OFFSET != pstart || off > blocks ||
                blocks > psize || pstart + psize > start + size)
             {
-                if(UP_NOISY(QUIET))
-                    up_msg((opts->relaxed ? UP_MSG_FWARN : UP_MSG_FERR),
+                if(UP_NOISY(disk->ctx, QUIET))
+                    up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, relaxed),
                            "invalid apple partition map in sector %"PRId64
                            "+%d, %s partition in sector %"
                            PRId64, start, APM_OFFSET, APM_MAP_PART_TYPE,
                            start + off + APM_OFFSET);
-                if(!opts->relaxed)
+                if(!disk->ctx->opts.relaxed)
                     return 0;
             }
             if(up_disk_checksectrange(disk, start + APM_OFFSET, blocks))
@@ -17,7 +17,9 @@
 #ifndef HDR_UPART_APM
 #define HDR_UPART_APM
 
+struct up_ctx;
+
 /* register apple partition map type */
-void up_apm_register(void);
+void up_apm_register(struct up_ctx *);
 
 #endif /* HDR_UPART_APM */
@@ -0,0 +1,17 @@
+# -*-Makefile-*-
+# auto.mk.  Generated from auto.mk.in by configure.
+
+CC           = gcc
+CFLAGS       = -g -O2 -Wall  -DHAVE_CONFIG_H
+DEPFLAGS     = -M
+LDFLAGS      = 
+LIBS         = 
+prefix       = /usr/local
+exec_prefix  = ${prefix}
+datarootdir  = ${prefix}/share
+bindir       = ${exec_prefix}/bin
+mandir       = ${datarootdir}/man
+INSTALL      = /usr/bin/install -c
+INSTALL_PROG = ${INSTALL} -m 755
+INSTALL_DATA = ${INSTALL} -m 644
+MKDIR_P      = /usr/bin/mkdir -p
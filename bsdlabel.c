@@ -212,6 +212,8 @@ static char *up_fstypes[] =
 
 static int	bsdlabel_load(const struct disk *, const struct part *,
     void **);
+static void	bsdlabel_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	bsdlabel_setup(struct disk *, struct map *);
 static int bsdlabel_getpart_v0(struct map *, struct up_bsdpart *,
     const uint8_t *);
@@ -230,13 +232,30 @@ static int	bsdlabel_read(const struct disk *, int64_t,
 static uint16_t bsdlabel_cksum(struct up_bsd_p *hdr,
                                const uint8_t *partitions, int size);
 
-void up_bsdlabel_register(void)
+/*
+  The label may be anywhere in the first few sectors. On disks with
+  big sectors the sector bug scan looks elsewhere, so always probe.
+*/
+static const struct map_sig bsdlabel_sigs[] = {
+	{ 0, 0, "\x82\x56\x45\x57", 4, MAP_SIG_ANYOFF | MAP_SIG_ONLY512 },
+	{ 0, 0, "\x57\x45\x56\x82", 4, MAP_SIG_ANYOFF | MAP_SIG_ONLY512 },
+	{ 1, 0, "\x82\x56\x45\x57", 4, MAP_SIG_ANYOFF | MAP_SIG_ONLY512 },
+	{ 1, 0, "\x57\x45\x56\x82", 4, MAP_SIG_ANYOFF | MAP_SIG_ONLY512 },
+	{ 2, 0, "\x82\x56\x45\x57", 4, MAP_SIG_ANYOFF | MAP_SIG_ONLY512 },
+	{ 2, 0, "\x57\x45\x56\x82", 4, MAP_SIG_ANYOFF | MAP_SIG_ONLY512 },
+	{ 0 }
+};
+
+void up_bsdlabel_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = LABEL_LABEL;
+	funcs.name = "bsd";
 	funcs.load = bsdlabel_load;
+	funcs.footprint = bsdlabel_footprint;
+	funcs.sigs = bsdlabel_sigs;
 	funcs.setup = bsdlabel_setup;
 	funcs.print_header = bsdlabel_info;
 	funcs.get_index = bsdlabel_index;
@@ -244,7 +263,7 @@ void up_bsdlabel_register(void)
 	funcs.print_extra = bsdlabel_extra;
 	funcs.dump_extra = bsdlabel_dump;
 
-	up_map_register(UP_MAP_BSD, &funcs);
+	up_map_register(ctx, UP_MAP_BSD, &funcs);
 }
 
 static int
@@ -274,7 +293,7 @@ bsdlabel_load(const struct disk *disk, const struct part *parent, void **priv)
 	assert(physaddr >= LABEL_BUG_ADJUST(disk, UP_PART_PHYSADDR(parent)));
 
 	/* allocate label struct */
-	if ((label = xalloc(1, sizeof(*label), XA_ZERO)) == NULL)
+	if ((label = up_map_alloc(disk, sizeof(*label))) == NULL)
 		return (-1);
 
 	/* populate label struct */
@@ -288,18 +307,20 @@ bsdlabel_load(const struct disk *disk, const struct part *parent, void **priv)
 	label->version = LABEL_LGETINT16(label, obsd_version);
 
 	/* warn about the big sector bug */
-	if (bugflags & LABEL_BUG_BADLABEL && UP_NOISY(QUIET)) {
+	if (bugflags & LABEL_BUG_BADLABEL && UP_NOISY(disk->ctx, QUIET)) {
 		if (bugflags & LABEL_BUG_USEBADLABEL) {
 			assert(label->startsect == LABEL_BUG_ADJUST(disk,
 				UP_PART_VIRTADDR(parent)));
-			up_warn("%d-byte sector bug: using misplaced %s at "
+			up_warn(disk->ctx,
+			    "%d-byte sector bug: using misplaced %s at "
 			    "sector %"PRId64" (offset %d), should be at "
 			    "sector %"PRId64,
 			    UP_DISK_1SECT(disk), LABEL_LABEL, label->startsect,
 			    label->sectoff, UP_PART_VIRTADDR(parent));
 		} else {
 			assert(label->startsect == UP_PART_VIRTADDR(parent));
-			up_warn("%d-byte sector bug: ignoring misplaced %s at "
+			up_warn(disk->ctx,
+			    "%d-byte sector bug: ignoring misplaced %s at "
 			    "sector %"PRId64" (offset %d)",
 			    UP_DISK_1SECT(disk), LABEL_LABEL,
 			    LABEL_BUG_ADJUST(disk, label->startsect),
@@ -311,11 +332,11 @@ bsdlabel_load(const struct disk *disk, const struct part *parent, void **priv)
 	size = LABEL_BASE_SIZE + (LABEL_PART_SIZE *
 	    LABEL_LGETINT16(label, maxpart));
 	if (byteoff + size > UP_DISK_1SECT(disk)) {
-		if (UP_NOISY(QUIET))
-			up_err("ignoring truncated %s in sector %"PRId64" "
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx,
+			    "ignoring truncated %s in sector %"PRId64" "
 			    "(offset %d)",
 			    LABEL_LABEL, label->startsect, label->sectoff);
-		free(label);
 		return (-1);
 	}
 
@@ -324,6 +345,15 @@ bsdlabel_load(const struct disk *disk, const struct part *parent, void **priv)
 	return (1);
 }
 
+static void
+bsdlabel_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	/* the openbsd bug check also reads elsewhere, which can't be helped */
+	*head = LABEL_PROBE_SECTS;
+	*tail = 0;
+}
+
 static int
 bsdlabel_setup(struct disk *disk, struct map *map)
 {
@@ -355,26 +385,24 @@ bsdlabel_setup(struct disk *disk, struct map *map)
 	/* verify the checksum */
 	if (bsdlabel_cksum(&label->label, buf, (LABEL_PART_SIZE * max)) !=
 	    label->label.checksum) {
-		if (UP_NOISY(QUIET))
-			up_msg((opts->relaxed ? UP_MSG_FWARN : UP_MSG_FERR),
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, relaxed),
 			    "%s with bad checksum in sector %"PRId64" "
 			    "(offset %d)", up_map_label(map), label->startsect,
 			    label->sectoff);
-		if (!opts->relaxed)
+		if (!disk->ctx->opts.relaxed)
 			return (0);
 	}
 
 	getpart = (label->version == 0 ?
 	    bsdlabel_getpart_v0 : bsdlabel_getpart_v1);
 	for (i = 0; i < max; i++) {
-		if ((part = xalloc(1, sizeof(*part), XA_ZERO)) == NULL)
+		if ((part = up_map_alloc(disk, sizeof(*part))) == NULL)
 			return (-1);
 
 		part->index = i;
-		if (!getpart(map, part, buf + (LABEL_PART_SIZE * i))) {
-			free(part);
+		if (!getpart(map, part, buf + (LABEL_PART_SIZE * i)))
 			return (-1);
-		}
 	}
 
 	return (1);
@@ -430,24 +458,25 @@ bsdlabel_info(const struct map *map, FILE *stream)
 	char *disktypestr;
 	int uid, i;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = map->priv;
 
 	if (fprintf(stream, "%s at ", (priv->version > 0 ?
 		    "OpenBSD disklabel" : up_map_label(map))) < 0 ||
-	    printsect_verbose(priv->startsect, stream) < 0 ||
+	    up_printsect_verbose(map->disk, priv->startsect, stream) < 0 ||
 	    fprintf(stream, " (offset %d) of %s",
 		priv->sectoff, UP_DISK_PATH(map->disk)) < 0 ||
 	    (priv->bugs & LABEL_BUG_USEBADLABEL &&
 		(fputs(" (should be at ", stream) == EOF ||
-		printsect_verbose(UP_MAP_VIRTADDR(map), stream) < 0 ||
+		up_printsect_verbose(map->disk, UP_MAP_VIRTADDR(map),
+		    stream) < 0 ||
 		fputs(")", stream) == EOF)) ||
 	    fputs(":\n", stream) == EOF)
 		return (-1);
 
-	if (!UP_NOISY(EXTRA))
+	if (!UP_NOISY(map->disk->ctx, EXTRA))
 		return (1);
 
 	if (priv->version > 0 &&
@@ -495,7 +524,7 @@ bsdlabel_info(const struct map *map, FILE *stream)
 		sectcount) < 0)
 		return (-1);
 
-        if (UP_NOISY(SPAM)) {
+        if (UP_NOISY(map->disk->ctx, SPAM)) {
 		if (uid && fprintf(stream,
 			"  alternate cylinders: %u\n",
 			LABEL_LGETINT32(priv, u_uid.s_uid.uid_altcyls)) < 0)
@@ -567,7 +596,7 @@ bsdlabel_extrahdr(const struct map *map, FILE *stream)
 {
 	const char *hdr;
 
-	hdr = UP_BSDLABEL_FMT_HDR();
+	hdr = UP_BSDLABEL_FMT_HDR(map->disk->ctx);
 	if (hdr == NULL)
 		return (0);
         return (fprintf(stream, " %s", hdr));
@@ -645,7 +674,7 @@ bsdlabel_read(const struct disk *disk, int64_t start, int64_t size,
 	if (size <= 0)
 		return (0);
 
-	if (up_disk_check1sect(disk, start))
+	if (up_disk_check1sect(disk, start) || up_disk_ishole(disk, start, 1))
 		return (0);
 	buf = up_disk_getsect(disk, start);
 	if (!buf)
@@ -723,18 +752,19 @@ up_bsdlabel_fmt(const struct part *part, int type,
 {
 	const char *typestr;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (0);
 
 	typestr = up_bsdlabel_fstype(type);
 
 	if (NULL == typestr)
 		return (fprintf(stream, " %u", type));
-	else if (UP_NOISY(EXTRA) &&
+	else if (UP_NOISY(part->map->disk->ctx, EXTRA) &&
 	    UP_BSDLABEL_FSTYPE_UNUSED == type && part->size)
 		return (fprintf(stream, " %-7s %5u %5u",
 			typestr, fsize, fsize * frags));
-	else if(UP_NOISY(EXTRA) && UP_BSDLABEL_FSTYPE_42BSD == type)
+	else if(UP_NOISY(part->map->disk->ctx, EXTRA) &&
+	    UP_BSDLABEL_FSTYPE_42BSD == type)
 		return (fprintf(stream, " %-7s %5u %5u %5u",
 			typestr, fsize, fsize * frags, cpg));
 	else
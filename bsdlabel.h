@@ -19,8 +19,10 @@
 
 struct part;
 
+struct up_ctx;
+
 /* register BSD disklabel partition map type */
-void up_bsdlabel_register(void);
+void up_bsdlabel_register(struct up_ctx *);
 
 #define UP_BSDLABEL_FSTYPE_UNUSED       (0)
 #define UP_BSDLABEL_FSTYPE_42BSD        (7)
@@ -28,9 +30,9 @@ void up_bsdlabel_register(void);
 #define OBSDLABEL_BF_BSIZE(bf)	((bf) ? 1 << (((bf) >> 3) + 12) : 0)
 #define OBSDLABEL_BF_FRAG(bf)	((bf) ? 1 << (((bf) & 7) - 1) : 0)
 
-#define UP_BSDLABEL_FMT_HDR() \
-    (UP_NOISY(EXTRA) ? "Type    fsize bsize   cpg" : \
-     (UP_NOISY(NORMAL) ? "Type" :  NULL))
+#define UP_BSDLABEL_FMT_HDR(ctx) \
+    (UP_NOISY((ctx), EXTRA) ? "Type    fsize bsize   cpg" : \
+     (UP_NOISY((ctx), NORMAL) ? "Type" :  NULL))
 
 const char *up_bsdlabel_fstype(int type);
 int	up_bsdlabel_fmt(const struct part *, int, uint32_t, int, int, FILE *);
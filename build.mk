@@ -1,7 +1,8 @@
 
 all: $(ALL_PROGS)
 
-.PHONY: all clean clean-tests cleaner cleanest check regress regen-tests
+.PHONY: all bench clean clean-tests cleaner cleanest check lib regress \
+	regen-tests
 
 install: all
 	$(MKDIR_P) $(DESTDIR)$(bindir)
@@ -10,17 +11,28 @@ install: all
 	$(INSTALL_DATA) upart.8 $(DESTDIR)$(mandir)/man8
 
 upart$(EXE_SUF): $(UPART_OBJS)
-	$(CC) $(LDFLAGS) $(LIBS) -o $@ $(UPART_OBJS)
+	$(CC) $(LDFLAGS) -o $@ $(UPART_OBJS) $(LIBS)
 
-$(REGRESS_BIN): $(REGRESS_SRC) getopt.c util.h
-	$(CC) $(CFLAGS) -I. -o $@ $(REGRESS_SRC) getopt.c
+lib: $(LIB_TARGETS)
+
+$(LIB_STATIC): $(LIB_OBJS)
+	$(AR_CMD) $(AR_OUT)$@ $(LIB_OBJS)
+
+$(LIB_SHARED): $(LIB_SRCS) $(ALL_HDRS)
+	$(CC) $(CFLAGS) $(SHLIB_FLAGS) $(LDFLAGS) -o $@ $(LIB_SRCS) $(LIBS)
+
+$(REGRESS_BIN): $(REGRESS_SRC) crc32.c getopt.c crc32.h util.h
+	$(CC) $(CFLAGS) -I. -o $@ $(REGRESS_SRC) crc32.c getopt.c
+
+$(BENCH_BIN): $(BENCH_SRC) $(LIB_STATIC) getopt.c crc32.h upart.h util.h
+	$(CC) $(CFLAGS) -I. -o $@ $(BENCH_SRC) getopt.c $(LIB_STATIC) $(LIBS)
 
 clean:
-	$(RM_CMD) .depend $(ALL_PROGS) $(ALL_OBJS)
+	$(RM_CMD) .depend $(ALL_PROGS) $(LIB_TARGETS) $(ALL_OBJS)
 
 clean-tests: $(REGRESS_BIN)
 	$(REGRESS_CMD) -c
-	$(RM_CMD) $(REGRESS_BIN)
+	$(RM_CMD) $(REGRESS_BIN) $(BENCH_BIN)
 
 cleaner: clean clean-tests
 	$(RM_CMD) config.cache config.h config.log config.status auto.mk
@@ -33,3 +45,5 @@ check regress: upart$(EXE_SUF) $(REGRESS_BIN)
 
 regen-tests: $(REGRESS_BIN)
 	$(REGRESS_CMD) -r
+
+bench: upart$(EXE_SUF) $(BENCH_BIN)
@@ -40,3 +40,4 @@ typedef uint64_t uintmax_t;
 
 #define snprintf _snprintf
 #define fseeko _fseeki64
+#define ftello _ftelli64
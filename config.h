@@ -0,0 +1,88 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* -*-c-*- */
+#ifndef HDR_UP_CONFIG
+#define HDR_UP_CONFIG
+
+#define PACKAGE_NAME "upart"
+#define PACKAGE_VERSION "0.3.2"
+
+#define OS_TYPE_UNIX 1
+
+/* linux is great */
+#define _GNU_SOURCE 1
+/* #undef _FILE_OFFSET_BITS */
+/* #undef _LARGE_FILES */
+
+/* standard headers */
+#define HAVE_SYS_TYPES_H 1
+#define HAVE_SYS_PARAM_H 1
+#define HAVE_SYS_IOCTL_H 1
+#define HAVE_SYS_MMAN_H 1
+#define HAVE_SYS_STAT_H 1
+#define HAVE_SYS_WAIT_H 1
+#define HAVE_DIRENT_H 1
+#define HAVE_ERRNO_H 1
+#define HAVE_FCNTL_H 1
+#define HAVE_INTTYPES_H 1
+#define HAVE_STDINT_H 1
+#define HAVE_UNISTD_H 1
+
+/* standard functions */
+#define HAVE_GETOPT 1
+#define HAVE_PREAD 1
+
+/* threads, for read deadlines */
+#define HAVE_PTHREAD_H 1
+#define HAVE_PTHREAD_CONDATTR_SETCLOCK 1
+
+/* bsd disklabel */
+/* #undef HAVE_SYS_DISKLABEL_H */
+
+/* bsd and solaris disk ioctls */
+/* #undef HAVE_SYS_DKIO_H */
+
+/* solaris vtoc */
+/* #undef HAVE_SYS_VTOC_H */
+
+/* freebsd disk ioctls */
+/* #undef HAVE_SYS_DISK_H */
+
+/* libutil, for opendisk() */
+/* #undef HAVE_UTIL_H */
+/* #undef HAVE_OPENDISK */
+/* #undef HAVE_OPENDEV */
+
+/* linux disk ioctls and asynchronous io */
+#define HAVE_LINUX_FS_H 1
+#define HAVE_LINUX_HDREG_H 1
+#define HAVE_LINUX_IO_URING_H 1
+#define HAVE_SYS_SYSMACROS_H 1
+
+/* sysctl, for listing disks on bsd */
+/* #undef HAVE_SYS_SYSCTL_H */
+/* #undef HAVE_SYSCTL */
+/* #undef HAVE_SYSCTLNAMETOMIB */
+
+/* osx iokit stuff for listing disks */
+/* #undef HAVE_COREFOUNDATION_COREFOUNDATION_H */
+/* #undef HAVE_IOKIT_IOKITLIB_H */
+/* #undef HAVE_IOKIT_IOBSD_H */
+/* #undef HAVE_IOKIT_STORAGE_IOMEDIA_H */
+
+/* sane string functions */
+/* #undef HAVE_STRLCPY */
+/* #undef HAVE_STRLCAT */
+
+/* it's kind of bogus to include these here but I'd rather not look at
+   this ugly mess of #ifdefs at the top of every single file */
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+#endif /* HDR_UP_CONFIG */
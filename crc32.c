@@ -98,10 +98,11 @@ static const uint32_t crc32tab[] = {
 };
 
 uint32_t
-up_crc32(const void *_buf, uint32_t size, uint32_t seed)
+up_crc32(const void *_buf, size_t size, uint32_t seed)
 {
 	const uint8_t *buf = _buf;
-	uint32_t i, crc;
+	uint32_t crc;
+	size_t i;
 
 	crc = seed;
 	for (i = 0; i < size; i++)
@@ -26,5 +26,5 @@
 
 #ifndef UP_CRC32_H
 #define UP_CRC32_H
-uint32_t	 up_crc32(const void *, uint32_t, uint32_t);
+uint32_t	 up_crc32(const void *, size_t, uint32_t);
 #endif
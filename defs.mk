@@ -1,16 +1,27 @@
 RM_CMD        = rm -f
+AR_CMD        = ar rcs
+AR_OUT        =
+SHLIB_FLAGS   = -fPIC -shared
 EXE_SUF       =
 
 ALL_PROGS     = upart$(EXE_SUF)
 ALL_SRCS      = $(UPART_SRCS)
 ALL_HDRS      = $(UPART_HDRSRC:.=.h) bsdqueue.h os-private.h
-UPART_SRCS    = $(UPART_HDRSRC:.=.c) getopt.c main.c os-bsd.c os-darwin.c \
-		os-haiku.c os-linux.c os-solaris.c os-unix.c os-windows.c
+UPART_SRCS    = $(LIB_SRCS) getopt.c main.c
 UPART_HDRSRC  = apm. bsdlabel. crc32. disk. gpt. img. map. md5. mbr. os. \
-		softraid. sunlabel-shared. sunlabel-sparc. sunlabel-x86. util.
+		softraid. sunlabel-shared. sunlabel-sparc. sunlabel-x86. \
+		upart. util.
+LIB_SRCS      = $(UPART_HDRSRC:.=.c) os-bsd.c os-darwin.c os-haiku.c \
+		os-linux.c os-solaris.c os-unix.c os-windows.c
+LIB_STATIC    = libupart.a
+LIB_SHARED    = libupart.so
+LIB_TARGETS   = $(LIB_STATIC) $(LIB_SHARED)
 REGRESS_SRC   = tests/tester.c
 REGRESS_BIN   = tests/tester
 REGRESS_CMD   = ./$(REGRESS_BIN)
+BENCH_SRC     = tests/bench.c
+BENCH_BIN     = tests/bench
 
 UPART_OBJS    = $(UPART_SRCS:.c=.o)
+LIB_OBJS      = $(LIB_SRCS:.c=.o)
 ALL_OBJS      = $(ALL_SRCS:.c=.o)
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bsdqueue.h"
 #include "disk.h"
 #include "img.h"
 #include "map.h"
@@ -30,53 +31,227 @@
 #include "util.h"
 
 /* #define DEBUG_SECTOR_SAVE */
+/* #define DEBUG_SECTOR_CACHE */
 
-static enum disk_type open_thing(const char *, union disk_handle *,
-    const char **);
+/* upper bound on the amount of data held in the sector cache */
+#define DISK_CACHE_BYTES	(4 * 1024 * 1024)
+/* cache misses are rounded out to a multiple of this many bytes */
+#define DISK_CACHE_FILLBYTES	(4096)
+/* images and mapped files are already in memory and aren't cached */
+#define DISK_CACHED(disk) \
+	((disk)->type != DT_IMAGE && (disk)->filemap == NULL)
+/* upper bound on the optimal i/o size used when filling the cache */
+#define DISK_CACHE_MAXFILL	(64 * 1024)
+/* reads from devices are abandoned if they pass a deadline */
+#define DISK_DEADLINES(disk) \
+	((disk)->ctx->opts.readtimeout > 0 || (disk)->ctx->opts.disktimeout > 0)
+/* the cache is shared by threads probing partitions in parallel */
+#define DISK_THREADED(disk)	((disk)->ctx->opts.jobs > 1)
+/* maximum number of reads queued by up_disk_submit() */
+#define DISK_AIO_DEPTH		(32)
+/* number of items allocated at once by a pool */
+#define DISK_POOL_CHUNK		(256)
+/* number of ranges in the subtree rooted at a saved range */
+#define SECT_SUBTREE(sect)	((sect) == NULL ? 0 : (sect)->subtree)
+
+/* a reference counted buffer of sector data */
+struct disk_buf {
+	int refs;
+	void *mem;
+};
+
+struct disk_cache_ent {
+	int64_t first;
+	int64_t last;
+	uint8_t *data;
+	struct disk_buf *buf;		/* buffer holding data */
+	RB_ENTRY(disk_cache_ent) link;
+	TAILQ_ENTRY(disk_cache_ent) lru;
+};
+
+RB_HEAD(disk_cache_map, disk_cache_ent);
+TAILQ_HEAD(disk_cache_lru, disk_cache_ent);
+
+/* a range of sectors with data allocated in a sparse file */
+struct disk_extent {
+	int64_t first;
+	int64_t last;
+};
+
+/* a range of sectors which failed to read, or were counted for -R */
+struct disk_range {
+	int64_t first;
+	int64_t last;
+	RB_ENTRY(disk_range) link;
+};
+
+RB_HEAD(disk_range_map, disk_range);
+
+/*
+  A trivial allocator for small fixed-size items. Items are carved
+  out of chunks which are only freed all at once, and freed items
+  are linked through their first pointer for reuse.
+*/
+struct disk_pool {
+	size_t size;			/* size of one item */
+	int left;			/* unused items in the newest chunk */
+	void *chunks;			/* chunks linked through first item */
+	void *free;			/* freed items */
+};
+
+/* all the ranges saved by one map */
+struct disk_sectref {
+	const void *ref;
+	struct disk_sect *sects;	/* linked through refnext */
+	RB_ENTRY(disk_sectref) link;
+};
+
+RB_HEAD(disk_sectref_map, disk_sectref);
+
+struct disk_sectidx {
+	struct disk_sectref_map refs;
+	struct disk_sectref *lastref;	/* most recently used owner */
+	struct disk_pool sectpool;
+	struct disk_pool refpool;
+};
+
+struct disk_cache {
+	struct disk_cache_map map;
+	struct disk_cache_lru lru;	/* least recently used first */
+	int64_t count;			/* number of sectors cached */
+	int64_t max;			/* maximum number of sectors cached */
+	int64_t align;			/* sectors to round misses out to */
+	int64_t dioblock;		/* block size for direct i/o, or 0 */
+	os_aio aio;			/* queue for up_disk_submit() */
+	int pending;			/* reads submitted but not reaped */
+	struct disk_buf *lastsect;	/* returned by up_disk_getsect() */
+	struct disk_range_map bad;	/* sectors known to be unreadable */
+	int64_t deadline;		/* os_msecs() to stop reading at */
+	int degraded;			/* a deadline passed, stop reading */
+	int64_t charged;		/* sectors read, see maxsects */
+	struct disk_range_map seen;	/* sectors charged if uncached */
+	int64_t refused;		/* reads too big for what's left */
+	int wasrefused;			/* see up_disk_wasrefused() */
+	struct disk_stats stats;
+	os_lock lock;			/* held while using any of the above */
+};
+
+static enum disk_type open_thing(struct disk *, char **);
 static int	fixparams(struct disk *, const struct disk_params *);
 static int	fixparams_checkone(struct disk_params *disk);
+static int64_t	disk_read(const struct disk *, int64_t, int64_t, void *,
+    size_t);
+static const void *disk_getsect(const struct disk *, int64_t);
+static const void *disk_savesectrange(struct disk *, int64_t, int64_t,
+    const struct map *, int);
+static int	disk_wait(const struct disk *);
+static int	disk_charge(const struct disk *, int64_t, int64_t);
+static int	disk_affordable(const struct disk *, int64_t, int64_t);
+static int64_t	disk_cost(const struct disk *, int64_t, int64_t);
+static ssize_t	disk_rawread(const struct disk *, int64_t, int64_t, void *);
+static ssize_t	disk_directread(const struct disk *, void *, size_t, int64_t);
+static ssize_t	disk_devread(const struct disk *, void *, size_t, int64_t);
+static void	disk_readerr(const struct disk *, int64_t, int64_t);
+static int64_t	disk_salvage(const struct disk *, int64_t, int64_t, uint8_t *);
+static int64_t	disk_readaround(const struct disk *, int64_t, int64_t,
+    uint8_t *);
+static void	disk_fillaround(const struct disk *, int64_t, int64_t,
+    uint8_t *);
+static int	disk_tryread(const struct disk *, int64_t, int64_t, uint8_t *);
+static ssize_t	disk_fileread(const struct disk *, int64_t, int64_t, uint8_t *);
+static int	disk_findholes(struct disk *);
+static int	disk_addextent(int64_t, int64_t, void *);
+static int	disk_extentidx(const struct disk *, int64_t);
+static int	bad_check(const struct disk *, int64_t, int64_t);
+static void	bad_add(const struct disk *, int64_t);
+static struct disk_range *bad_first(const struct disk *, int64_t, int64_t);
+static int64_t	seen_count(const struct disk *, int64_t, int64_t);
+static void	seen_add(const struct disk *, int64_t, int64_t);
+static struct disk_buf *buf_new(const struct disk *, size_t, uint8_t **);
+static struct disk_buf *buf_ref(struct disk_buf *);
+static void	buf_unref(struct disk_buf *);
+static const uint8_t *disk_mapped(const struct disk *, int64_t, int64_t);
+static struct disk_cache *cache_new(const struct disk *);
+static void	cache_free(struct disk_cache *);
+static struct disk_cache_ent *cache_find(struct disk_cache *, int64_t,
+    int64_t);
+static struct disk_cache_ent *cache_get(const struct disk *, int64_t,
+    int64_t);
+static struct disk_cache_ent *cache_fill(const struct disk *, int64_t,
+    int64_t);
+static struct disk_cache_ent *cache_newent(const struct disk *, int64_t,
+    int64_t, int);
+static struct disk_cache_ent *cache_insert(const struct disk *,
+    struct disk_cache_ent *, ssize_t);
+static void	cache_evict(struct disk_cache *, struct disk_cache_ent *);
+static void	cache_freeent(struct disk_cache_ent *);
+static void	pool_init(struct disk_pool *, size_t);
+static void	*pool_get(struct disk_pool *);
+static void	pool_put(struct disk_pool *, void *);
+static void	pool_destroy(struct disk_pool *);
+static struct disk_sectidx *sectidx_new(void);
+static void	sectidx_free(struct disk_sectidx *);
+static struct disk_sectref *sectidx_getref(struct disk_sectidx *,
+    const void *, int);
+static void	sect_augment(struct disk_sect *);
+static void	sect_fixup(struct disk_sect *);
 static int	sectcmp(struct disk_sect *, struct disk_sect *);
+static int	sectrefcmp(struct disk_sectref *, struct disk_sectref *);
+static int	cachecmp(struct disk_cache_ent *, struct disk_cache_ent *);
+static int	rangecmp(struct disk_range *, struct disk_range *);
 
-RB_GENERATE_STATIC(disk_sect_map, disk_sect, link, sectcmp)
-
-static struct disk *st_curdisk;
+RB_GENERATE_STATIC(disk_cache_map, disk_cache_ent, link, cachecmp)
+RB_GENERATE_STATIC(disk_range_map, disk_range, link, rangecmp)
+RB_GENERATE_STATIC(disk_sectref_map, disk_sectref, link, sectrefcmp)
 
-struct disk *
-current_disk(void)
-{
-	return (st_curdisk);
-}
+/* keep the subtree counts used by up_disk_nthsect() up to date */
+#undef RB_AUGMENT
+#define RB_AUGMENT(x)	sect_augment(x)
+RB_GENERATE_STATIC(disk_sect_map, disk_sect, link, sectcmp)
+#undef RB_AUGMENT
+#define RB_AUGMENT(x)	(void)(x)
 
 struct disk *
-up_disk_open(const char *name)
+up_disk_open(struct up_ctx *ctx, const char *name)
 {
 	struct disk *disk;
-	const char *path;
+	char *path;
 
  	/* allocate disk struct */
-	if ((disk = xalloc(1, sizeof(*disk), 0)) == NULL)
+	if ((disk = up_xalloc(1, sizeof(*disk), 0)) == NULL)
 		return (NULL);
-	if ((disk->name = xstrdup(name, 0)) == NULL) {
+	if ((disk->name = up_xstrdup(name, 0)) == NULL) {
 		free(disk);
 		return (NULL);
 	}
+	disk->ctx = ctx;
 	disk->path = NULL;
 	memset(&disk->params, 0, sizeof(disk->params));
 	disk->setup_done = 0;
 	disk->buf = NULL;
+	disk->filemap = NULL;
+	disk->filemaplen = 0;
+	disk->extents = NULL;
+	disk->extentcount = -1;
+	disk->cache = NULL;
 	disk->maps = NULL;
+	disk->arena = NULL;
+	disk->memo = NULL;
 	RB_INIT(&disk->sectsused);
 	disk->sectsused_count = 0;
+	disk->sectidx = NULL;
 
 	/* open device */
-	disk->type = open_thing(name, &disk->handle, &path);
+	path = NULL;
+	disk->type = open_thing(disk, &path);
+	disk->path = path;
 	if (disk->type == DT_UNKNOWN ||
-	    (disk->path = xstrdup((path ? path : name), 0)) == NULL) {
+	    (disk->sectidx = sectidx_new()) == NULL ||
+	    (path == NULL && (disk->path = up_xstrdup(name, 0)) == NULL)) {
 		up_disk_close(disk);
 		return (NULL);
 	}
 
-	st_curdisk = disk;
 	return (disk);
 }
 
@@ -92,10 +267,11 @@ up_disk_setup(struct disk *disk, const struct disk_params *params)
 		break;
 	case DT_DEVICE:
 		/* try to get drive parameters via OS-dependent interfaces */
-		if (os_dev_params(disk->handle.dev, &disk->params,
+		if (os_dev_params(disk->ctx, disk->handle.dev, &disk->params,
 			UP_DISK_PATH(disk)) < 0) {
-			if (UP_NOISY(QUIET))
-				up_err("failed to determine disk parameters "
+			if (UP_NOISY(disk->ctx, QUIET))
+				up_err(disk->ctx,
+				    "failed to determine disk parameters "
 				    "for %s: %s",
 				    UP_DISK_PATH(disk), os_lasterrstr());
 			return (-1);
@@ -104,6 +280,13 @@ up_disk_setup(struct disk *disk, const struct disk_params *params)
 		    UP_DISK_PATH(disk));
 		break;
 	case DT_FILE:
+		/* map the file if possible, otherwise pread() is used */
+		disk->filemaplen = os_file_size(disk->handle.file);
+		if (!disk->ctx->opts.directio)
+			disk->filemap = os_file_map(disk->handle.file,
+			    disk->filemaplen);
+		if (disk->filemap == NULL)
+			disk->filemaplen = 0;
 		break;
 	default:
 		assert(!"unknown disk type");
@@ -112,14 +295,22 @@ up_disk_setup(struct disk *disk, const struct disk_params *params)
 
 	/* try to fill in missing drive paramaters */
 	if (fixparams(disk, params) < 0) {
-		if (UP_NOISY(QUIET))
-			up_err("failed to determine disk parameters for %s",
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx,
+			    "failed to determine disk parameters for %s",
 			    UP_DISK_PATH(disk));
 		return (-1);
 	}
 
+	/* find any holes in sparse files so they needn't be read */
+	if (disk->type == DT_FILE && disk_findholes(disk) < 0)
+		return (-1);
+
 	assert(disk->buf == NULL);
-	if ((disk->buf = xalloc(1, UP_DISK_1SECT(disk), 0)) == NULL)
+	if ((disk->buf = up_xalloc(1, UP_DISK_1SECT(disk), 0)) == NULL)
+		return (-1);
+	assert(disk->cache == NULL);
+	if ((disk->cache = cache_new(disk)) == NULL)
 		return (-1);
 
 	disk->setup_done = 1;
@@ -130,8 +321,22 @@ int64_t
 up_disk_read(const struct disk *disk, int64_t sect_off, int64_t sect_count,
     void *buf, size_t bufsize)
 {
+	int64_t res;
+
+	os_lock_acquire(disk->cache->lock);
+	res = disk_read(disk, sect_off, sect_count, buf, bufsize);
+	os_lock_release(disk->cache->lock);
+
+	return (res);
+}
+
+static int64_t
+disk_read(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    void *buf, size_t bufsize)
+{
+	struct disk_cache_ent *ent;
 	size_t byte_count;
-	int64_t byte_off;
+	int64_t avail;
 	ssize_t res;
 
 	/* validate and fixup arguments */
@@ -144,30 +349,594 @@ up_disk_read(const struct disk *disk, int64_t sect_off, int64_t sect_count,
 		return (0);
 	if (INT64_MAX / UP_DISK_1SECT(disk) < sect_off ||
 	    SIZE_MAX / UP_DISK_1SECT(disk) < sect_count) {
-		up_err("failed to read from disk: address out of range");
+		up_err(disk->ctx,
+		    "failed to read from disk: address out of range");
+		return (-1);
+	}
+	byte_count = sect_count * UP_DISK_1SECT(disk);
+
+	/* try the cache first, then try to fill it from the disk */
+	if ((ent = cache_get(disk, sect_off, sect_count)) != NULL) {
+		avail = MIN(sect_count, ent->last - sect_off + 1);
+		memcpy(buf, ent->data +
+		    (sect_off - ent->first) * UP_DISK_1SECT(disk),
+		    avail * UP_DISK_1SECT(disk));
+		return (avail);
+	}
+
+	/* a deadline passed and the error has already been reported */
+	if (disk->cache->degraded)
+		return (-1);
+
+	/* leave what's left of the -R limit for smaller reads */
+	if (!disk_affordable(disk, sect_off, sect_count)) {
+		if (disk->cache->refused++ == 0 && UP_NOISY(disk->ctx, QUIET))
+			up_warn(disk->ctx, "not reading more than %"PRId64
+			    " sector(s) from %s", disk->ctx->opts.maxsects,
+			    UP_DISK_PATH(disk));
+		disk->cache->wasrefused = 1;
+		return (-1);
+	}
+
+	/*
+	  Don't wait for the device to fail on sectors it already has.
+	  They were reported when they were found, so don't again.
+	*/
+	if (bad_check(disk, sect_off, sect_count)) {
+		if (!disk->ctx->opts.sloppyio)
+			return (-1);
+		return (disk_readaround(disk, sect_off, sect_count, buf));
+	}
+
+	/* the read was too big to cache or failed, try it uncached */
+	res = disk_rawread(disk, sect_off, sect_count, buf);
+	if (res < 0 && disk->cache->degraded)
+		return (-1);
+	if (res < 0) {
+		disk_readerr(disk, sect_off, sect_count);
+		if (sect_count == 1)
+			bad_add(disk, sect_off);
+		if (!disk->ctx->opts.sloppyio)
+			return (-1);
+		disk_salvage(disk, sect_off, sect_count, buf);
+		if (disk->cache->degraded)
+			return (-1);
+		res = byte_count;
+	}
+
+	return (res / UP_DISK_1SECT(disk));
+}
+
+/*
+  Report a failed read, as a warning with -k. The sectors found bad
+  while salvaging it aren't reported again, they're covered by this.
+*/
+static void
+disk_readerr(const struct disk *disk, int64_t sect_off, int64_t sect_count)
+{
+	if (UP_NOISY(disk->ctx, QUIET))
+		up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, sloppyio),
+		    "read from %s failed: %"PRIu64" sector(s) of %u "
+		    "bytes at offset %"PRIu64": %s",
+		    UP_DISK_PATH(disk), sect_count,
+		    UP_DISK_1SECT(disk), sect_off,
+		    (disk->type == DT_IMAGE ?
+			up_img_readerr(disk->handle.img) :
+			os_lasterrstr()));
+}
+
+/*
+  Read as much of a range as possible after reading it failed, by
+  splitting it in half and reading each half. A half which fails is
+  split again, unless the other half failed too, in which case the
+  range is read a sector at a time since splitting a run of bad
+  sectors takes nearly twice as many reads. Unreadable sectors are
+  zero-filled and remembered so they're never read again. Returns the
+  number of bad sectors.
+*/
+static int64_t
+disk_salvage(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    uint8_t *buf)
+{
+	int64_t half, bad, i;
+	uint8_t *ptr;
+	int lo, hi;
+
+	/* don't take a deadline passing for a bad sector */
+	if (disk->cache->degraded) {
+		memset(buf, 0, sect_count * UP_DISK_1SECT(disk));
+		return (0);
+	}
+
+	if (sect_count == 1) {
+		bad_add(disk, sect_off);
+		memset(buf, 0, UP_DISK_1SECT(disk));
+		return (1);
+	}
+
+	half = sect_count / 2;
+	lo = disk_tryread(disk, sect_off, half, buf);
+	hi = disk_tryread(disk, sect_off + half, sect_count - half,
+	    buf + half * UP_DISK_1SECT(disk));
+	if (disk->cache->degraded) {
+		memset(buf, 0, sect_count * UP_DISK_1SECT(disk));
+		return (0);
+	}
+	if (lo < 0 && hi < 0) {
+		bad = 0;
+		for (i = 0; i < sect_count; i++) {
+			ptr = buf + i * UP_DISK_1SECT(disk);
+			if (disk_tryread(disk, sect_off + i, 1, ptr) > 0)
+				continue;
+			if (disk->cache->degraded) {
+				memset(buf, 0, sect_count * UP_DISK_1SECT(disk));
+				return (0);
+			}
+			bad_add(disk, sect_off + i);
+			memset(ptr, 0, UP_DISK_1SECT(disk));
+			bad++;
+		}
+		return (bad);
+	}
+
+	return ((lo > 0 ? 0 : disk_salvage(disk, sect_off, half, buf)) +
+	    (hi > 0 ? 0 : disk_salvage(disk, sect_off + half,
+		sect_count - half, buf + half * UP_DISK_1SECT(disk))));
+}
+
+/*
+  Read a range with sectors already known to be bad for -k, zero-filling
+  them and reading the rest with disk_read() so it comes from the cache
+  and any new bad sectors are reported as usual. Returns SECT_COUNT, or
+  -1 if the rest couldn't be read.
+*/
+static int64_t
+disk_readaround(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    uint8_t *buf)
+{
+	struct disk_range *bad;
+	int64_t off, end, len;
+	uint8_t *ptr;
+
+	end = sect_off + sect_count;
+	for (off = sect_off; off < end; off += len) {
+		ptr = buf + (off - sect_off) * UP_DISK_1SECT(disk);
+		bad = bad_first(disk, off, end - off);
+		if (bad != NULL && bad->first <= off) {
+			len = MIN(bad->last + 1, end) - off;
+			memset(ptr, 0, len * UP_DISK_1SECT(disk));
+			continue;
+		}
+		len = (bad != NULL ? bad->first : end) - off;
+		len = disk_read(disk, off, len, ptr, len * UP_DISK_1SECT(disk));
+		if (len <= 0)
+			return (-1);
+	}
+
+	return (sect_count);
+}
+
+/*
+  Like disk_readaround() but for cache_fill(), reading the rest of the
+  range directly. A read which fails is reported and salvaged.
+*/
+static void
+disk_fillaround(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    uint8_t *buf)
+{
+	struct disk_range *bad;
+	int64_t off, end, len;
+	uint8_t *ptr;
+	ssize_t res;
+
+	end = sect_off + sect_count;
+	for (off = sect_off; off < end; off += len) {
+		ptr = buf + (off - sect_off) * UP_DISK_1SECT(disk);
+		bad = bad_first(disk, off, end - off);
+		if (bad != NULL && bad->first <= off) {
+			len = MIN(bad->last + 1, end) - off;
+			memset(ptr, 0, len * UP_DISK_1SECT(disk));
+			continue;
+		}
+		len = (bad != NULL ? bad->first : end) - off;
+		if ((res = disk_rawread(disk, off, len, ptr)) >= 0) {
+			memset(ptr + res, 0, len * UP_DISK_1SECT(disk) - res);
+			continue;
+		}
+		if (disk->cache->degraded)
+			return;
+		disk_readerr(disk, off, len);
+		disk_salvage(disk, off, len, ptr);
+	}
+}
+
+/*
+  Try to read a range for disk_salvage(), zero-filling past the end of
+  the disk. Returns 1 if it was read, 0 if it has a sector already
+  known to be bad so it wasn't, or -1 if the read failed.
+*/
+static int
+disk_tryread(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    uint8_t *buf)
+{
+	ssize_t res;
+
+	if (bad_check(disk, sect_off, sect_count))
+		return (0);
+	if ((res = disk_rawread(disk, sect_off, sect_count, buf)) < 0)
+		return (-1);
+	memset(buf + res, 0, sect_count * UP_DISK_1SECT(disk) - res);
+	return (1);
+}
+
+/* Return true if any of the given sectors are known to be bad. */
+static int
+bad_check(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_range key;
+
+	if (RB_EMPTY(&disk->cache->bad))
+		return (0);
+	key.first = first;
+	key.last = first + count - 1;
+	return (RB_FIND(disk_range_map, &disk->cache->bad, &key) != NULL);
+}
+
+/* Return the first known bad range overlapping the given sectors. */
+static struct disk_range *
+bad_first(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_range key, *bad, *prev;
+
+	if (count <= 0)
+		return (NULL);
+	key.first = first;
+	key.last = first + count - 1;
+	if ((bad = RB_FIND(disk_range_map, &disk->cache->bad, &key)) == NULL)
+		return (NULL);
+
+	/* the range found may not be the first one which overlaps */
+	if (bad->first > first &&
+	    (prev = bad_first(disk, first, bad->first - first)) != NULL)
+		return (prev);
+
+	return (bad);
+}
+
+/* Remember a bad sector, merging it with any adjacent bad ranges. */
+static void
+bad_add(const struct disk *disk, int64_t sect)
+{
+	struct disk_range_map *map = &disk->cache->bad;
+	struct disk_range key, *bad, *next;
+
+	if (bad_check(disk, sect, 1))
+		return;
+	disk->cache->stats.badsects++;
+#ifdef DEBUG_SECTOR_CACHE
+	fprintf(stderr, "bad sector %"PRId64"\n", sect);
+#endif
+
+	key.first = sect - 1;
+	key.last = sect - 1;
+	if (sect > 0 && (bad = RB_FIND(disk_range_map, map, &key)) != NULL)
+		bad->last = sect;
+	else {
+		/* failing to remember it just means reading it again */
+		if ((bad = up_xalloc(1, sizeof(*bad), XA_QUIET)) == NULL)
+			return;
+		bad->first = sect;
+		bad->last = sect;
+		RB_INSERT(disk_range_map, map, bad);
+	}
+
+	key.first = sect + 1;
+	key.last = sect + 1;
+	if ((next = RB_FIND(disk_range_map, map, &key)) != NULL) {
+		RB_REMOVE(disk_range_map, map, next);
+		bad->last = next->last;
+		free(next);
+	}
+}
+
+/* Return how many of the given sectors weren't counted for -R before. */
+static int64_t
+seen_count(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_range key, *seen;
+	int64_t res;
+
+	if (count <= 0)
+		return (0);
+	key.first = first;
+	key.last = first + count - 1;
+	if ((seen = RB_FIND(disk_range_map, &disk->cache->seen, &key)) == NULL)
+		return (count);
+
+	/* count what's on either side of the range which was found */
+	res = 0;
+	if (seen->first > first)
+		res += seen_count(disk, first, seen->first - first);
+	if (seen->last < key.last)
+		res += seen_count(disk, seen->last + 1, key.last - seen->last);
+
+	return (res);
+}
+
+/* Remember sectors counted for -R, merging any ranges they touch. */
+static void
+seen_add(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_range_map *map = &disk->cache->seen;
+	struct disk_range key, near, *seen;
+
+	key.first = first;
+	key.last = first + count - 1;
+	for (;;) {
+		/* look one sector further each way to merge adjacent ranges */
+		near.first = (key.first > 0 ? key.first - 1 : 0);
+		near.last = key.last + 1;
+		if ((seen = RB_FIND(disk_range_map, map, &near)) == NULL)
+			break;
+		RB_REMOVE(disk_range_map, map, seen);
+		key.first = MIN(key.first, seen->first);
+		key.last = MAX(key.last, seen->last);
+		free(seen);
+	}
+
+	/* failing to remember them just means counting them again */
+	if ((seen = up_xalloc(1, sizeof(*seen), XA_QUIET)) == NULL)
+		return;
+	seen->first = key.first;
+	seen->last = key.last;
+	RB_INSERT(disk_range_map, map, seen);
+}
+
+/*
+  Count sectors about to be read from the device or file against the
+  limit on how many may be read. Once it's reached the disk is treated
+  like one which passed its deadline and nothing more is read from it.
+*/
+static int
+disk_charge(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_cache *cache = disk->cache;
+	int64_t cost;
+
+	if (disk->ctx->opts.maxsects <= 0)
+		return (0);
+	if (cache->degraded)
+		return (-1);
+	cost = disk_cost(disk, first, count);
+	if (cost > disk->ctx->opts.maxsects - cache->charged) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_warn(disk->ctx, "giving up on %s after reading "
+			    "%"PRId64" sector(s)", UP_DISK_PATH(disk),
+			    cache->charged);
+		cache->degraded = 1;
+		return (-1);
+	}
+	cache->charged += cost;
+	if (!DISK_CACHED(disk))
+		seen_add(disk, first, count);
+
+	return (0);
+}
+
+/*
+  Return true if the given sectors can be read without going over the
+  limit. Reads which don't fit are refused, or left out if they're
+  only reading ahead, without giving up on the disk.
+*/
+static int
+disk_affordable(const struct disk *disk, int64_t first, int64_t count)
+{
+	return (disk->ctx->opts.maxsects <= 0 || disk_cost(disk, first,
+		count) <= disk->ctx->opts.maxsects - disk->cache->charged);
+}
+
+/*
+  Return how many of the given sectors reading them would count
+  against the limit. Reads which miss the cache are counted every
+  time, but images and mapped files aren't cached and are already in
+  memory after their first read, so only sectors not read from them
+  before are counted.
+*/
+static int64_t
+disk_cost(const struct disk *disk, int64_t first, int64_t count)
+{
+	if (DISK_CACHED(disk))
+		return (count);
+	return (seen_count(disk, first, count));
+}
+
+/*
+  Read from a device, giving up if the per-read or per-disk deadline
+  passes. After that the disk is marked degraded and all further reads
+  from it fail immediately.
+*/
+static ssize_t
+disk_devread(const struct disk *disk, void *buf, size_t size, int64_t off)
+{
+	struct disk_cache *cache = disk->cache;
+	int64_t wait;
+	ssize_t res;
+	int timedout;
+
+	if (cache->degraded)
+		return (-1);
+
+	/* let other threads use the cache while this one waits */
+	os_lock_release(cache->lock);
+	if (!DISK_DEADLINES(disk)) {
+		res = os_dev_read(disk->handle.dev, buf, size, off);
+		os_lock_acquire(cache->lock);
+		return (res);
+	}
+
+	wait = (disk->ctx->opts.readtimeout > 0 ?
+	    disk->ctx->opts.readtimeout : INT64_MAX);
+	if (disk->ctx->opts.disktimeout > 0)
+		wait = MIN(wait, cache->deadline - os_msecs());
+	timedout = (wait <= 0);
+	res = -1;
+	if (!timedout)
+		res = os_dev_read_deadline(disk->handle.dev, buf, size, off,
+		    wait, &timedout);
+	os_lock_acquire(cache->lock);
+	if (timedout) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_warn(disk->ctx,
+			    "read from %s at sector %"PRId64" passed its "
+			    "deadline, giving up on the disk",
+			    UP_DISK_PATH(disk), off / UP_DISK_1SECT(disk));
+		cache->degraded = 1;
+		return (-1);
+	}
+
+	return (res);
+}
+
+/*
+  Read from a device opened for direct i/o, bouncing the read through
+  an aligned buffer rounded out to whole blocks if needed.
+*/
+static ssize_t
+disk_directread(const struct disk *disk, void *buf, size_t size, int64_t off)
+{
+	int64_t block = disk->cache->dioblock;
+	int64_t start, end;
+	struct disk_buf *bounce;
+	uint8_t *data;
+	ssize_t res;
+
+	if (off % block == 0 && size % block == 0 &&
+	    (uintptr_t)buf % block == 0)
+		return (disk_devread(disk, buf, size, off));
+
+	start = off - off % block;
+	end = off + size;
+	end += (block - end % block) % block;
+	if ((bounce = buf_new(disk, end - start, &data)) == NULL)
 		return (-1);
+	res = disk_devread(disk, data, end - start, start);
+	if (res >= 0) {
+		res = MAX(0, MIN(res - (off - start), (ssize_t)size));
+		memcpy(buf, data + (off - start), res);
+	}
+	buf_unref(bounce);
+
+	return (res);
+}
+
+/*
+  Allocate a buffer suitably aligned for reading from the disk, with
+  one reference. DATA is set to the aligned start of the buffer.
+*/
+static struct disk_buf *
+buf_new(const struct disk *disk, size_t size, uint8_t **data)
+{
+	struct disk_buf *buf;
+	size_t align;
+
+	align = MAX(1, disk->cache->dioblock);
+	if ((buf = up_xalloc(1, sizeof(*buf), 0)) == NULL)
+		return (NULL);
+	if ((buf->mem = up_xalloc(1, size + align - 1, 0)) == NULL) {
+		free(buf);
+		return (NULL);
+	}
+	buf->refs = 1;
+	*data = (uint8_t *)buf->mem +
+	    (align - (uintptr_t)buf->mem % align) % align;
+
+	return (buf);
+}
+
+static struct disk_buf *
+buf_ref(struct disk_buf *buf)
+{
+	assert(buf->refs > 0);
+	buf->refs++;
+	return (buf);
+}
+
+static void
+buf_unref(struct disk_buf *buf)
+{
+	if (buf == NULL)
+		return;
+	assert(buf->refs > 0);
+	if (--buf->refs == 0) {
+		free(buf->mem);
+		free(buf);
 	}
+}
+
+/*
+  Return a pointer to the given sectors in the file mapping, or NULL
+  if the disk isn't mapped, the sectors are past the end of it, or
+  they're all in a hole and reading them would only fault in zeros.
+*/
+static const uint8_t *
+disk_mapped(const struct disk *disk, int64_t first, int64_t count)
+{
+	int64_t off, len;
+
+	if (disk->filemap == NULL || up_disk_ishole(disk, first, count) ||
+	    first > (disk->filemaplen / UP_DISK_1SECT(disk)) ||
+	    count > (disk->filemaplen / UP_DISK_1SECT(disk)))
+		return (NULL);
+	off = first * UP_DISK_1SECT(disk);
+	len = count * UP_DISK_1SECT(disk);
+	if (off + len > disk->filemaplen ||
+	    !disk_affordable(disk, first, count) ||
+	    disk_charge(disk, first, count) < 0)
+		return (NULL);
+
+	return (disk->filemap + off);
+}
+
+/*
+  Read directly from the underlying device, file, or image, bypassing
+  the cache. Returns the number of bytes read or -1 on error, without
+  printing any error message.
+*/
+static ssize_t
+disk_rawread(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    void *buf)
+{
+	size_t byte_count;
+	int64_t byte_off;
+	ssize_t res;
+
 	byte_off = sect_off * UP_DISK_1SECT(disk);
 	byte_count = sect_count * UP_DISK_1SECT(disk);
+	if (disk->type != DT_FILE) {
+		/* file holes aren't read, disk_fileread() counts them */
+		if (disk_charge(disk, sect_off, sect_count) < 0)
+			return (-1);
+		disk->cache->stats.reads++;
+		disk->cache->stats.readsects += sect_count;
+	}
 
 	switch (disk->type) {
 	case DT_IMAGE:
 		/* if there's an image then read from it instead */
-		return (up_img_read(disk->handle.img, sect_off, sect_count,
-			buf));
+		res = up_img_read(disk->handle.img, sect_off, sect_count,
+		    buf);
+		if (res > 0)
+			res *= UP_DISK_1SECT(disk);
+		break;
 	case DT_FILE:
-		/* plain files use stdio */
-		if (fseeko(disk->handle.file, byte_off, SEEK_SET) != 0)
-			res = (ferror(disk->handle.file) ? -1 : 0);
-		else {
-			res = fread(buf, 1, byte_count, disk->handle.file);
-			if (res == 0 && ferror(disk->handle.file))
-				res = -1;
-		}
+		res = disk_fileread(disk, sect_off, sect_count, buf);
 		break;
 	case DT_DEVICE:
 		/* otherwise try to read from the device */
-		res = os_dev_read(disk->handle.dev, buf, byte_count, byte_off);
+		if (disk->cache->dioblock > 0)
+			res = disk_directread(disk, buf, byte_count, byte_off);
+		else
+			res = disk_devread(disk, buf, byte_count, byte_off);
 		break;
 	default:
 		assert(!"unknown disk type");
@@ -176,30 +945,227 @@ up_disk_read(const struct disk *disk, int64_t sect_off, int64_t sect_count,
 		break;
 	}
 
-	if (res < 0) {
-		if (UP_NOISY(QUIET))
-			up_msg((opts->sloppyio ? UP_MSG_FWARN : UP_MSG_FERR),
-			    "read from %s failed: %"PRIu64" sector(s) of %u "
-			    "bytes at offset %"PRIu64": %s",
-			    UP_DISK_PATH(disk), sect_count,
-			    UP_DISK_1SECT(disk), sect_off, os_lasterrstr());
-		if (!opts->sloppyio)
+	return (res);
+}
+
+/*
+  Read from a plain file, zero-filling holes instead of reading them
+  and copying from the mapping if there is one.
+*/
+static ssize_t
+disk_fileread(const struct disk *disk, int64_t sect_off, int64_t sect_count,
+    uint8_t *buf)
+{
+	int64_t done, sect, next, count, byte_off;
+	size_t byte_count;
+	ssize_t res;
+	int idx;
+
+	for (done = 0; done < sect_count; done += count) {
+		sect = sect_off + done;
+		count = sect_count - done;
+		byte_off = sect * UP_DISK_1SECT(disk);
+
+		/* zero-fill up to the next data, or find the end of it */
+		if (disk->extentcount >= 0 && sect < UP_DISK_SIZESECTS(disk)) {
+			next = up_disk_nextdata(disk, sect);
+			if (next > sect) {
+				count = MIN(count, next - sect);
+				memset(buf + done * UP_DISK_1SECT(disk), 0,
+				    count * UP_DISK_1SECT(disk));
+				disk->cache->stats.holesects += count;
+				continue;
+			}
+			idx = disk_extentidx(disk, sect);
+			count = MIN(count, disk->extents[idx].last - sect + 1);
+		}
+		byte_count = count * UP_DISK_1SECT(disk);
+		if (disk_charge(disk, sect, count) < 0)
 			return (-1);
-		res = byte_count;
-		memset(buf, 0, res);
+		disk->cache->stats.reads++;
+		disk->cache->stats.readsects += count;
+
+		if (disk->filemap == NULL) {
+			os_lock_release(disk->cache->lock);
+			res = os_file_read(disk->handle.file,
+			    buf + done * UP_DISK_1SECT(disk), byte_count,
+			    byte_off);
+			os_lock_acquire(disk->cache->lock);
+		} else if (byte_off >= disk->filemaplen)
+			res = 0;
+		else {
+			res = MIN(byte_count, disk->filemaplen - byte_off);
+			memcpy(buf + done * UP_DISK_1SECT(disk),
+			    disk->filemap + byte_off, res);
+		}
+		if (res < 0)
+			return (res);
+		if (res < byte_count)
+			return (done * UP_DISK_1SECT(disk) + res);
 	}
 
-	return (res / UP_DISK_1SECT(disk));
+	return (sect_count * UP_DISK_1SECT(disk));
+}
+
+/*
+  Build a sorted list of the sectors of a plain file which have data
+  allocated. If every sector does, or holes can't be found, the list
+  isn't used.
+*/
+static int
+disk_findholes(struct disk *disk)
+{
+	int64_t size;
+
+	disk->extentcount = 0;
+	size = UP_DISK_SIZEBYTES(disk);
+	if (os_file_extents(disk->handle.file, size, disk_addextent,
+		disk) < 0 ||
+	    (disk->extentcount == 1 && disk->extents[0].first == 0 &&
+		disk->extents[0].last == UP_DISK_SIZESECTS(disk) - 1)) {
+		free(disk->extents);
+		disk->extents = NULL;
+		disk->extentcount = -1;
+		return (0);
+	}
+
+	return (0);
+}
+
+static int
+disk_addextent(int64_t off, int64_t len, void *arg)
+{
+	struct disk *disk = arg;
+	struct disk_extent *ext;
+	int64_t first, last;
+
+	/* round out to whole sectors and merge with the previous extent */
+	first = off / UP_DISK_1SECT(disk);
+	last = (off + len - 1) / UP_DISK_1SECT(disk);
+	if (disk->extentcount > 0 &&
+	    disk->extents[disk->extentcount - 1].last + 1 >= first) {
+		disk->extents[disk->extentcount - 1].last = last;
+		return (0);
+	}
+
+	if ((disk->extentcount & (disk->extentcount - 1)) == 0) {
+		if ((ext = up_xalloc(MAX(1, disk->extentcount * 2),
+			    sizeof(*ext), 0)) == NULL)
+			return (-1);
+		if (disk->extentcount > 0)
+			memcpy(ext, disk->extents,
+			    disk->extentcount * sizeof(*ext));
+		free(disk->extents);
+		disk->extents = ext;
+	}
+	disk->extents[disk->extentcount].first = first;
+	disk->extents[disk->extentcount].last = last;
+	disk->extentcount++;
+
+	return (0);
+}
+
+/* Return the index of the first extent not entirely before SECT. */
+static int
+disk_extentidx(const struct disk *disk, int64_t sect)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = disk->extentcount;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (disk->extents[mid].last < sect)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+int
+up_disk_ishole(const struct disk *disk, int64_t first, int64_t count)
+{
+	int idx;
+
+	assert(disk->setup_done);
+	if (disk->extentcount < 0 || count <= 0 ||
+	    first + count > UP_DISK_SIZESECTS(disk))
+		return (0);
+	idx = disk_extentidx(disk, first);
+	return (idx == disk->extentcount ||
+	    disk->extents[idx].first > first + count - 1);
+}
+
+int64_t
+up_disk_nextdata(const struct disk *disk, int64_t sect)
+{
+	int idx;
+
+	assert(disk->setup_done);
+	if (disk->extentcount < 0 || sect >= UP_DISK_SIZESECTS(disk))
+		return (sect);
+	idx = disk_extentidx(disk, sect);
+	if (idx == disk->extentcount)
+		return (UP_DISK_SIZESECTS(disk));
+	return (MAX(sect, disk->extents[idx].first));
 }
 
 const void *
 up_disk_getsect(const struct disk *disk, int64_t sect)
 {
+    const void *ret;
+
+    os_lock_acquire(disk->cache->lock);
+    ret = disk_getsect(disk, sect);
+    os_lock_release(disk->cache->lock);
+
+    return ret;
+}
+
+static const void *
+disk_getsect(const struct disk *disk, int64_t sect)
+{
+    struct disk_cache_ent *ent;
+    const uint8_t *ptr;
+    struct up_task *task;
+    void *buf;
+
     assert(disk->buf);
-    if(1 > up_disk_read(disk, sect, 1, disk->buf, UP_DISK_1SECT(disk)))
+    if((ptr = disk_mapped(disk, sect, 1)))
+        return ptr;
+
+    /*
+      Other threads may replace the held sector or disk buffer, so
+      tasks get a copy in a buffer of their own.
+    */
+    buf = disk->buf;
+    if(NULL != (task = up_task_get()))
+    {
+        if(task->sectsize < UP_DISK_1SECT(disk))
+        {
+            free(task->sect);
+            task->sectsize = 0;
+            if(!(task->sect = up_xalloc(1, UP_DISK_1SECT(disk), 0)))
+                return NULL;
+            task->sectsize = UP_DISK_1SECT(disk);
+        }
+        buf = task->sect;
+    }
+
+    /* hold on to the cached sector so it isn't freed under the caller */
+    else if((ent = cache_get(disk, sect, 1)))
+    {
+        buf_unref(disk->cache->lastsect);
+        disk->cache->lastsect = buf_ref(ent->buf);
+        return ent->data + (sect - ent->first) * UP_DISK_1SECT(disk);
+    }
+
+    if(1 > disk_read(disk, sect, 1, buf, UP_DISK_1SECT(disk)))
         return NULL;
     else
-        return disk->buf;
+        return buf;
 }
 
 int
@@ -211,14 +1177,17 @@ up_disk_check1sect(const struct disk *disk, int64_t sect)
 int
 up_disk_checksectrange(const struct disk *disk, int64_t start, int64_t size)
 {
-	struct disk_sect key;
+	struct disk_sect key, *found;
 
 	assert(disk->setup_done);
 	assert(size > 0);
 	memset(&key, 0, sizeof key);
 	key.first = start;
 	key.last = start + size - 1;
-	if (RB_FIND(disk_sect_map, &disk->sectsused, &key) == NULL) {
+	os_lock_acquire(disk->cache->lock);
+	found = RB_FIND(disk_sect_map, &disk->sectsused, &key);
+	os_lock_release(disk->cache->lock);
+	if (found == NULL) {
 #ifdef DEBUG_SECTOR_SAVE
 		printf("check %"PRId64"+%"PRId64": free\n", start, size);
 #endif
@@ -242,30 +1211,60 @@ const void *
 up_disk_savesectrange(struct disk *disk, int64_t first, int64_t size,
     const struct map *ref, int tag)
 {
+	const void *ret;
+
+	os_lock_acquire(disk->cache->lock);
+	ret = disk_savesectrange(disk, first, size, ref, tag);
+	os_lock_release(disk->cache->lock);
+
+	return (ret);
+}
+
+static const void *
+disk_savesectrange(struct disk *disk, int64_t first, int64_t size,
+    const struct map *ref, int tag)
+{
+	struct disk_cache_ent *ent;
+	struct disk_sectref *owner;
 	struct disk_sect *new;
+	uint8_t *data;
 
 	/* allocate data structure */
 	assert(disk->setup_done);
 	assert(size > 0);
-	if ((new = xalloc(1, sizeof(*new), XA_ZERO)) == NULL)
+	if ((owner = sectidx_getref(disk->sectidx, ref, 1)) == NULL ||
+	    (new = pool_get(&disk->sectidx->sectpool)) == NULL)
 		return (NULL);
+	memset(new, 0, sizeof(*new));
 	new->data = NULL;
+	new->subtree = 1;
 	new->first = first;
 	new->last = first + size - 1;
 	new->ref = ref;
 	new->tag = tag;
-	if ((new->data = xalloc(size, UP_DISK_1SECT(disk), XA_ZERO)) == NULL) {
-		free(new);
-		return (NULL);
-	}
 
-	/* try to read the sectors from disk */
-	if (up_disk_read(disk, first, size, new->data,
-	    size * UP_DISK_1SECT(disk)) != size) {
-		free(new->data);
-		free(new);
+	/*
+	  Point into the file mapping or share the cached buffer, and
+	  only read the sectors into a buffer of our own as a last resort.
+	*/
+	if ((new->data = (void *)disk_mapped(disk, first, size)) != NULL)
+		new->buf = NULL;
+	else if ((ent = cache_get(disk, first, size)) != NULL &&
+	    ent->last >= new->last) {
+		new->buf = buf_ref(ent->buf);
+		new->data = ent->data +
+		    (first - ent->first) * UP_DISK_1SECT(disk);
+	} else if ((new->buf = buf_new(disk, size * UP_DISK_1SECT(disk),
+		    &data)) == NULL) {
+		pool_put(&disk->sectidx->sectpool, new);
 		return (NULL);
-	}
+	} else if (disk_read(disk, first, size, data,
+		size * UP_DISK_1SECT(disk)) != size) {
+		buf_unref(new->buf);
+		pool_put(&disk->sectidx->sectpool, new);
+		return (NULL);
+	} else
+		new->data = data;
 
 	/* insert it in the tree if the sectors aren't marked as used */
 	if (RB_INSERT(disk_sect_map, &disk->sectsused, new)) {
@@ -273,14 +1272,17 @@ up_disk_savesectrange(struct disk *disk, int64_t first, int64_t size,
 		printf("failed to mark %"PRId64"+%"PRId64" with %p, "
 		    "already used\n", first, size, ref);
 #endif
-		free(new->data);
-		free(new);
+		buf_unref(new->buf);
+		pool_put(&disk->sectidx->sectpool, new);
 		return (NULL);
 	}
+	sect_fixup(new);
 #ifdef DEBUG_SECTOR_SAVE
 	printf("mark %"PRId64"+%"PRId64" with %p\n", first, size, ref);
 #endif
 	disk->sectsused_count += size;
+	new->refnext = owner->sects;
+	owner->sects = new;
 
 	/* return the data */
 	return (new->data);
@@ -289,23 +1291,72 @@ up_disk_savesectrange(struct disk *disk, int64_t first, int64_t size,
 void
 up_disk_sectsunref(struct disk *disk, const void *ref)
 {
-	struct disk_sect *ii, *inc;
+	struct disk_sectref *owner;
+	struct disk_sect *ii, *fix, *succ;
 
 	assert(disk->setup_done);
-	for (ii = RB_MIN(disk_sect_map, &disk->sectsused); ii; ii = inc) {
-		inc = RB_NEXT(disk_sect_map, &disk->sectsused, ii);
-		if (ref == ii->ref) {
+	os_lock_acquire(disk->cache->lock);
+	if ((owner = sectidx_getref(disk->sectidx, ref, 0)) == NULL) {
+		os_lock_release(disk->cache->lock);
+		return;
+	}
+	while ((ii = owner->sects) != NULL) {
+		owner->sects = ii->refnext;
 #ifdef DEBUG_SECTOR_SAVE
-			printf("unmark %"PRId64"+%"PRId64" with %p\n",
-			    ii->first, ii->last - ii->first + 1, ii->ref);
+		printf("unmark %"PRId64"+%"PRId64" with %p\n",
+		    ii->first, ii->last - ii->first + 1, ii->ref);
 #endif
-			RB_REMOVE(disk_sect_map, &disk->sectsused, ii);
-			disk->sectsused_count -= ii->last - ii->first + 1;
-			assert(0 <= disk->sectsused_count);
-			free(ii->data);
-			free(ii);
+		/*
+		  Find the lowest node whose subtree loses a range: the
+		  parent of the node which is actually unlinked, either
+		  this one or its successor.
+		*/
+		if (RB_LEFT(ii, link) == NULL || RB_RIGHT(ii, link) == NULL)
+			fix = RB_PARENT(ii, link);
+		else {
+			for (succ = RB_RIGHT(ii, link);
+			     RB_LEFT(succ, link) != NULL;
+			     succ = RB_LEFT(succ, link))
+				;
+			fix = (RB_PARENT(succ, link) == ii ?
+			    succ : RB_PARENT(succ, link));
 		}
+		RB_REMOVE(disk_sect_map, &disk->sectsused, ii);
+		sect_fixup(fix);
+		disk->sectsused_count -= ii->last - ii->first + 1;
+		assert(0 <= disk->sectsused_count);
+		buf_unref(ii->buf);
+		pool_put(&disk->sectidx->sectpool, ii);
 	}
+
+	RB_REMOVE(disk_sectref_map, &disk->sectidx->refs, owner);
+	if (disk->sectidx->lastref == owner)
+		disk->sectidx->lastref = NULL;
+	pool_put(&disk->sectidx->refpool, owner);
+	os_lock_release(disk->cache->lock);
+}
+
+/*
+  Drop every saved range without looking up or unlinking each one,
+  the ranges and owners are all returned to their pools' chunks.
+*/
+void
+up_disk_sectsunrefall(struct disk *disk)
+{
+	struct disk_sect *ii;
+
+	if (!disk->setup_done)
+		return;
+	os_lock_acquire(disk->cache->lock);
+	RB_FOREACH(ii, disk_sect_map, &disk->sectsused)
+		buf_unref(ii->buf);
+	RB_INIT(&disk->sectsused);
+	disk->sectsused_count = 0;
+	RB_INIT(&disk->sectidx->refs);
+	disk->sectidx->lastref = NULL;
+	pool_destroy(&disk->sectidx->sectpool);
+	pool_destroy(&disk->sectidx->refpool);
+	os_lock_release(disk->cache->lock);
 }
 
 void
@@ -316,6 +1367,7 @@ up_disk_close(struct disk *disk)
     up_map_freeall(disk);
     assert(RB_EMPTY(&disk->sectsused));
     assert(0 == disk->sectsused_count);
+    sectidx_free(disk->sectidx);
     switch (disk->type) {
     case DT_UNKNOWN:
 	    assert(!disk->setup_done);
@@ -325,6 +1377,9 @@ up_disk_close(struct disk *disk)
 	    os_dev_close(disk->handle.dev);
 	    break;
     case DT_FILE:
+	    if (disk->filemap != NULL)
+		    os_file_unmap(disk->filemap, disk->filemaplen);
+	    free(disk->extents);
 	    fclose(disk->handle.file);
 	    break;
     case DT_IMAGE:
@@ -334,26 +1389,30 @@ up_disk_close(struct disk *disk)
 	    assert(!"bad disk type");
 	    break;
     }
+    cache_free(disk->cache);
     free(disk->buf);
     free(disk->name);
     free(disk->path);
     free(disk);
-    if (disk == st_curdisk)
-	    st_curdisk = NULL;
 }
 
 static enum disk_type
-open_thing(const char *name, union disk_handle *handle, const char **path)
+open_thing(struct disk *disk, char **path)
 {
+	union disk_handle *handle;
+	const char *name;
 	enum disk_type type;
 	struct img *img;
 	os_device_handle dev;
 	FILE *fh;
 
-	switch (type = os_dev_open(name, path, &dev)) {
+	handle = &disk->handle;
+	name = UP_DISK_NAME(disk);
+	switch (type = os_dev_open(disk->ctx, name, path, &dev)) {
 	case DT_UNKNOWN:
-		if (UP_NOISY(QUIET))
-			up_err("failed to open device %s for reading: %s",
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx,
+			    "failed to open device %s for reading: %s",
 			    (*path ? *path : name), os_lasterrstr());
 		break;
 	case DT_DEVICE:
@@ -361,14 +1420,15 @@ open_thing(const char *name, union disk_handle *handle, const char **path)
 		break;
 	case DT_FILE:
 		if ((fh = fopen(name, "rb")) == NULL) {
-			up_err("failed to open file %s for reading: %s",
+			up_err(disk->ctx,
+			    "failed to open file %s for reading: %s",
 			    name, os_lasterrstr());
 			return (DT_UNKNOWN);
 		}
 
 		/* check if it's an image file */
 		img = NULL;
-		switch (up_img_load(fh, name, &img)) {
+		switch (up_img_load(disk->ctx, fh, name, &img)) {
 		case -1:
 			fclose(fh);
 			return (DT_UNKNOWN);
@@ -410,7 +1470,7 @@ fixparams(struct disk *disk, const struct disk_params *params)
 
 	/* sector size defaults to 512 */
 	if (disk->params.sectsize <= 0) {
-		up_warn("couldn't determine sector size for %s, "
+		up_warn(disk->ctx, "couldn't determine sector size for %s, "
 		    "assuming 512 bytes", UP_DISK_PATH(disk));
         	disk->params.sectsize = 512;
 	}
@@ -427,12 +1487,13 @@ fixparams(struct disk *disk, const struct disk_params *params)
 
 	/* apparently not, try defaulting heads and sectors to 255 and 63 */
 	if (disk->params.heads <= 0) {
-		up_warn("couldn't determine number of heads for %s, "
+		up_warn(disk->ctx, "couldn't determine number of heads for %s, "
 		    "assuming 255", UP_DISK_PATH(disk));
         	disk->params.heads = 255;
 	}
 	if (disk->params.sects <= 0) {
-		up_warn("couldn't determine number of sectors/track for %s, "
+		up_warn(disk->ctx,
+		    "couldn't determine number of sectors/track for %s, "
 		    "assuming 63", UP_DISK_PATH(disk));
 		disk->params.sects = 63;
 	}
@@ -498,11 +1559,11 @@ up_disk_print(const struct disk *disk, void *_stream)
 
     assert(disk->setup_done);
     size = up_fmtsize(UP_DISK_SIZEBYTES(disk), &unit);
-    if(UP_NOISY(NORMAL))
+    if(UP_NOISY(disk->ctx, NORMAL))
         fprintf(stream, "%s: %.*f%s (%"PRId64" sectors of %d bytes)\n",
                 UP_DISK_PATH(disk), UP_BESTDECIMAL(size), size, unit,
                 UP_DISK_SIZESECTS(disk), UP_DISK_1SECT(disk));
-    if(UP_NOISY(EXTRA))
+    if(UP_NOISY(disk->ctx, EXTRA))
         fprintf(stream,
                 "    description:         %s\n"
                 "    device name:         %s\n"
@@ -515,7 +1576,7 @@ up_disk_print(const struct disk *disk, void *_stream)
 	    "\n", UP_DISK_DESC(disk), UP_DISK_NAME(disk), UP_DISK_PATH(disk),
 	    UP_DISK_1SECT(disk), UP_DISK_SIZESECTS(disk),
 	    UP_DISK_CYLS(disk), UP_DISK_HEADS(disk), UP_DISK_SPT(disk));
-    if(UP_NOISY(NORMAL))
+    if(UP_NOISY(disk->ctx, NORMAL))
         fputc('\n', stream);
 }
 
@@ -528,9 +1589,9 @@ up_disk_summary(const struct disk *disk, void *_stream)
 
 	assert(disk->setup_done);
 	size = up_fmtsize(UP_DISK_SIZEBYTES(disk), &unit);
-	if (UP_NOISY(NORMAL))
+	if (UP_NOISY(disk->ctx, NORMAL))
 		fprintf(stream, "%.*f%s", UP_BESTDECIMAL(size), size, unit);
-	if (UP_NOISY(EXTRA))
+	if (UP_NOISY(disk->ctx, EXTRA))
 		fprintf(stream, " - %s", UP_DISK_DESC(disk));
 }
 
@@ -563,16 +1624,626 @@ const struct disk_sect *
 up_disk_nthsect(const struct disk *disk, int off)
 {
 	struct disk_sect *node;
+	int64_t rank;
 
 	assert(disk->setup_done);
 	assert(off >= 0);
-	for (node = RB_MIN(disk_sect_map, &disk->sectsused); node;
-	    node = RB_NEXT(disk_sect_map, &disk->sectsused, node))
-		if (off-- == 0)
+	rank = off;
+	node = RB_ROOT(&disk->sectsused);
+	while (node != NULL) {
+		if (rank < SECT_SUBTREE(RB_LEFT(node, link)))
+			node = RB_LEFT(node, link);
+		else if (rank == SECT_SUBTREE(RB_LEFT(node, link)))
 			return (node);
+		else {
+			rank -= SECT_SUBTREE(RB_LEFT(node, link)) + 1;
+			node = RB_RIGHT(node, link);
+		}
+	}
 	return (NULL);
 }
 
+int
+up_disk_submit(const struct disk *disk, int64_t start, int64_t count)
+{
+	struct disk_cache *cache = disk->cache;
+	struct disk_cache_ent *ent;
+	int res;
+
+	assert(disk->setup_done);
+	assert(start >= 0);
+
+	/* see up_disk_read() for why some disks aren't cached */
+	if (!DISK_CACHED(disk))
+		return (0);
+	if (start + count > UP_DISK_SIZESECTS(disk))
+		count = UP_DISK_SIZESECTS(disk) - start;
+	os_lock_acquire(cache->lock);
+	if (count <= 0 || cache_find(cache, start, count) != NULL ||
+	    bad_check(disk, start, count) || cache->degraded) {
+		os_lock_release(cache->lock);
+		return (0);
+	}
+
+	/*
+	  Only devices are read asynchronously, and not with deadlines or
+	  when threads are probing in parallel and can't share the queue.
+	*/
+	if (disk->type == DT_DEVICE && cache->aio == NULL &&
+	    !DISK_DEADLINES(disk) && !DISK_THREADED(disk))
+		cache->aio = os_aio_open(disk->handle.dev, DISK_AIO_DEPTH);
+	if (cache->aio == NULL) {
+		cache_fill(disk, start, count);
+		os_lock_release(cache->lock);
+		return (0);
+	}
+
+	if ((ent = cache_newent(disk, start, count, 1)) == NULL) {
+		os_lock_release(cache->lock);
+		return (-1);
+	}
+	if (cache->dioblock > 0 &&
+	    (ent->first * UP_DISK_1SECT(disk) % cache->dioblock != 0 ||
+		(ent->last + 1) * UP_DISK_1SECT(disk) % cache->dioblock != 0)) {
+		/* let disk_directread() deal with it */
+		cache_freeent(ent);
+		cache_fill(disk, start, count);
+		os_lock_release(cache->lock);
+		return (0);
+	}
+	/* a prefetch which doesn't fit in the -R limit isn't needed */
+	if (!disk_affordable(disk, ent->first, ent->last - ent->first + 1)) {
+		cache_freeent(ent);
+		os_lock_release(cache->lock);
+		return (0);
+	}
+	disk_charge(disk, ent->first, ent->last - ent->first + 1);
+	cache->stats.reads++;
+	cache->stats.readsects += ent->last - ent->first + 1;
+	while ((res = os_aio_submit(cache->aio, ent->data,
+		    (ent->last - ent->first + 1) * UP_DISK_1SECT(disk),
+		    ent->first * UP_DISK_1SECT(disk), ent)) == 0)
+		if (disk_wait(disk) < 0)
+			break;
+	if (res <= 0) {
+		cache_freeent(ent);
+		os_lock_release(cache->lock);
+		return (-1);
+	}
+	cache->pending++;
+	os_lock_release(cache->lock);
+
+	return (0);
+}
+
+int
+up_disk_wait(const struct disk *disk)
+{
+	int res;
+
+	assert(disk->setup_done);
+	os_lock_acquire(disk->cache->lock);
+	res = disk_wait(disk);
+	os_lock_release(disk->cache->lock);
+
+	return (res);
+}
+
+static int
+disk_wait(const struct disk *disk)
+{
+	struct disk_cache *cache = disk->cache;
+	void *cookie;
+	ssize_t res;
+
+	while (cache->pending > 0) {
+		if (os_aio_wait(cache->aio, &cookie, &res) <= 0)
+			return (-1);
+		cache->pending--;
+		cache_insert(disk, cookie, res);
+	}
+
+	return (0);
+}
+
+/*
+  Forget any read refused for not fitting in the -R limit, so a caller
+  can later tell with up_disk_wasrefused() if one of its own reads was.
+  Maps are probed one at a time with -R, so no other thread's reads
+  come in between.
+*/
+void
+up_disk_clearrefused(const struct disk *disk)
+{
+	if (!disk->setup_done)
+		return;
+	os_lock_acquire(disk->cache->lock);
+	disk->cache->wasrefused = 0;
+	os_lock_release(disk->cache->lock);
+}
+
+int
+up_disk_wasrefused(const struct disk *disk)
+{
+	int res;
+
+	if (!disk->setup_done)
+		return (0);
+	os_lock_acquire(disk->cache->lock);
+	res = disk->cache->wasrefused;
+	os_lock_release(disk->cache->lock);
+
+	return (res);
+}
+
+int
+up_disk_degraded(const struct disk *disk)
+{
+	int res;
+
+	if (!disk->setup_done)
+		return (0);
+	os_lock_acquire(disk->cache->lock);
+	res = disk->cache->degraded;
+	os_lock_release(disk->cache->lock);
+
+	return (res);
+}
+
+int
+up_disk_verify(const struct disk *disk)
+{
+	if (disk->type != DT_IMAGE)
+		return (0);
+	return (up_img_verify(disk->handle.img));
+}
+
+void
+up_disk_getstats(const struct disk *disk, struct disk_stats *stats)
+{
+	assert(disk->setup_done);
+	os_lock_acquire(disk->cache->lock);
+	*stats = disk->cache->stats;
+	os_lock_release(disk->cache->lock);
+}
+
+void
+up_disk_printstats(const struct disk *disk, void *_stream)
+{
+	struct disk_stats stats;
+	FILE *stream = _stream;
+
+	up_disk_getstats(disk, &stats);
+	fprintf(stream, "%s: %"PRId64" read(s) of %"PRId64" sector(s), "
+	    "%"PRId64" cache hit(s), %"PRId64" cache miss(es)\n",
+	    UP_DISK_PATH(disk), stats.reads, stats.readsects,
+	    stats.hits, stats.misses);
+	if (stats.holesects > 0)
+		fprintf(stream, "%s: %"PRId64" sector(s) in holes read as "
+		    "zeros\n", UP_DISK_PATH(disk), stats.holesects);
+	if (stats.badsects > 0)
+		fprintf(stream, "%s: %"PRId64" bad sector(s)\n",
+		    UP_DISK_PATH(disk), stats.badsects);
+}
+
+static struct disk_cache *
+cache_new(const struct disk *disk)
+{
+	struct disk_cache *cache;
+	int64_t phys, fill;
+
+	if ((cache = up_xalloc(1, sizeof(*cache), XA_ZERO)) == NULL)
+		return (NULL);
+	RB_INIT(&cache->map);
+	TAILQ_INIT(&cache->lru);
+	RB_INIT(&cache->bad);
+	RB_INIT(&cache->seen);
+	cache->count = 0;
+	cache->max = MAX(1, DISK_CACHE_BYTES / UP_DISK_1SECT(disk));
+
+	/* fill whole physical blocks, and the optimal size if not huge */
+	phys = MAX(disk->params.physsectsize, UP_DISK_1SECT(disk));
+	fill = MAX(DISK_CACHE_FILLBYTES,
+	    MIN(disk->params.iosize, DISK_CACHE_MAXFILL));
+	fill += (phys - fill % phys) % phys;
+	cache->align = MAX(1, fill / UP_DISK_1SECT(disk));
+
+	if (disk->ctx->opts.disktimeout > 0)
+		cache->deadline = os_msecs() + disk->ctx->opts.disktimeout;
+	if (DISK_THREADED(disk))
+		cache->lock = os_lock_new();
+
+	/* direct reads must be aligned to the physical block */
+	if (disk->ctx->opts.directio && disk->type == DT_DEVICE)
+		cache->dioblock = phys;
+
+	return (cache);
+}
+
+static void
+cache_free(struct disk_cache *cache)
+{
+	struct disk_cache_ent *ent;
+	struct disk_range *bad;
+	void *cookie;
+	ssize_t res;
+
+	if (cache == NULL)
+		return;
+	buf_unref(cache->lastsect);
+	if (cache->aio != NULL) {
+		while (cache->pending > 0 &&
+		    os_aio_wait(cache->aio, &cookie, &res) > 0) {
+			ent = cookie;
+			cache_freeent(ent);
+			cache->pending--;
+		}
+		os_aio_close(cache->aio);
+	}
+	while ((ent = TAILQ_FIRST(&cache->lru)) != NULL)
+		cache_evict(cache, ent);
+	assert(cache->count == 0);
+	while ((bad = RB_ROOT(&cache->bad)) != NULL) {
+		RB_REMOVE(disk_range_map, &cache->bad, bad);
+		free(bad);
+	}
+	while ((bad = RB_ROOT(&cache->seen)) != NULL) {
+		RB_REMOVE(disk_range_map, &cache->seen, bad);
+		free(bad);
+	}
+	os_lock_free(cache->lock);
+	free(cache);
+}
+
+/* Return the cache entry containing all of the given sectors, or NULL. */
+static struct disk_cache_ent *
+cache_find(struct disk_cache *cache, int64_t first, int64_t count)
+{
+	struct disk_cache_ent key, *ent;
+
+	key.first = first;
+	key.last = first + count - 1;
+	ent = RB_FIND(disk_cache_map, &cache->map, &key);
+	if (ent == NULL || ent->first > key.first || ent->last < key.last)
+		return (NULL);
+
+	/* move it to the end of the lru list */
+	TAILQ_REMOVE(&cache->lru, ent, lru);
+	TAILQ_INSERT_TAIL(&cache->lru, ent, lru);
+
+	return (ent);
+}
+
+/*
+  Return a cache entry starting with the given sectors, reading them
+  into the cache if needed. The entry may be short if the end of the
+  disk was reached. Returns NULL if the disk isn't cached, the read
+  failed or was too large, or any of the sectors are bad, and
+  up_disk_read() will try it again uncached.
+
+  Images zero-fill any range starting with a sector they lack, so they
+  can't be read in larger chunks and aren't cached.
+*/
+static struct disk_cache_ent *
+cache_get(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_cache_ent *ent;
+
+	if (!DISK_CACHED(disk) || bad_check(disk, first, count))
+		return (NULL);
+	if ((ent = cache_find(disk->cache, first, count)) != NULL) {
+		disk->cache->stats.hits++;
+		return (ent);
+	}
+	disk->cache->stats.misses++;
+	if ((ent = cache_fill(disk, first, count)) == NULL ||
+	    bad_check(disk, first, count))
+		return (NULL);
+	return (ent);
+}
+
+/*
+  Read an aligned range of sectors containing the given ones into the
+  cache. Returns the new entry, which may be short if the end of the
+  disk was reached, or NULL if the read failed or was too large.
+*/
+static struct disk_cache_ent *
+cache_fill(const struct disk *disk, int64_t first, int64_t count)
+{
+	struct disk_cache_ent *ent;
+	ssize_t res;
+	int known;
+
+	if ((ent = cache_newent(disk, first, count, 1)) == NULL)
+		return (NULL);
+
+	/* without room for the whole entry only read what was asked for */
+	if (!disk_affordable(disk, ent->first, ent->last - ent->first + 1)) {
+		cache_freeent(ent);
+		if (!disk_affordable(disk, first, count) ||
+		    (ent = cache_newent(disk, first, count, 0)) == NULL)
+			return (NULL);
+	}
+
+	/*
+	  If the read fails then with sloppyio find the bad sectors and
+	  keep the rest, cache_get() won't return anything containing a
+	  bad sector. Otherwise only the sectors asked for are read.
+	*/
+	known = bad_check(disk, ent->first, ent->last - ent->first + 1);
+	res = (known ? -1 : disk_rawread(disk, ent->first,
+		ent->last - ent->first + 1, ent->data));
+	if (res < 0 && !disk->cache->degraded &&
+	    !disk->ctx->opts.sloppyio) {
+		cache_freeent(ent);
+		return (NULL);
+	}
+	if (res < 0 && !disk->cache->degraded) {
+		if (known)
+			disk_fillaround(disk, ent->first,
+			    ent->last - ent->first + 1, ent->data);
+		else {
+			disk_readerr(disk, ent->first,
+			    ent->last - ent->first + 1);
+			disk_salvage(disk, ent->first,
+			    ent->last - ent->first + 1, ent->data);
+		}
+		res = (ent->last - ent->first + 1) * UP_DISK_1SECT(disk);
+	}
+	if (disk->cache->degraded) {
+		cache_freeent(ent);
+		return (NULL);
+	}
+
+	/* give up if the read stopped short of the first sector */
+	if (ent->first + res / UP_DISK_1SECT(disk) <= first) {
+		cache_freeent(ent);
+		return (NULL);
+	}
+
+	return (cache_insert(disk, ent, res));
+}
+
+/*
+  Allocate a cache entry for the given sectors, rounded out to an
+  aligned range if ROUND is true, and clamped to the end of the disk.
+  Returns NULL if the range is too large to cache or allocation fails.
+*/
+static struct disk_cache_ent *
+cache_newent(const struct disk *disk, int64_t first, int64_t count,
+    int round)
+{
+	struct disk_cache *cache = disk->cache;
+	struct disk_cache_ent *ent;
+	int64_t last;
+
+	/* round the read out to the cache alignment */
+	last = MIN(first + count, UP_DISK_SIZESECTS(disk)) - 1;
+	if (round)
+		first -= first % cache->align;
+	if (round && last < UP_DISK_SIZESECTS(disk) - 1)
+		last = MIN(last - last % cache->align + cache->align - 1,
+		    UP_DISK_SIZESECTS(disk) - 1);
+	if (last - first + 1 > cache->max)
+		return (NULL);
+
+	if ((ent = up_xalloc(1, sizeof(*ent), XA_ZERO)) == NULL)
+		return (NULL);
+	if ((ent->buf = buf_new(disk,
+		    (last - first + 1) * UP_DISK_1SECT(disk), &ent->data)) == NULL) {
+		free(ent);
+		return (NULL);
+	}
+	ent->first = first;
+	ent->last = last;
+
+	return (ent);
+}
+
+/*
+  Add an entry to the cache after RES bytes were read into it, or free
+  it if nothing was read. Returns the entry or NULL.
+*/
+static struct disk_cache_ent *
+cache_insert(const struct disk *disk, struct disk_cache_ent *ent,
+    ssize_t res)
+{
+	struct disk_cache *cache = disk->cache;
+	struct disk_cache_ent *old;
+
+	if (res < UP_DISK_1SECT(disk)) {
+		cache_freeent(ent);
+		return (NULL);
+	}
+#ifdef DEBUG_SECTOR_CACHE
+	fprintf(stderr, "cache fill %"PRId64"+%"PRId64"\n",
+	    ent->first, (int64_t)(res / UP_DISK_1SECT(disk)));
+#endif
+	ent->last = MIN(ent->last,
+	    ent->first + res / UP_DISK_1SECT(disk) - 1);
+
+	/* make room for the new entry and remove any overlapping ones */
+	while (cache->count + (ent->last - ent->first + 1) > cache->max &&
+	    (old = TAILQ_FIRST(&cache->lru)) != NULL)
+		cache_evict(cache, old);
+	while ((old = RB_FIND(disk_cache_map, &cache->map, ent)) != NULL)
+		cache_evict(cache, old);
+
+	RB_INSERT(disk_cache_map, &cache->map, ent);
+	TAILQ_INSERT_TAIL(&cache->lru, ent, lru);
+	cache->count += ent->last - ent->first + 1;
+
+	return (ent);
+}
+
+static void
+cache_evict(struct disk_cache *cache, struct disk_cache_ent *ent)
+{
+#ifdef DEBUG_SECTOR_CACHE
+	fprintf(stderr, "cache evict %"PRId64"+%"PRId64"\n",
+	    ent->first, ent->last - ent->first + 1);
+#endif
+	RB_REMOVE(disk_cache_map, &cache->map, ent);
+	TAILQ_REMOVE(&cache->lru, ent, lru);
+	cache->count -= ent->last - ent->first + 1;
+	assert(cache->count >= 0);
+	cache_freeent(ent);
+}
+
+static void
+cache_freeent(struct disk_cache_ent *ent)
+{
+	buf_unref(ent->buf);
+	free(ent);
+}
+
+static int
+cachecmp(struct disk_cache_ent *left, struct disk_cache_ent *right)
+{
+	if (left->last < right->first)
+		return (-1);
+	else if (left->first > right->last)
+		return (1);
+	else
+		return (0);
+}
+
+static int
+rangecmp(struct disk_range *left, struct disk_range *right)
+{
+	if (left->last < right->first)
+		return (-1);
+	else if (left->first > right->last)
+		return (1);
+	else
+		return (0);
+}
+
+static void
+pool_init(struct disk_pool *pool, size_t size)
+{
+	/* round up so every item is suitably aligned */
+	pool->size = (size + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1);
+	if (pool->size < sizeof(void *))
+		pool->size = sizeof(void *);
+	pool->left = 0;
+	pool->chunks = NULL;
+	pool->free = NULL;
+}
+
+static void *
+pool_get(struct disk_pool *pool)
+{
+	void *item, *chunk;
+
+	if ((item = pool->free) != NULL) {
+		pool->free = *(void **)item;
+		return (item);
+	}
+
+	/* the first item in each chunk links to the previous chunk */
+	if (pool->left == 0) {
+		if ((chunk = up_xalloc(DISK_POOL_CHUNK + 1, pool->size, 0)) ==
+		    NULL)
+			return (NULL);
+		*(void **)chunk = pool->chunks;
+		pool->chunks = chunk;
+		pool->left = DISK_POOL_CHUNK;
+	}
+
+	return ((uint8_t *)pool->chunks + pool->left-- * pool->size);
+}
+
+static void
+pool_put(struct disk_pool *pool, void *item)
+{
+	*(void **)item = pool->free;
+	pool->free = item;
+}
+
+static void
+pool_destroy(struct disk_pool *pool)
+{
+	void *chunk;
+
+	while ((chunk = pool->chunks) != NULL) {
+		pool->chunks = *(void **)chunk;
+		free(chunk);
+	}
+	pool->left = 0;
+	pool->free = NULL;
+}
+
+static struct disk_sectidx *
+sectidx_new(void)
+{
+	struct disk_sectidx *idx;
+
+	if ((idx = up_xalloc(1, sizeof(*idx), 0)) == NULL)
+		return (NULL);
+	RB_INIT(&idx->refs);
+	idx->lastref = NULL;
+	pool_init(&idx->sectpool, sizeof(struct disk_sect));
+	pool_init(&idx->refpool, sizeof(struct disk_sectref));
+
+	return (idx);
+}
+
+static void
+sectidx_free(struct disk_sectidx *idx)
+{
+	if (idx == NULL)
+		return;
+	assert(RB_EMPTY(&idx->refs));
+	pool_destroy(&idx->sectpool);
+	pool_destroy(&idx->refpool);
+	free(idx);
+}
+
+/*
+  Return the list of ranges saved by REF, creating an empty one if
+  CREATE is true and it doesn't exist yet.
+*/
+static struct disk_sectref *
+sectidx_getref(struct disk_sectidx *idx, const void *ref, int create)
+{
+	struct disk_sectref key, *owner;
+
+	if (idx->lastref != NULL && idx->lastref->ref == ref)
+		return (idx->lastref);
+
+	key.ref = ref;
+	if ((owner = RB_FIND(disk_sectref_map, &idx->refs, &key)) == NULL) {
+		if (!create || (owner = pool_get(&idx->refpool)) == NULL)
+			return (NULL);
+		owner->ref = ref;
+		owner->sects = NULL;
+		RB_INSERT(disk_sectref_map, &idx->refs, owner);
+	}
+	idx->lastref = owner;
+
+	return (owner);
+}
+
+static void
+sect_augment(struct disk_sect *sect)
+{
+	sect->subtree = 1 + SECT_SUBTREE(RB_LEFT(sect, link)) +
+	    SECT_SUBTREE(RB_RIGHT(sect, link));
+}
+
+/*
+  Recount subtrees from SECT up to the root. The tree code only
+  recounts the nodes it rotates, the ancestors of a node which was
+  inserted or unlinked are left stale until this is called.
+*/
+static void
+sect_fixup(struct disk_sect *sect)
+{
+	for (; sect != NULL; sect = RB_PARENT(sect, link))
+		sect_augment(sect);
+}
+
 static int
 sectcmp(struct disk_sect *left, struct disk_sect *right)
 {
@@ -599,3 +2270,14 @@ sectcmp(struct disk_sect *left, struct disk_sect *right)
 		return (0);
 	}
 }
+
+static int
+sectrefcmp(struct disk_sectref *left, struct disk_sectref *right)
+{
+	if ((uintptr_t)left->ref < (uintptr_t)right->ref)
+		return (-1);
+	else if ((uintptr_t)left->ref > (uintptr_t)right->ref)
+		return (1);
+	else
+		return (0);
+}
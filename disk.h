@@ -22,6 +22,8 @@ struct disk_params {
 	int64_t sects;		/* number of sectors per track */
 	int64_t size;		/* total number of sects */
 	int sectsize;		/* size of a sector in bytes */
+	int physsectsize;	/* size of a physical block in bytes, or 0 */
+	int iosize;		/* optimal read size in bytes, or 0 */
 };
 #endif /* HDR_UPART_DISK_PARAMS_ONLY */
 
@@ -34,6 +36,13 @@ struct map;
 struct part;
 struct img;
 struct os_device_handle;
+struct disk_cache;
+struct disk_buf;
+struct disk_sectidx;
+struct disk_extent;
+struct map_arena;
+struct map_memo;
+struct up_ctx;
 
 #define UP_SECT_OFF(sect)       ((sect)->first)
 #define UP_SECT_COUNT(sect)     ((sect)->last - (sect)->first + 1)
@@ -46,6 +55,9 @@ struct disk_sect {
 	const struct map *ref;
 	void *data;
 	int tag;
+	struct disk_buf *buf;	/* buffer holding data, NULL if mapped */
+	int64_t subtree;	/* number of ranges in this subtree */
+	struct disk_sect *refnext; /* next range saved by the same map */
 	RB_ENTRY(disk_sect) link;
 };
 
@@ -58,6 +70,15 @@ enum disk_type {
 	DT_IMAGE
 };
 
+struct disk_stats {
+	int64_t reads;		/* number of reads issued to the OS */
+	int64_t readsects;	/* total sectors requested from the OS */
+	int64_t hits;		/* reads satisfied entirely from cache */
+	int64_t misses;		/* reads which went to the OS */
+	int64_t badsects;	/* sectors which could not be read */
+	int64_t holesects;	/* sectors in file holes read as zeros */
+};
+
 union disk_handle {
 	struct os_device_handle *dev;
 	FILE *file;
@@ -65,6 +86,7 @@ union disk_handle {
 };
 
 struct disk {
+	struct up_ctx *ctx;	/* options and message stream */
 	char *name;		/* disk name supplied by user */
 	char *path;		/* path to opened device node */
 	struct disk_params params;
@@ -75,11 +97,20 @@ struct disk {
 	enum disk_type type;
 	union disk_handle handle;
 	uint8_t *buf;
+	const uint8_t *filemap;
+	int64_t filemaplen;
+	struct disk_extent *extents;	/* allocated ranges of a sparse file */
+	int extentcount;	/* -1 if holes aren't known */
+	struct disk_cache *cache;
 	struct part *maps;
+	struct map_arena *arena; /* memory for maps, freed all at once */
+	struct map_memo *memo;	/* load verdicts already known */
 	struct disk_sect_map sectsused;
 	int64_t sectsused_count;
+	struct disk_sectidx *sectidx;
 };
 
+#define UP_DISK_MAPS(disk)      ((const struct part *)(disk)->maps)
 #define UP_DISK_NAME(disk)      ((disk)->name)
 #define UP_DISK_PATH(disk)      ((disk)->path)
 #define UP_DISK_DESC(disk)      ((disk)->desc)
@@ -95,11 +126,9 @@ struct disk {
 typedef int (*up_disk_iterfunc_t)(const struct disk *,
     const struct disk_sect *, void *);
 
-/* Returns the currently-open disk, or NULL */
-struct disk	*current_disk(void);
-
-/* Open the disk device, must call up_disk_setup() after this */
-struct disk	*up_disk_open(const char *);
+/* Open the disk device with the options in a context, must call
+   up_disk_setup() after this */
+struct disk	*up_disk_open(struct up_ctx *, const char *);
 
 /* Read get drive parameters and make disk ready to read from or write to */
 int		 up_disk_setup(struct disk *, const struct disk_params *);
@@ -113,6 +142,44 @@ int64_t		 up_disk_read(const struct disk *, int64_t, int64_t,
    is called again. */
 const void	*up_disk_getsect(const struct disk *, int64_t);
 
+/* Queue a read of sectors into the cache ahead of their use. Read
+   errors are not reported, the sectors are simply not cached. */
+int		 up_disk_submit(const struct disk *, int64_t, int64_t);
+
+/* Wait for all reads queued with up_disk_submit() to finish. */
+int		 up_disk_wait(const struct disk *);
+
+/* Return true if a read deadline passed or the -R limit ran out part
+   way through a read, and the disk is no longer being read from. */
+int		 up_disk_degraded(const struct disk *);
+
+/* Forget that any read was refused for not fitting in what was left
+   of the -R limit. */
+void		 up_disk_clearrefused(const struct disk *);
+
+/* Return true if a read was refused for not fitting in what was left
+   of the -R limit since up_disk_clearrefused() was last called.
+   Smaller reads may still succeed after one. */
+int		 up_disk_wasrefused(const struct disk *);
+
+/* Check anything about the disk which was put off until after it was
+   read, such as an image's data crc. Returns -1 if it's corrupt. */
+int		 up_disk_verify(const struct disk *);
+
+/* Copy read statistics for the disk into STATS. */
+void		 up_disk_getstats(const struct disk *, struct disk_stats *);
+
+/* Print read statistics to STREAM. */
+void		 up_disk_printstats(const struct disk *, void *);
+
+/* Return true if all the sectors lie in holes in a sparse file and
+   will read as zeros. */
+int		 up_disk_ishole(const struct disk *, int64_t, int64_t);
+
+/* Return the first sector at or after the given one which isn't in a
+   hole, or the size of the disk if there is none. */
+int64_t		 up_disk_nextdata(const struct disk *, int64_t);
+
 /* return true if a sector is marked as used, false otherwise */
 int up_disk_check1sect(const struct disk *disk, int64_t sect);
 
@@ -131,11 +198,14 @@ const void	*up_disk_savesectrange(struct disk *, int64_t, int64_t,
 /* mark all sectors associated with REF unused */
 void up_disk_sectsunref(struct disk *disk, const void *ref);
 
+/* mark all sectors unused at once, for when every map is freed */
+void up_disk_sectsunrefall(struct disk *disk);
+
 /* iterate through marked sectors */
 /* the passed function should return 0 to stop iteration */
 void up_disk_sectsiter(const struct disk *disk,
                        up_disk_iterfunc_t func, void *arg);
-/* return the nth sector */
+/* return the nth saved range in O(log n) */
 const struct disk_sect	*up_disk_nthsect(const struct disk *, int);
 
 /* Close disk and free struct. */
@@ -49,6 +49,8 @@
     (guid)->data4[6], (guid)->data4[7]
 #define GPT_GUID_DATA4_SIZE     8
 #define GPT_PART_SIZE           0x80
+/* usual number of partition entries, only used when prefetching */
+#define GPT_PROBE_PARTS         (128)
 #define GPT_NAME_SIZE           0x48
 
 #pragma pack(1)
@@ -105,6 +107,8 @@ struct up_gpt
 
 static int	gpt_load(const struct disk *, const struct part *,
     void **);
+static void	gpt_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	gpt_setup(struct disk *, struct map *);
 static int	gpt_getinfo(const struct map *, FILE *);
 static int	gpt_getindex(const struct part *, char *, size_t);
@@ -117,21 +121,31 @@ static int	gpt_readhdr(const struct disk *, int64_t, int64_t,
 static int	gpt_checkcrc(struct up_gpt_p *);
 static const char *gpt_typename(const struct up_guid_p *);
 
+/* the primary header or the secondary one in the last sector */
+static const struct map_sig gpt_sigs[] = {
+	{ 1, 0, "EFI PART", 8, 0 },
+	{ -1, 0, "EFI PART", 8, 0 },
+	{ 0 }
+};
+
 void
-up_gpt_register(void)
+up_gpt_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = "EFI GPT";
+	funcs.name = "gpt";
 	funcs.load = gpt_load;
+	funcs.footprint = gpt_footprint;
+	funcs.sigs = gpt_sigs;
 	funcs.setup = gpt_setup;
 	funcs.print_header = gpt_getinfo;
 	funcs.get_index = gpt_getindex;
 	funcs.print_extrahdr = gpt_getextrahdr;
 	funcs.print_extra = gpt_getextra;
 
-	up_map_register(UP_MAP_GPT, &funcs);
+	up_map_register(ctx, UP_MAP_GPT, &funcs);
 }
 
 int
@@ -155,8 +169,8 @@ gpt_load(const struct disk *disk, const struct part *parent, void **priv)
 
 	/* check revision */
 	if (GPT_REVISION != UP_LETOH32(pk.revision)) {
-		if (UP_NOISY(QUIET))
-			up_err("gpt with unknown revision: %u.%u",
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "gpt with unknown revision: %u.%u",
 			    (UP_LETOH32(pk.revision) >> 16) & 0xffff,
 			    UP_LETOH32(pk.revision) & 0xffff);
 		return (0);
@@ -165,7 +179,7 @@ gpt_load(const struct disk *disk, const struct part *parent, void **priv)
 	/* XXX validate other fields */
 
 	/* create map private struct */
-	if ((gpt = xalloc(1, sizeof(*gpt), XA_ZERO)) == NULL)
+	if ((gpt = up_map_alloc(disk, sizeof(*gpt))) == NULL)
 		return (-1);
 	gpt->gpt = pk;
 	*priv = gpt;
@@ -173,6 +187,15 @@ gpt_load(const struct disk *disk, const struct part *parent, void **priv)
 	return (1);
 }
 
+static void
+gpt_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	/* headers plus a partition array of the usual size */
+	*head = 2 + GPT_PROBE_PARTS * GPT_PART_SIZE / UP_DISK_1SECT(disk);
+	*tail = 1 + GPT_PROBE_PARTS * GPT_PART_SIZE / UP_DISK_1SECT(disk);
+}
+
 static int
 gpt_setup(struct disk *disk, struct map *map)
 {
@@ -200,10 +223,10 @@ gpt_setup(struct disk *disk, struct map *map)
 	/* verify the crc */
 	if (UP_LETOH32(gpt->partcrc) !=
 	    (up_crc32(data1 + UP_DISK_1SECT(disk),  partbytes, ~0) ^ ~0)) {
-		if (UP_NOISY(QUIET))
-			up_msg((opts->relaxed ? UP_MSG_FWARN : UP_MSG_FERR),
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, relaxed),
 			    "bad gpt partition crc");
-		if (!opts->relaxed)
+		if (!disk->ctx->opts.relaxed)
 			return (0);
 	}
 
@@ -211,16 +234,14 @@ gpt_setup(struct disk *disk, struct map *map)
 	pk = (const struct up_gptpart_p *)(data1 + UP_DISK_1SECT(disk));
 	while ((const uint8_t *)pk + sizeof(*pk) <=
 	    data1 + UP_DISK_1SECT(disk) * partsects) {
-		if ((part = xalloc(1, sizeof(*part), XA_ZERO)) == NULL)
+		if ((part = up_map_alloc(disk, sizeof(*part))) == NULL)
 			return (-1);
 		part->part = *pk;
 		part->index = priv->partitions;
 		if (!up_map_add(map, UP_LETOH64(pk->start),
 			UP_LETOH64(pk->end) - UP_LETOH64(pk->start),
-			0, part)) {
-			free(part);
+			0, part))
 			return (-1);
-		}
 		priv->partitions++;
 		pk++;
 	}
@@ -233,22 +254,22 @@ gpt_getinfo(const struct map *map, FILE *stream)
 {
 	const struct up_gpt *gpt;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	gpt = map->priv;
 
 	if (fprintf(stream, "%s partition table at ",
 		up_map_label(map)) < 0 ||
-	    printsect_verbose(GPT_PRIOFF(UP_MAP_VIRTADDR(map), map->size),
-		stream) < 0 ||
+	    up_printsect_verbose(map->disk,
+		GPT_PRIOFF(UP_MAP_VIRTADDR(map), map->size), stream) < 0 ||
 	    fputs(" (backup at ", stream) == EOF ||
-	    printsect_verbose(GPT_SECOFF(UP_MAP_VIRTADDR(map), map->size),
-		stream) < 0 ||
+	    up_printsect_verbose(map->disk,
+		GPT_SECOFF(UP_MAP_VIRTADDR(map), map->size), stream) < 0 ||
 	    fprintf(stream, ") of %s:\n", UP_DISK_PATH(map->disk)) < 0)
 		return (-1);
 
-	if (UP_NOISY(EXTRA)) 
+	if (UP_NOISY(map->disk->ctx, EXTRA)) 
 		return (fprintf(stream,
 			"  size:                 %u\n"
 			"  primary gpt sector:   %"PRIu64"\n"
@@ -285,10 +306,10 @@ gpt_getindex(const struct part *part, char *buf, size_t size)
 static int
 gpt_getextrahdr(const struct map *map, FILE *stream)
 {
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
-        if (UP_NOISY(EXTRA))
+        if (UP_NOISY(map->disk->ctx, EXTRA))
 		return (fprintf(stream, " %-36s Type", "GUID"));
         else
 		return (fprintf(stream, " Type"));
@@ -300,13 +321,13 @@ gpt_getextra(const struct part *part, FILE *stream)
 	const struct up_gptpart *priv;
 	const char *label;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = part->priv;
 	label = gpt_typename(&priv->part.type);
 
-	if (UP_NOISY(EXTRA))
+	if (UP_NOISY(part->map->disk->ctx, EXTRA))
 		return (fprintf(stream, " "GPT_GUID_FMT" "GPT_GUID_FMT" %s",
                         GPT_GUID_FMT_ARGS(&priv->part.guid),
                         GPT_GUID_FMT_ARGS(&priv->part.type),
@@ -336,8 +357,8 @@ gpt_findhdr(const struct disk *disk, int64_t start, int64_t size,
         *gpt = *buf;
         if(gpt_checkcrc(gpt))
             return 1;
-        if(UP_NOISY(QUIET))
-            up_warn("bad crc on primary gpt in sector %"PRId64,
+        if(UP_NOISY(disk->ctx, QUIET))
+            up_warn(disk->ctx, "bad crc on primary gpt in sector %"PRId64,
                     GPT_PRIOFF(start, size));
         badcrc = 1;
     }
@@ -351,8 +372,8 @@ gpt_findhdr(const struct disk *disk, int64_t start, int64_t size,
         *gpt = *buf;
         if(gpt_checkcrc(gpt))
             return 1;
-        if(UP_NOISY(QUIET))
-            up_err("bad crc on secondary gpt in sector %"PRId64,
+        if(UP_NOISY(disk->ctx, QUIET))
+            up_err(disk->ctx, "bad crc on secondary gpt in sector %"PRId64,
                    GPT_SECOFF(start, size));
         badcrc = 1;
     }
@@ -17,7 +17,9 @@
 #ifndef HDR_UPART_GPT
 #define HDR_UPART_GPT
 
+struct up_ctx;
+
 /* register GPT partition map type */
-void up_gpt_register(void);
+void up_gpt_register(struct up_ctx *);
 
 #endif /* HDR_UPART_GPT */
@@ -32,10 +32,21 @@
 /* #define IMG_DEBUG */
 
 #define IMG_MAGIC		(UINT64_C(0x5550415254eaf2e5))
-#define IMG_MAJOR		(1)
-#define IMG_MINOR		(0)
+/* images with less than 4GB of data are written as version 1 */
+#define IMG_V1_MAJOR		(1)
+#define IMG_V1_MINOR		(1)
+#define IMG_V2_MAJOR		(2)
+#define IMG_V2_MINOR		(0)
 #define IMG_HDR_LEN		(328)
+#define IMG_HDREXT_LEN		(16)
+#define IMG_HDR2_LEN		(352)
 #define IMG_SECT_LEN		(16)
+#define IMG_IDX_LEN		(24)
+#define IMG_IDX2_LEN		(32)
+/* size of the buffer used to copy out a staged image */
+#define IMG_COPY_LEN		(16 * 1024)
+/* write version 2 images whatever their size if set, for testing */
+#define IMG_FORCEV2_ENV		"UPART_IMG_FORCEV2"
 
 struct imghdr {
 	uint64_t magic;
@@ -55,89 +66,367 @@ struct imghdr {
 	char label[256];
 };
 
+/* header extension added in version 1.1, after the main header */
+struct imghdrext {
+	uint64_t idxoff;
+	uint32_t idxcount;
+	uint32_t idxcrc;
+};
+
+/* version 2 header, the same up to hdrcrc with 64-bit data offsets */
+struct imghdr2 {
+	uint64_t magic;
+	uint16_t major;
+	uint16_t minor;
+	uint32_t hdrlen;
+	uint32_t hdrcrc;
+	uint32_t sectsize;
+	uint64_t datastart;
+	uint64_t datasize;
+	uint32_t datacrc;
+	uint32_t idxcount;
+	uint64_t idxoff;
+	uint32_t idxcrc;
+	uint32_t pad;
+	uint64_t size;
+	uint64_t cyls;
+	uint64_t heads;
+	uint64_t sects;
+	char label[256];
+};
+
 struct imgsect {
 	uint64_t off;
 	uint64_t size;
 };
 
+/* sector group index entry, added in version 1.1 after the data */
+struct imgidx {
+	uint64_t off;
+	uint64_t size;
+	uint32_t dataoff;
+	uint32_t crc;
+};
+
+/* version 2 index entry, with a 64-bit data offset */
+struct imgidx2 {
+	uint64_t off;
+	uint64_t size;
+	uint64_t dataoff;
+	uint32_t crc;
+	uint32_t pad;
+};
+
+/* a group of sectors in the image data, see up_img_read() */
+struct imgext {
+	int64_t first;
+	int64_t last;
+	uint64_t dataoff;	/* offset of the first sector in data */
+	uint32_t crc;		/* crc of the group header and sectors */
+	int checked;		/* crc was checked, -1 if it failed */
+};
+
+/* the header fields of either version, in host byte order */
 struct img {
-	struct imghdr hdr;
-	uint8_t *data;
+	struct up_ctx *ctx;
+	int major;
+	int minor;
+	uint64_t datastart;
+	uint64_t datasize;
+	uint32_t datacrc;
+	uint32_t sectsize;
+	int64_t size;
+	int64_t cyls;
+	int64_t heads;
+	int64_t sects;
+	char label[256];
+	int hasindex;		/* the index fields below are valid */
+	uint64_t idxoff;
+	uint32_t idxcount;
+	uint32_t idxcrc;
+	const uint8_t *data;
+	uint8_t *databuf;	/* data if the file couldn't be mapped */
+	const void *map;	/* mapping of the whole file, or NULL */
+	int64_t maplen;
+	int verified;		/* data crc was checked, -1 if it failed */
+	struct imgext *exts;	/* sorted by first sector */
+	int extcount;
+	int indexed;		/* groups were loaded from the index */
+	const char *readerr;	/* why the last up_img_read() failed */
+};
+
+static int	img_read(struct up_ctx *, FILE *, const char *, void *, size_t,
+    int64_t);
+static int	img_checkcrc(struct up_ctx *, struct imghdr *, FILE *,
+    const char *, uint32_t *, uint8_t **);
+static void	img_parsehdr(struct img *, const struct imghdr *,
+    const uint8_t *);
+static void	img_mkhdr(const struct disk *, const char *, uint64_t,
+    uint32_t, int, uint32_t, int, uint8_t *);
+static int	img_saveindex_iter(const struct disk *,
+    const struct disk_sect *, void *);
+static int	img_copy(struct up_ctx *, FILE *, FILE *, const char *);
+static int	img_loaddata(struct img *, FILE *, const char *);
+static int	img_loadindex(struct img *, FILE *, const char *);
+static int	img_index(struct img *);
+static int	img_sortexts(struct img *);
+static int	img_checkext(struct img *, struct imgext *);
+static int	img_extcmp(const void *, const void *);
+
+/* state for writing sector groups out as they're iterated over */
+struct imgwriter {
+	FILE *stream;
+	const char *file;
+	uint64_t datalen;
+	uint32_t datacrc;
+	int groups;		/* number of groups written */
+	int wide;		/* write version 2 index entries */
+	uint64_t idxoff;	/* data offset of the next group indexed */
+	uint32_t idxcrc;
+	int err;
 };
 
-static int	img_read(FILE *, const char *, void *, size_t, int64_t);
-static int	img_checkcrc(struct imghdr *, FILE *, const char *, uint32_t *);
+static int
+img_size_iter(const struct disk *disk, const struct disk_sect *node,
+    void *arg)
+{
+	uint64_t *datalen = arg;
+
+	*datalen += IMG_SECT_LEN +
+	    (uint64_t)UP_SECT_COUNT(node) * UP_DISK_1SECT(disk);
+
+	return (1);
+}
 
 static int
 img_save_iter(const struct disk *disk, const struct disk_sect *node,
     void *arg)
 {
+	struct imgwriter *writer = arg;
 	struct imgsect hdr;
-	uint8_t **data;
+	size_t len;
 
 #ifdef IMG_DEBUG
 	fprintf(stderr, "saving %"PRId64" sectors at offset %"PRId64"\n",
 	    UP_SECT_COUNT(node), UP_SECT_OFF(node));
 #endif
 
-	data = (uint8_t **)arg;
-	memcpy(&hdr, *data, sizeof(hdr));
+	len = UP_SECT_COUNT(node) * UP_DISK_1SECT(disk);
+	memset(&hdr, 0, sizeof(hdr));
 	hdr.off = UP_HTOBE64(UP_SECT_OFF(node));
 	hdr.size = UP_HTOBE64(UP_SECT_COUNT(node));
-	memcpy(*data, &hdr, sizeof(hdr));
-	*data += IMG_SECT_LEN;
-	memcpy(*data, UP_SECT_DATA(node),
-	    UP_SECT_COUNT(node) * UP_DISK_1SECT(disk));
-	*data += UP_SECT_COUNT(node) * UP_DISK_1SECT(disk);
+	if (fwrite(&hdr, IMG_SECT_LEN, 1, writer->stream) != 1 ||
+	    fwrite(UP_SECT_DATA(node), 1, len, writer->stream) != len) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "error writing to %s: %s",
+			    writer->file, os_lasterrstr());
+		writer->err = 1;
+		return (0);
+	}
+	writer->datacrc = up_crc32(&hdr, IMG_SECT_LEN, writer->datacrc);
+	writer->datacrc = up_crc32(UP_SECT_DATA(node), len, writer->datacrc);
+	writer->datalen += IMG_SECT_LEN + len;
+	writer->groups++;
 
 	return (1);
 }
 
+/*
+  Write the index entry for a group written by img_save_iter(). The
+  groups are iterated over again in the same order rather than keeping
+  every entry in memory until the data has all been written.
+*/
+static int
+img_saveindex_iter(const struct disk *disk, const struct disk_sect *node,
+    void *arg)
+{
+	struct imgwriter *writer = arg;
+	struct imgsect hdr;
+	struct imgidx idx;
+	struct imgidx2 idx2;
+	uint32_t crc;
+	void *buf;
+	size_t len;
+
+	len = UP_SECT_COUNT(node) * UP_DISK_1SECT(disk);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.off = UP_HTOBE64(UP_SECT_OFF(node));
+	hdr.size = UP_HTOBE64(UP_SECT_COUNT(node));
+	crc = up_crc32(&hdr, IMG_SECT_LEN, 0);
+	crc = up_crc32(UP_SECT_DATA(node), len, crc);
+
+	if (writer->wide) {
+		memset(&idx2, 0, sizeof(idx2));
+		idx2.off = hdr.off;
+		idx2.size = hdr.size;
+		idx2.dataoff = UP_HTOBE64(writer->idxoff);
+		idx2.crc = UP_HTOBE32(crc);
+		buf = &idx2;
+		len = IMG_IDX2_LEN;
+	} else {
+		idx.off = hdr.off;
+		idx.size = hdr.size;
+		idx.dataoff = UP_HTOBE32(writer->idxoff);
+		idx.crc = UP_HTOBE32(crc);
+		buf = &idx;
+		len = IMG_IDX_LEN;
+	}
+	if (fwrite(buf, len, 1, writer->stream) != 1) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "error writing to %s: %s",
+			    writer->file, os_lasterrstr());
+		writer->err = 1;
+		return (0);
+	}
+	writer->idxcrc = up_crc32(buf, len, writer->idxcrc);
+	writer->idxoff += IMG_SECT_LEN +
+	    (uint64_t)UP_SECT_COUNT(node) * UP_DISK_1SECT(disk);
+
+	return (1);
+}
+
+/*
+  Write an image of the saved sectors, one group at a time, followed by
+  the index of the groups. The header is written last since it has the
+  size and crc of the data, by going back to the start if the stream is
+  seekable. Otherwise the data is staged in a temporary file and copied
+  after the header. Version 2 is only used if there's too much data for
+  version 1, so older versions can still read most images.
+*/
 int
 up_img_save(const struct disk *disk, FILE *stream, const char *label,
     const char *file)
 {
-	struct imghdr hdr;
-	uint8_t *data, *ptr;
-	size_t datalen;
+	struct imgwriter writer;
+	uint8_t hdr[IMG_HDR2_LEN];
+	FILE *tmp;
+	int64_t start, idxlen;
+	uint64_t datalen;
+	size_t hdrlen;
+	int wide, res;
 
 	assert(sizeof(struct imghdr) == IMG_HDR_LEN);
+	assert(sizeof(struct imghdrext) == IMG_HDREXT_LEN);
+	assert(sizeof(struct imghdr2) == IMG_HDR2_LEN);
 	assert(sizeof(struct imgsect) == IMG_SECT_LEN);
+	assert(sizeof(struct imgidx) == IMG_IDX_LEN);
+	assert(sizeof(struct imgidx2) == IMG_IDX2_LEN);
 
 	/* label defaults to the device description */
 	if (label == NULL)
 		label = UP_DISK_DESC(disk);
 
-	/* allocate the data buffer */
-	datalen = disk->sectsused_count *
-	    (UP_DISK_1SECT(disk) + IMG_SECT_LEN);
-	if (disk->sectsused_count == 0)
-		data = NULL;
-	else {
-		if ((data = xalloc(disk->sectsused_count,
-			    UP_DISK_1SECT(disk) + IMG_SECT_LEN, 0)) == NULL)
+	/* the header length depends on the version */
+	datalen = 0;
+	up_disk_sectsiter(disk, img_size_iter, &datalen);
+	wide = (datalen > UINT32_MAX || getenv(IMG_FORCEV2_ENV) != NULL);
+	hdrlen = (wide ? IMG_HDR2_LEN : IMG_HDR_LEN + IMG_HDREXT_LEN);
+
+	tmp = NULL;
+	if ((start = ftello(stream)) < 0 ||
+	    fseeko(stream, start, SEEK_SET) != 0) {
+		if ((tmp = tmpfile()) == NULL) {
+			if (UP_NOISY(disk->ctx, QUIET))
+				up_err(disk->ctx, "failed to create a "
+				    "temporary file: %s", os_lasterrstr());
 			return (-1);
+		}
+	}
+
+	/* leave room for the header, then write the data and index */
+	memset(hdr, 0, sizeof(hdr));
+	memset(&writer, 0, sizeof(writer));
+	writer.stream = (tmp != NULL ? tmp : stream);
+	writer.file = (tmp != NULL ? "temporary file" : file);
+	writer.wide = wide;
+	if (tmp == NULL && fwrite(hdr, hdrlen, 1, stream) != 1) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "error writing to %s: %s",
+			    file, os_lasterrstr());
+		return (-1);
+	}
+	up_disk_sectsiter(disk, img_save_iter, &writer);
+	if (!writer.err)
+		up_disk_sectsiter(disk, img_saveindex_iter, &writer);
+	if (writer.err) {
+		if (tmp != NULL)
+			fclose(tmp);
+		return (-1);
+	}
+	assert(writer.datalen == datalen);
+	assert(writer.idxoff == datalen);
+	idxlen = (int64_t)writer.groups *
+	    (wide ? IMG_IDX2_LEN : IMG_IDX_LEN);
+
+	/* write the header over the space left for it, or before the data */
+	img_mkhdr(disk, label, writer.datalen, writer.datacrc,
+	    writer.groups, writer.idxcrc, wide, hdr);
+	if ((tmp == NULL && fseeko(stream, start, SEEK_SET) != 0) ||
+	    fwrite(hdr, hdrlen, 1, stream) != 1 ||
+	    (tmp == NULL &&
+		fseeko(stream, start + hdrlen + writer.datalen + idxlen,
+		    SEEK_SET) != 0)) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "error writing to %s: %s",
+			    file, os_lasterrstr());
+		if (tmp != NULL)
+			fclose(tmp);
+		return (-1);
+	}
 
-		/* write sectors with sector headers into data buffer */
-		ptr = data;
-		up_disk_sectsiter(disk, img_save_iter, &ptr);
-		/* datalen can be too big since we assume one header per
-		   sector when calculating it, but there may be groups of
-		   multiple sectors */
-		assert(ptr - data <= datalen);
-		datalen = ptr - data;
+	res = 0;
+	if (tmp != NULL) {
+		res = img_copy(disk->ctx, tmp, stream, file);
+		fclose(tmp);
+	}
+
+	return (res);
+}
+
+/* Fill out a version 1.1 or 2.0 header, which must be zeroed first. */
+static void
+img_mkhdr(const struct disk *disk, const char *label, uint64_t datalen,
+    uint32_t datacrc, int idxcount, uint32_t idxcrc, int wide, uint8_t *buf)
+{
+	struct imghdr hdr;
+	struct imghdrext ext;
+	struct imghdr2 hdr2;
+
+	if (wide) {
+		memset(&hdr2, 0, sizeof(hdr2));
+		hdr2.magic = UP_HTOBE64(IMG_MAGIC);
+		hdr2.major = UP_HTOBE16(IMG_V2_MAJOR);
+		hdr2.minor = UP_HTOBE16(IMG_V2_MINOR);
+		hdr2.hdrlen = UP_HTOBE32(IMG_HDR2_LEN);
+		hdr2.hdrcrc = 0;
+		hdr2.sectsize = UP_HTOBE32(UP_DISK_1SECT(disk));
+		hdr2.datastart = UP_HTOBE64(IMG_HDR2_LEN);
+		hdr2.datasize = UP_HTOBE64(datalen);
+		hdr2.datacrc = UP_HTOBE32(datacrc);
+		hdr2.idxcount = UP_HTOBE32(idxcount);
+		hdr2.idxoff = UP_HTOBE64(IMG_HDR2_LEN + datalen);
+		hdr2.idxcrc = UP_HTOBE32(idxcrc);
+		hdr2.pad = 0;
+		hdr2.size = UP_HTOBE64(UP_DISK_SIZESECTS(disk));
+		hdr2.cyls = UP_HTOBE64(UP_DISK_CYLS(disk));
+		hdr2.heads = UP_HTOBE64(UP_DISK_HEADS(disk));
+		hdr2.sects = UP_HTOBE64(UP_DISK_SPT(disk));
+		strlcpy(hdr2.label, label, sizeof(hdr2.label));
+		/* this must go last, for reasons which should be obvious */
+		hdr2.hdrcrc = UP_HTOBE32(up_crc32(&hdr2, IMG_HDR2_LEN, 0));
+		memcpy(buf, &hdr2, IMG_HDR2_LEN);
+		return;
 	}
 
-	/* fill out header */
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.magic = UP_HTOBE64(IMG_MAGIC);
-	hdr.major = UP_HTOBE16(IMG_MAJOR);
-	hdr.minor = UP_HTOBE16(IMG_MINOR);
-	hdr.hdrlen = UP_HTOBE32(IMG_HDR_LEN);
+	hdr.major = UP_HTOBE16(IMG_V1_MAJOR);
+	hdr.minor = UP_HTOBE16(IMG_V1_MINOR);
+	hdr.hdrlen = UP_HTOBE32(IMG_HDR_LEN + IMG_HDREXT_LEN);
 	hdr.hdrcrc = 0;
-	hdr.datastart = UP_HTOBE32(IMG_HDR_LEN);
+	hdr.datastart = UP_HTOBE32(IMG_HDR_LEN + IMG_HDREXT_LEN);
 	hdr.datasize = UP_HTOBE32(datalen);
-	hdr.datacrc = UP_HTOBE32(up_crc32(data, datalen, 0));
+	hdr.datacrc = UP_HTOBE32(datacrc);
 	hdr.sectsize = UP_HTOBE32(UP_DISK_1SECT(disk));
 	hdr.pad = 0;
 	hdr.size = UP_HTOBE64(UP_DISK_SIZESECTS(disk));
@@ -145,63 +434,125 @@ up_img_save(const struct disk *disk, FILE *stream, const char *label,
 	hdr.heads = UP_HTOBE64(UP_DISK_HEADS(disk));
 	hdr.sects = UP_HTOBE64(UP_DISK_SPT(disk));
 	strlcpy(hdr.label, label, sizeof(hdr.label));
+	ext.idxoff = UP_HTOBE64(IMG_HDR_LEN + IMG_HDREXT_LEN + datalen);
+	ext.idxcount = UP_HTOBE32(idxcount);
+	ext.idxcrc = UP_HTOBE32(idxcrc);
 	/* this must go last, for reasons which should be obvious */
-	hdr.hdrcrc = UP_HTOBE32(up_crc32(&hdr, IMG_HDR_LEN, 0));
+	hdr.hdrcrc = UP_HTOBE32(up_crc32(&ext, IMG_HDREXT_LEN,
+		up_crc32(&hdr, IMG_HDR_LEN, 0)));
+	memcpy(buf, &hdr, IMG_HDR_LEN);
+	memcpy(buf + IMG_HDR_LEN, &ext, IMG_HDREXT_LEN);
+}
 
-	/* write the header */
-	if (fwrite(&hdr, IMG_HDR_LEN, 1, stream) != 1) {
-		if (UP_NOISY(QUIET))
-			up_err("error writing to %s: %s",
-			    file, os_lasterrstr());
-		free(data);
+/* Copy a temporary file from the start to the end of another stream. */
+static int
+img_copy(struct up_ctx *ctx, FILE *from, FILE *to, const char *file)
+{
+	char buf[IMG_COPY_LEN];
+	size_t len;
+
+	if (fseeko(from, 0, SEEK_SET) != 0) {
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "failed to seek temporary file: %s",
+			    os_lasterrstr());
 		return (-1);
 	}
-
-	/* write the data buffer */
-	if (datalen > 0) {
-		if (fwrite(data, 1, datalen, stream) != datalen ) {
-			if (UP_NOISY(QUIET))
-				up_err("error writing to %s: %s",
+	while ((len = fread(buf, 1, sizeof(buf), from)) > 0) {
+		if (fwrite(buf, 1, len, to) != len) {
+			if (UP_NOISY(ctx, QUIET))
+				up_err(ctx, "error writing to %s: %s",
 				    file, os_lasterrstr());
-			free(data);
 			return (-1);
 		}
 	}
+	if (ferror(from)) {
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "failed to read temporary file: %s",
+			    os_lasterrstr());
+		return (-1);
+	}
 
-	free(data);
 	return (0);
 }
 
 int
-up_img_load(FILE *stream, const char *name, struct img **ret)
+up_img_load(struct up_ctx *ctx, FILE *stream, const char *name,
+    struct img **ret)
 {
 	struct imghdr hdr;
-	void *data;
-	uint32_t crc;
+	uint8_t *extra;
+	uint32_t crc, hdrlen;
+	int major, minor, known, res;
 
 	assert(sizeof(struct imghdr) == IMG_HDR_LEN);
+	assert(sizeof(struct imghdrext) == IMG_HDREXT_LEN);
+	assert(sizeof(struct imghdr2) == IMG_HDR2_LEN);
 	assert(sizeof(struct imgsect) == IMG_SECT_LEN);
+	assert(sizeof(struct imgidx) == IMG_IDX_LEN);
+	assert(sizeof(struct imgidx2) == IMG_IDX2_LEN);
 	*ret = NULL;
 
-	/* try to read header and check magic */
+	/* try to read header and check magic, both versions start alike */
 	memset(&hdr, 0, sizeof hdr);
-	if (img_read(stream, name, &hdr, IMG_HDR_LEN, 0) != 0)
+	if (img_read(ctx, stream, name, &hdr, IMG_HDR_LEN, 0) != 0)
 		return (-1);
 	if (UP_BETOH64(hdr.magic) != IMG_MAGIC)
 		return (0);
 
-	/* make sure label string is nul-terminated */
-	hdr.label[sizeof(hdr.label)-1] = '\0';
+	/* check version */
+	major = UP_BETOH16(hdr.major);
+	minor = UP_BETOH16(hdr.minor);
+	if (major < IMG_V1_MAJOR || major > IMG_V2_MAJOR) {
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "upart image version %d.x is too %s",
+			    major, (major > IMG_V2_MAJOR ? "new" : "old"));
+		return (-1);
+	}
+	known = (major == IMG_V1_MAJOR ? IMG_V1_MINOR : IMG_V2_MINOR);
+	if(minor > known && UP_NOISY(ctx, QUIET))
+		up_warn(ctx, "treating version %d.%d upart image as %d.%d",
+		    major, minor, major, known);
+
+	/* validate header crc, 1.1 and later have the extension */
+	if (major == IMG_V2_MAJOR)
+		hdrlen = IMG_HDR2_LEN;
+	else if (minor >= 1)
+		hdrlen = IMG_HDR_LEN + IMG_HDREXT_LEN;
+	else
+		hdrlen = IMG_HDR_LEN;
+	if (UP_BETOH32(hdr.hdrlen) < hdrlen ||
+	    (UP_BETOH32(hdr.hdrlen) != hdrlen && minor <= known)) {
+		 if (UP_NOISY(ctx, QUIET))
+		 	up_err(ctx,
+		 	    "corrupt upart image header: invalid version "
+			    "%d.%d header length: %d",
+			    major, minor, UP_BETOH32(hdr.hdrlen));
+		return (-1);
+	}
+	if (img_checkcrc(ctx, &hdr, stream, name, &crc, &extra) < 0)
+		return (-1);
+	if (UP_BETOH32(hdr.hdrcrc) != crc) {
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "corrupt upart image header: "
+			    "header crc check failed");
+		free(extra);
+		return (-1);
+	}
+
+	/* wrap everything up in a struct and return it */
+	if ((*ret = up_xalloc(1, sizeof(**ret), XA_ZERO)) == NULL) {
+		free(extra);
+		return (-1);
+	}
+	(*ret)->ctx = ctx;
+	img_parsehdr(*ret, &hdr, extra);
+	free(extra);
 
 #ifdef IMG_DEBUG
 	fprintf(stderr, "upart image file %s:\n"
-	    "magic           %016"PRIx64"\n"
-	    "major           %u\n"
-            "minor           %u\n"
-            "header size     %u\n"
-            "header crc      0x%08x\n"
-            "data offset     %u\n"
-            "data size       %u\n"
+	    "version         %d.%d\n"
+            "data offset     %"PRIu64"\n"
+            "data size       %"PRIu64"\n"
             "data crc        0x%08x\n"
             "sector size     %u\n"
             "sector count    %"PRId64"\n"
@@ -211,108 +562,152 @@ up_img_load(FILE *stream, const char *name, struct img **ret)
             "label           %s\n"
             "\n",
             name,
-            UP_BETOH64(hdr.magic),
-            UP_BETOH16(hdr.major),
-            UP_BETOH16(hdr.minor),
-            UP_BETOH32(hdr.hdrlen),
-            UP_BETOH32(hdr.hdrcrc),
-            UP_BETOH32(hdr.datastart),
-            UP_BETOH32(hdr.datasize),
-            UP_BETOH32(hdr.datacrc),
-            UP_BETOH32(hdr.sectsize),
-            UP_BETOH64(hdr.size),
-            UP_BETOH64(hdr.cyls),
-            UP_BETOH64(hdr.heads),
-            UP_BETOH64(hdr.sects),
-            hdr.label);
+            (*ret)->major, (*ret)->minor,
+            (*ret)->datastart,
+            (*ret)->datasize,
+            (*ret)->datacrc,
+            (*ret)->sectsize,
+            (*ret)->size,
+            (*ret)->cyls,
+            (*ret)->heads,
+            (*ret)->sects,
+            (*ret)->label);
 #endif /* IMG_DEBUG */
 
-	/* check version */
-	if (UP_BETOH16(hdr.major) != IMG_MAJOR) {
-		if (UP_NOISY(QUIET))
-			up_err("upart image version %d.x is too %s",
-			    UP_BETOH16(hdr.major),
-			    (UP_BETOH16(hdr.major) > IMG_MAJOR ?
-			"new" : "old"));
-		return (-1);
+	res = 0;
+	if ((*ret)->datastart < UP_BETOH32(hdr.hdrlen)) {
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "corrupt upart image header: "
+			    "data offset inside header: %"PRIu64,
+			    (*ret)->datastart);
+		res = -1;
 	}
-	if(UP_BETOH16(hdr.minor) > IMG_MINOR && UP_NOISY(QUIET))
-		up_warn("treating version %d.%d upart image as %d.%d",
-		    UP_BETOH16(hdr.major), UP_BETOH16(hdr.minor),
-		    IMG_MAJOR, IMG_MINOR);
-
-	/* validate header crc */
-	if (UP_BETOH32(hdr.hdrlen) < IMG_HDR_LEN ||
-	    (UP_BETOH32(hdr.hdrlen) != IMG_HDR_LEN &&
-	     UP_BETOH16(hdr.minor) == IMG_MINOR)) {
-		 if (UP_NOISY(QUIET))
-		 	up_err("corrupt upart image header: invalid version "
-			    "%d.%d header length: %d",
-			    UP_BETOH16(hdr.major), UP_BETOH16(hdr.minor),
-			    UP_BETOH32(hdr.hdrlen));
-		return (-1);
+	if (res == 0 && (*ret)->datasize > INT64_MAX - (*ret)->datastart) {
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "corrupt upart image header: "
+			    "data size out of range: %"PRIu64,
+			    (*ret)->datasize);
+		res = -1;
 	}
-	if (img_checkcrc(&hdr, stream, name, &crc) < 0)
-		return (-1);
-	if (UP_BETOH32(hdr.hdrcrc) != crc) {
-		if (UP_NOISY(QUIET))
-			up_err("corrupt upart image header: "
-			    "header crc check failed");
+	if (res == 0)
+		res = img_loaddata(*ret, stream, name);
+	if (res == 0 && (*ret)->hasindex)
+		res = img_loadindex(*ret, stream, name);
+	if (res == 0)
+		res = img_index(*ret);
+	if (res < 0 || (ctx->opts.strictimg && up_img_verify(*ret) < 0)) {
+		up_img_free(*ret);
+		*ret = NULL;
 		return (-1);
 	}
 
-	/* allocate data buffer and read data */
-	if ((data = xalloc(1, UP_BETOH32(hdr.datasize), 0)) == NULL)
-		return (-1);
-	if (img_read(stream, name, data, UP_BETOH32(hdr.datasize),
-		UP_BETOH32(hdr.datastart)) != 0) {
-		free(data);
-		return (-1);
-	}
+	return (1);
+}
 
-	/* validate the data crc */
-	if (up_crc32(data, UP_BETOH32(hdr.datasize), 0) !=
-	    UP_BETOH32(hdr.datacrc)) {
-		if (UP_NOISY(QUIET))
-			up_err("corrupt upart image: data crc check failed");
-		free(data);
-		return (-1);
+/*
+  Copy the fields from a header into host byte order, with the rest of
+  the header after the part both versions have in EXTRA.
+*/
+static void
+img_parsehdr(struct img *img, const struct imghdr *hdr,
+    const uint8_t *extra)
+{
+	struct imghdrext ext;
+	struct imghdr2 hdr2;
+
+	img->major = UP_BETOH16(hdr->major);
+	img->minor = UP_BETOH16(hdr->minor);
+
+	if (img->major == IMG_V2_MAJOR) {
+		memcpy(&hdr2, hdr, IMG_HDR_LEN);
+		memcpy((uint8_t *)&hdr2 + IMG_HDR_LEN, extra,
+		    IMG_HDR2_LEN - IMG_HDR_LEN);
+		img->datastart = UP_BETOH64(hdr2.datastart);
+		img->datasize = UP_BETOH64(hdr2.datasize);
+		img->datacrc = UP_BETOH32(hdr2.datacrc);
+		img->sectsize = UP_BETOH32(hdr2.sectsize);
+		img->size = UP_BETOH64(hdr2.size);
+		img->cyls = UP_BETOH64(hdr2.cyls);
+		img->heads = UP_BETOH64(hdr2.heads);
+		img->sects = UP_BETOH64(hdr2.sects);
+		memcpy(img->label, hdr2.label, sizeof(img->label));
+		img->hasindex = 1;
+		img->idxoff = UP_BETOH64(hdr2.idxoff);
+		img->idxcount = UP_BETOH32(hdr2.idxcount);
+		img->idxcrc = UP_BETOH32(hdr2.idxcrc);
+	} else {
+		img->datastart = UP_BETOH32(hdr->datastart);
+		img->datasize = UP_BETOH32(hdr->datasize);
+		img->datacrc = UP_BETOH32(hdr->datacrc);
+		img->sectsize = UP_BETOH32(hdr->sectsize);
+		img->size = UP_BETOH64(hdr->size);
+		img->cyls = UP_BETOH64(hdr->cyls);
+		img->heads = UP_BETOH64(hdr->heads);
+		img->sects = UP_BETOH64(hdr->sects);
+		memcpy(img->label, hdr->label, sizeof(img->label));
+		/* the extension comes first in the extra data */
+		if (img->minor >= 1) {
+			memcpy(&ext, extra, IMG_HDREXT_LEN);
+			img->hasindex = 1;
+			img->idxoff = UP_BETOH64(ext.idxoff);
+			img->idxcount = UP_BETOH32(ext.idxcount);
+			img->idxcrc = UP_BETOH32(ext.idxcrc);
+		}
 	}
 
-	/* wrap everything up in a struct and return it */
-	if ((*ret = xalloc(1, sizeof(**ret), XA_ZERO)) == NULL) {
-		free(data);
+	/* make sure label string is nul-terminated */
+	img->label[sizeof(img->label)-1] = '\0';
+}
+
+/*
+  Check the data crc if it hasn't been already. Sectors are read from
+  images before this unless the strictimg option is set, so anything
+  found in them isn't to be trusted if it fails. Images with an index
+  have each group checked when it's first read instead.
+*/
+int
+up_img_verify(struct img *img)
+{
+	if (img->indexed && !img->ctx->opts.strictimg)
+		return (0);
+	if (img->verified == 0)
+		img->verified = (up_crc32(img->data, img->datasize, 0) ==
+		    img->datacrc ? 1 : -1);
+	if (img->verified < 0) {
+		if (UP_NOISY(img->ctx, QUIET))
+			up_err(img->ctx,
+			    "corrupt upart image: data crc check failed");
 		return (-1);
 	}
-	(*ret)->hdr = hdr;
-	(*ret)->data = data;
 
-	return (1);
+	return (0);
 }
 
 void
 up_img_getparams(struct img *img, struct disk_params *params)
 {
-	params->sectsize = UP_BETOH32(img->hdr.sectsize);
-	params->size = UP_BETOH64(img->hdr.size);
-	params->cyls = UP_BETOH64(img->hdr.cyls);
-	params->heads = UP_BETOH64(img->hdr.heads);
-	params->sects = UP_BETOH64(img->hdr.sects);
+	params->sectsize = img->sectsize;
+	params->size = img->size;
+	params->cyls = img->cyls;
+	params->heads = img->heads;
+	params->sects = img->sects;
 }
 
 const char *
 up_img_getlabel(struct img *img)
 {
-	assert(memchr(img->hdr.label, 0, sizeof(img->hdr.label)));
-	return (img->hdr.label);
+	assert(memchr(img->label, 0, sizeof(img->label)));
+	return (img->label);
 }
 
 int64_t
 up_img_read(struct img *img, int64_t start, int64_t sects, void *_buf)
 {
+	struct imgext *ext;
 	uint8_t *buf;
-	size_t imgoff, sectsize;
-	struct imgsect sect;
+	size_t sectsize;
+	int64_t count, done;
+	int lo, hi, mid;
 
 #ifdef IMG_DEBUG
 	fprintf(stderr, "searching for %"PRId64" sectors at offset %"
@@ -320,9 +715,134 @@ up_img_read(struct img *img, int64_t start, int64_t sects, void *_buf)
 #endif
 
 	buf = _buf;
+	sectsize = img->sectsize;
+	img->readerr = NULL;
+
+	/* find the first group which doesn't end before the read starts */
+	lo = 0;
+	hi = img->extcount;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (img->exts[mid].last < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* copy from each group the read spans and zero-fill the gaps */
+	for (done = 0; done < sects; done += count) {
+		ext = (lo < img->extcount ? &img->exts[lo] : NULL);
+		if (ext == NULL || ext->first > start + done) {
+			count = sects - done;
+			if (ext != NULL)
+				count = MIN(count, ext->first - start - done);
+#ifdef IMG_DEBUG
+			fprintf(stderr, "warning: %"PRId64" sector(s) at "
+			    "%"PRId64" not found in image file\n", count,
+			    start + done);
+#endif
+			memset(buf + done * sectsize, 0, count * sectsize);
+			continue;
+		}
+		if (ext->checked == 0)
+			ext->checked = img_checkext(img, ext);
+		if (ext->checked < 0) {
+			img->readerr = "image data crc check failed";
+			return (-1);
+		}
+		count = MIN(sects - done, ext->last - (start + done) + 1);
+		memcpy(buf + done * sectsize, img->data + ext->dataoff +
+		    (start + done - ext->first) * sectsize, count * sectsize);
+		lo++;
+	}
+
+	return (sects);
+}
+
+const char *
+up_img_readerr(const struct img *img)
+{
+	return (img->readerr != NULL ? img->readerr : "unknown error");
+}
+
+void
+up_img_free(struct img *img)
+{
+	if(img != NULL) {
+		free(img->exts);
+		free(img->databuf);
+		if (img->map != NULL)
+			os_file_unmap(img->map, img->maplen);
+		free(img);
+	}
+}
+
+/*
+  Map the image file and point at the data in the mapping, so only the
+  parts of it which are used are read, or read all of the data into a
+  buffer if the file can't be mapped or -d was given.
+*/
+static int
+img_loaddata(struct img *img, FILE *stream, const char *name)
+{
+	int64_t start, size;
+
+	start = img->datastart;
+	size = img->datasize;
+	img->maplen = os_file_size(stream);
+	if (!img->ctx->opts.directio && img->maplen >= start + size &&
+	    (img->map = os_file_map(stream, img->maplen)) != NULL) {
+		img->data = (const uint8_t *)img->map + start;
+		return (0);
+	}
+	img->maplen = 0;
+
+	if ((uint64_t)size > SIZE_MAX) {
+		if (UP_NOISY(img->ctx, QUIET))
+			up_err(img->ctx, "upart image data is too large to "
+			    "load: %"PRId64" bytes", size);
+		return (-1);
+	}
+	if (size == 0)
+		return (0);
+	if ((img->databuf = up_xalloc(1, size, 0)) == NULL)
+		return (-1);
+	if (img_read(img->ctx, stream, name, img->databuf, size, start) != 0)
+		return (-1);
+	img->data = img->databuf;
+
+	return (0);
+}
+
+/*
+  Build the sorted list of sector groups used by up_img_read(),
+  checking that each one lies within the data and that none of them
+  overlap.
+*/
+static int
+img_index(struct img *img)
+{
+	struct imgsect sect;
+	struct imgext *exts;
+	uint64_t datasize, imgoff, sectsize;
+	int alloc;
+
+	datasize = img->datasize;
+	sectsize = img->sectsize;
+	img->exts = NULL;
+	img->extcount = 0;
+	if (datasize <= IMG_SECT_LEN)
+		return (0);
+	if (sectsize == 0) {
+		if (UP_NOISY(img->ctx, QUIET))
+			up_err(img->ctx, "corrupt upart image header: "
+			    "invalid sector size: 0");
+		return (-1);
+	}
+
+	alloc = 0;
 	imgoff = 0;
-	sectsize = UP_BETOH32(img->hdr.sectsize);
-	while (UP_BETOH32(img->hdr.datasize) - imgoff > IMG_SECT_LEN) {
+	while (datasize - imgoff > IMG_SECT_LEN) {
 		memcpy(&sect, img->data + imgoff, IMG_SECT_LEN);
 		sect.off = UP_BETOH64(sect.off);
 		sect.size = UP_BETOH64(sect.size);
@@ -331,66 +851,212 @@ up_img_read(struct img *img, int64_t start, int64_t sects, void *_buf)
 		fprintf(stderr, "found %"PRId64" sectors at offset %"
 		    PRId64"\n", sect.size, sect.off);
 #endif
-		/* XXX should sanity-check data when image is first read */
-		if (UP_BETOH32(img->hdr.datasize) - imgoff <
-		    sect.size * sectsize) {
-			if (UP_NOISY(QUIET))
-				up_err("truncated image file data");
+		if ((datasize - imgoff) / sectsize < sect.size ||
+		    sect.off > INT64_MAX - sect.size) {
+			if (UP_NOISY(img->ctx, QUIET))
+				up_err(img->ctx, "corrupt upart image: "
+				    "group of %"PRIu64" sector(s) at %"PRIu64
+				    " is out of range", sect.size, sect.off);
 			return (-1);
 		}
-		if (start >= sect.off && start < sect.off + sect.size) {
-			if (start > sect.off) {
-				imgoff += (start - sect.off) * sectsize;
-				sect.size -= start - sect.off;
-				sect.off = start;
-			}
-			if (sects > sect.size) {
-				memcpy(buf, img->data + imgoff,
-				    sect.size * sectsize);
-				start += sect.size;
-				sects -= sect.size;
-				buf += sect.size * sectsize;
-				return (up_img_read(img, start, sects, buf) +
-				    sect.size);
-			} else {
-				memcpy(buf, img->data + imgoff,
-				    sects * sectsize);
-				return (sects);
-			}
+		if (sect.size > 0 && img->extcount == alloc) {
+			if ((exts = up_xalloc(alloc * 2 + 64, sizeof(*exts),
+				    0)) == NULL)
+				return (-1);
+			if (img->extcount > 0)
+				memcpy(exts, img->exts,
+				    img->extcount * sizeof(*exts));
+			free(img->exts);
+			img->exts = exts;
+			alloc = alloc * 2 + 64;
+		}
+		if (sect.size > 0) {
+			img->exts[img->extcount].first = sect.off;
+			img->exts[img->extcount].last =
+			    sect.off + sect.size - 1;
+			img->exts[img->extcount].dataoff = imgoff;
+			/* covered by the data crc instead */
+			img->exts[img->extcount].checked = 1;
+			img->extcount++;
 		}
 		imgoff += sect.size * sectsize;
 	}
 
-#ifdef IMG_DEBUG
-	fprintf(stderr, "warning: sector %"PRId64" not found in image file\n",
-	    start);
-#endif
-	memset(buf, 0, sects * sectsize);
-	return sects;
+	return (img_sortexts(img));
 }
 
-void
-up_img_free(struct img *img)
+/*
+  Read the sector group index from the end of a version 1.1 or later
+  image and build the list of groups from it without walking the data.
+  Returns 0 if the index can't be used, in which case the data is
+  walked instead.
+*/
+static int
+img_loadindex(struct img *img, FILE *stream, const char *name)
 {
-	if(img != NULL) {
-		free(img->data);
-		free(img);
+	const uint8_t *entries;
+	struct imgidx idx;
+	struct imgidx2 idx2;
+	struct imgext *dest;
+	uint8_t *buf;
+	uint64_t datasize, sectsize, off, size, dataoff;
+	int64_t filesize;
+	uint32_t count, i;
+	size_t len, entlen;
+	int res;
+
+	datasize = img->datasize;
+	sectsize = img->sectsize;
+	count = img->idxcount;
+	entlen = (img->major == IMG_V2_MAJOR ? IMG_IDX2_LEN : IMG_IDX_LEN);
+
+	/* every group has a header and at least one sector */
+	res = 0;
+	buf = NULL;
+	filesize = (img->map != NULL ? img->maplen : os_file_size(stream));
+	if (sectsize == 0 || count > datasize / (IMG_SECT_LEN + sectsize) ||
+	    count > SIZE_MAX / entlen ||
+	    img->idxoff < img->datastart + datasize ||
+	    filesize < 0 || img->idxoff > (uint64_t)filesize ||
+	    (uint64_t)filesize - img->idxoff < (uint64_t)count * entlen)
+		goto done;
+	len = (size_t)count * entlen;
+	if (img->map != NULL)
+		entries = (const uint8_t *)img->map + img->idxoff;
+	else {
+		if ((buf = up_xalloc(count, entlen, 0)) == NULL ||
+		    img_read(img->ctx, stream, name, buf, len,
+			img->idxoff) != 0) {
+			free(buf);
+			return (-1);
+		}
+		entries = buf;
+	}
+	if (up_crc32(entries, len, 0) != img->idxcrc)
+		goto done;
+
+	if (count > 0 &&
+	    (img->exts = up_xalloc(count, sizeof(*img->exts),
+		XA_ZERO)) == NULL) {
+		free(buf);
+		return (-1);
+	}
+	img->extcount = 0;
+	for (i = 0; i < count; i++) {
+		if (img->major == IMG_V2_MAJOR) {
+			memcpy(&idx2, entries + i * entlen, IMG_IDX2_LEN);
+			off = UP_BETOH64(idx2.off);
+			size = UP_BETOH64(idx2.size);
+			dataoff = UP_BETOH64(idx2.dataoff);
+			dest = &img->exts[img->extcount];
+			dest->crc = UP_BETOH32(idx2.crc);
+		} else {
+			memcpy(&idx, entries + i * entlen, IMG_IDX_LEN);
+			off = UP_BETOH64(idx.off);
+			size = UP_BETOH64(idx.size);
+			dataoff = UP_BETOH32(idx.dataoff);
+			dest = &img->exts[img->extcount];
+			dest->crc = UP_BETOH32(idx.crc);
+		}
+		if (size == 0 || dataoff > datasize - IMG_SECT_LEN ||
+		    (datasize - IMG_SECT_LEN - dataoff) / sectsize < size ||
+		    off > INT64_MAX - size) {
+			free(img->exts);
+			img->exts = NULL;
+			img->extcount = 0;
+			goto done;
+		}
+		dest->first = off;
+		dest->last = off + size - 1;
+		dest->dataoff = dataoff + IMG_SECT_LEN;
+		img->extcount++;
 	}
+	img->indexed = 1;
+	res = (img_sortexts(img) < 0 ? -1 : 1);
+
+done:
+	free(buf);
+	/* later versions may not have the index where this one expects */
+	if (res == 0 && img->minor == (img->major == IMG_V2_MAJOR ?
+		IMG_V2_MINOR : IMG_V1_MINOR) && UP_NOISY(img->ctx, QUIET))
+		up_warn(img->ctx, "corrupt upart image: "
+		    "ignoring invalid sector group index");
+	return (res);
 }
 
+/* Sort the sector groups and check that none of them overlap. */
 static int
-img_read(FILE *stream, const char *name, void *buf, size_t size, int64_t off)
+img_sortexts(struct img *img)
+{
+	int i;
+
+	if (img->extcount == 0)
+		return (0);
+
+	/* images are written in order, but don't rely on it */
+	qsort(img->exts, img->extcount, sizeof(*img->exts), img_extcmp);
+	for (i = 1; i < img->extcount; i++) {
+		if (img->exts[i].first <= img->exts[i - 1].last) {
+			if (UP_NOISY(img->ctx, QUIET))
+				up_err(img->ctx, "corrupt upart image: sector "
+				    "groups at %"PRId64" and %"PRId64" "
+				    "overlap", img->exts[i - 1].first,
+				    img->exts[i].first);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+  Check the crc of a group from the index the first time it's read,
+  and that its header matches the index entry. Returns 1 if it's good
+  or -1 if it isn't.
+*/
+static int
+img_checkext(struct img *img, struct imgext *ext)
+{
+	struct imgsect sect;
+	const uint8_t *hdr;
+	size_t len;
+
+	hdr = img->data + ext->dataoff - IMG_SECT_LEN;
+	len = (ext->last - ext->first + 1) * img->sectsize;
+	memcpy(&sect, hdr, IMG_SECT_LEN);
+	if (UP_BETOH64(sect.off) != (uint64_t)ext->first ||
+	    UP_BETOH64(sect.size) != (uint64_t)(ext->last - ext->first + 1) ||
+	    up_crc32(hdr, IMG_SECT_LEN + len, 0) != ext->crc)
+		return (-1);
+
+	return (1);
+}
+
+static int
+img_extcmp(const void *left, const void *right)
+{
+	const struct imgext *a = left, *b = right;
+
+	if (a->first != b->first)
+		return (a->first < b->first ? -1 : 1);
+	return (0);
+}
+
+static int
+img_read(struct up_ctx *ctx, FILE *stream, const char *name, void *buf,
+    size_t size, int64_t off)
 {
 	if (fseeko(stream, off, SEEK_SET) != 0) {
-		if (UP_NOISY(QUIET))
-			up_err("failed to seek image file %s: %s",
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "failed to seek image file %s: %s",
 			    name, os_lasterrstr());
 		return (-1);
 	}
 
 	if (fread(buf, 1, size, stream) != size) {
-		if (UP_NOISY(QUIET))
-			up_err("failed to read from image file %s: %s", name,
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx,
+			    "failed to read from image file %s: %s", name,
 			    (ferror(stream) ? os_lasterrstr() :
 				"unexpected end of file"));
 		return (-1);
@@ -399,12 +1065,16 @@ img_read(FILE *stream, const char *name, void *buf, size_t size, int64_t off)
 	return (0);
 }
 
+/*
+  Get the crc of the header, with the rest of it after the part both
+  versions have returned in EXTRA, which must be freed.
+*/
 static int
-img_checkcrc(struct imghdr *hdr, FILE *stream, const char *name, uint32_t *ret)
+img_checkcrc(struct up_ctx *ctx, struct imghdr *hdr, FILE *stream,
+    const char *name, uint32_t *ret, uint8_t **extra)
 {
 	uint32_t old, crc;
-	void *extra;
-	ssize_t len;
+	size_t len;
 
 	/* get the crc of the main header first */
 	old = hdr->hdrcrc;
@@ -413,18 +1083,20 @@ img_checkcrc(struct imghdr *hdr, FILE *stream, const char *name, uint32_t *ret)
 	hdr->hdrcrc = old;
 
 	/* if there's extra header data, read it in and get it's crc too */
+	*extra = NULL;
 	len = UP_BETOH32(hdr->hdrlen) - sizeof *hdr;
 	if (len > 0) {
-		if ((extra = xalloc(len, 1, 0)) == NULL)
+		if ((*extra = up_xalloc(len, 1, 0)) == NULL)
 			return (-1);
-		if (img_read(stream, name, extra, len, IMG_HDR_LEN) != 0) {
-			free(extra);
+		if (img_read(ctx, stream, name, *extra, len,
+			IMG_HDR_LEN) != 0) {
+			free(*extra);
+			*extra = NULL;
 			return (-1);
 		}
-		crc = up_crc32(extra, len, crc);
-		free(extra);
+		crc = up_crc32(*extra, len, crc);
 	}
 
-	*ret = crc;	
+	*ret = crc;
 	return (0);
 }
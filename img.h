@@ -20,15 +20,20 @@
 struct disk;
 struct img;
 struct disk_params;
+struct up_ctx;
 
 /* serialize disk metainfo and partition sectors to a file */
 int		 up_img_save(const struct disk *, FILE *, const char *,
     const char *);
 
-int		 up_img_load(FILE *, const char *, struct img **);
+int		 up_img_load(struct up_ctx *, FILE *, const char *,
+    struct img **);
 void		 up_img_getparams(struct img *, struct disk_params *);
 const char	*up_img_getlabel(struct img *);
 int64_t		 up_img_read(struct img *, int64_t, int64_t, void *);
+/* describe why the last up_img_read() failed */
+const char	*up_img_readerr(const struct img *);
+int		 up_img_verify(struct img *);
 void		 up_img_free(struct img *);
 
 #endif
@@ -28,53 +28,82 @@
 #endif
 
 
-#include "apm.h"
-#include "bsdlabel.h"
-#include "disk.h"
-#include "gpt.h"
-#include "img.h"
-#include "map.h"
-#include "mbr.h"
 #include "os.h"
-#include "softraid.h"
-#include "sunlabel-sparc.h"
-#include "sunlabel-x86.h"
-#include "util.h"
+#include "upart.h"
 
-static char	*readargs(int, char *[], struct opts *, struct disk_params *);
+/* exit status when -c finds no map of the requested types */
+#define EXIT_NOMATCH		(2)
+/* more threads than this won't make reading one disk any faster */
+#define MAX_JOBS		(256)
+
+static char	*readargs(int, char *[], struct opts *, struct disk_params *,
+    int *);
 static void	 usage(const char *, ...);
 static int	 serialize(const struct disk *);
+static int	 scan(struct up_ctx *, const char *, const struct disk_params *);
+static int	 classify(struct up_ctx *, struct disk *);
+static int	 classtypes(struct up_ctx *, const char *, unsigned int *);
+
+static const char *st_progname;
 
 int
 main(int argc, char *argv[])
 {
 	struct disk_params params;
 	struct opts newopts;
+	struct up_ctx *ctx;
 	char *name;
-	struct disk *disk;
-	int ret;
+	int dolist, ret;
 
-	if (up_savename(argv[0]) < 0 ||
-	    up_getendian() < 0)
+	if ((st_progname = strrchr(argv[0], '/')) == NULL || !*(++st_progname))
+		st_progname = argv[0];
+
+	name = readargs(argc, argv, &newopts, &params, &dolist);
+	if (name == NULL && !dolist)
 		return (EXIT_FAILURE);
-	up_mbr_register();
-	up_bsdlabel_register();
-	up_apm_register();
-	up_sunlabel_sparc_register();
-	up_sunlabel_x86_register();
-	up_gpt_register();
-	up_softraid_register();
-
-	name = readargs(argc, argv, &newopts, &params);
-	if (name == NULL)
+	if ((ctx = up_ctx_new(st_progname, &newopts)) == NULL)
 		return (EXIT_FAILURE);
-	set_options(&newopts);
 
-	disk = up_disk_open(name);
+	if (dolist)
+		ret = (up_ctx_listdevices(ctx, stdout) < 0 ?
+		    EXIT_FAILURE : EXIT_SUCCESS);
+	else
+		ret = scan(ctx, name, &params);
+
+	up_ctx_free(ctx);
+
+	return (ret);
+}
+
+static int
+scan(struct up_ctx *ctx, const char *name, const struct disk_params *params)
+{
+	const struct opts *opts;
+	struct disk *disk;
+	int ret;
+
+	opts = &ctx->opts;
+	disk = up_disk_open(ctx, name);
 	if (!disk)
 		return (EXIT_FAILURE);
-	if (up_disk_setup(disk, &params) < 0 ||
-	    up_map_loadall(disk) < 0) {
+	if (up_disk_setup(disk, params) < 0) {
+		up_disk_close(disk);
+		return (EXIT_FAILURE);
+	}
+	if (opts->classify) {
+		ret = classify(ctx, disk);
+		up_disk_close(disk);
+		return (ret);
+	}
+
+	/* with -p each map is printed while loading as it's found */
+	if (opts->progressive) {
+		up_disk_print(disk, stdout);
+		fflush(stdout);
+	}
+	/* images are checked after loading rather than before unless -I */
+	if (up_map_loaddepth(disk, opts->maxdepth) < 0 ||
+	    up_disk_verify(disk) < 0) {
 		up_disk_close(disk);
 		return (EXIT_FAILURE);
 	}
@@ -84,40 +113,126 @@ main(int argc, char *argv[])
 		if (serialize(disk) < 0)
 			ret = (EXIT_FAILURE);
 	} else {
-		up_disk_print(disk, stdout);
-		up_map_printall(disk, stdout);
-		if (UP_NOISY(SPAM))
+		if (!opts->progressive) {
+			up_disk_print(disk, stdout);
+			up_map_printall(disk, stdout);
+		}
+		if (UP_NOISY(ctx, SPAM))
 			up_disk_dump(disk, stdout);
 	}
+	if (opts->iostats) {
+		up_disk_printstats(disk, stderr);
+		up_map_printstats(disk, stderr);
+	}
+	if (up_disk_degraded(disk))
+		ret = EXIT_FAILURE;
 
 	up_disk_close(disk);
 
 	return (ret);
 }
 
+/*
+  Look for the first map of the types given with -c and print a line
+  saying what was found, reading as little of the disk as possible.
+*/
+static int
+classify(struct up_ctx *ctx, struct disk *disk)
+{
+	unsigned int types;
+	enum mapid type;
+	int maxdepth, res;
+
+	if (classtypes(ctx, ctx->opts.classify, &types) < 0)
+		return (EXIT_FAILURE);
+	maxdepth = (ctx->opts.maxdepth > 0 ? ctx->opts.maxdepth : 1);
+	res = up_map_classify(disk, types, maxdepth, &type);
+	if (res >= 0 && up_disk_verify(disk) < 0)
+		res = -1;
+	if (res >= 0)
+		printf("%s: %s\n", UP_DISK_PATH(disk),
+		    type != UP_MAP_NONE ? ctx->types[type].name : "none");
+	if (ctx->opts.iostats) {
+		up_disk_printstats(disk, stderr);
+		up_map_printstats(disk, stderr);
+	}
+
+	if (res < 0 || up_disk_degraded(disk))
+		return (EXIT_FAILURE);
+	return (res > 0 ? EXIT_SUCCESS : EXIT_NOMATCH);
+}
+
+/* Parse a comma-separated list of map type names, or "all". */
+static int
+classtypes(struct up_ctx *ctx, const char *list, unsigned int *types)
+{
+	const char *start;
+	char name[32];
+	enum mapid type;
+	size_t len;
+
+	*types = 0;
+	start = list;
+	for (;;) {
+		len = strcspn(list, ",");
+		if (len == 0) {
+			up_err(ctx, "empty map type name in list: \"%s\"",
+			    start);
+			return (-1);
+		}
+		snprintf(name, sizeof(name), "%.*s", (int)len, list);
+		if (strcmp(name, "all") == 0)
+			*types |= UP_MAP_ALLTYPES;
+		else if (len < sizeof(name) &&
+		    (type = up_map_typebyname(ctx, name)) != UP_MAP_NONE)
+			*types |= UP_MAP_BIT(type);
+		else {
+			up_err(ctx, "unknown map type: %.*s", (int)len, list);
+			return (-1);
+		}
+		if (list[len] == '\0')
+			break;
+		list += len + 1;
+	}
+
+	return (0);
+}
+
 static char *
 readargs(int argc, char *argv[], struct opts *newopts,
-    struct disk_params *params)
+    struct disk_params *params, int *dolist)
 {
-	int opt, dolist;
+	long num;
+	int opt;
 
 	/*
-	  Note that the global options aren't initialized yet, do not
-	  call any function which might try to read them unless you
-	  like segfaults. This includes the verbosity option check
-	  that is done before printing error messages.
+	  Note that there is no context yet, so errors can only be
+	  reported with usage().
 	*/
 
-	dolist = 0;
-	init_options(newopts);
+	*dolist = 0;
+	up_init_options(newopts);
 	memset(params, 0, sizeof *params);
-	while(0 < (opt = getopt(argc, argv, "C:fhH:klL:qrsS:vVw:xz:"))) {
+	while(0 < (opt = getopt(argc, argv,
+		    "c:C:dD:fhH:iIj:klL:M:N:pqrR:sS:t:T:vVw:xz:"))) {
 		switch(opt) {
+		case 'c':
+			newopts->classify = optarg;
+			break;
 		case 'C':
 			params->cyls = strtol(optarg, NULL, 0);
 			if (0 >= params->cyls)
 				usage("illegal cylinder count: %s", optarg);
 			break;
+		case 'd':
+			newopts->directio = 1;
+			break;
+		case 'D':
+			num = strtol(optarg, NULL, 0);
+			if (0 >= num || INT_MAX < num)
+				usage("illegal map depth: %s", optarg);
+			newopts->maxdepth = num;
+			break;
 		case 'f':
 			newopts->plainfile = 1;
 			break;
@@ -130,21 +245,53 @@ readargs(int argc, char *argv[], struct opts *newopts,
 				usage("illegal tracks per cylinder (ie: head) "
 				    "count: %s", optarg);
 			break;
+		case 'i':
+			newopts->iostats = 1;
+			break;
+		case 'I':
+			newopts->strictimg = 1;
+			break;
+		case 'j':
+			num = strtol(optarg, NULL, 0);
+			if (0 >= num || MAX_JOBS < num)
+				usage("illegal number of jobs: %s", optarg);
+			newopts->jobs = num;
+			break;
 		case 'k':
 			newopts->sloppyio = 1;
 			break;
 		case 'l':
-			dolist = 1;
+			*dolist = 1;
 			break;
 		case 'L':
 			newopts->label = optarg;
 			break;
+		case 'M':
+			num = strtol(optarg, NULL, 0);
+			if (0 >= num || INT_MAX < num)
+				usage("illegal map count: %s", optarg);
+			newopts->maxmaps = num;
+			break;
+		case 'N':
+			num = strtol(optarg, NULL, 0);
+			if (0 >= num || INT_MAX < num)
+				usage("illegal map nesting depth: %s", optarg);
+			newopts->maxnest = num;
+			break;
+		case 'p':
+			newopts->progressive = 1;
+			break;
 		case 'q':
 			newopts->verbosity--;
 			break;
 		case 'r':
 			newopts->relaxed = 1;
 			break;
+		case 'R':
+			newopts->maxsects = strtoll(optarg, NULL, 0);
+			if (0 >= newopts->maxsects)
+				usage("illegal sector count: %s", optarg);
+			break;
 		case 's':
 			newopts->swapcols = 1;
 			break;
@@ -153,6 +300,18 @@ readargs(int argc, char *argv[], struct opts *newopts,
 			if (0 >= params->sects)
 				usage("illegal sectors per track count (sectors): %s", optarg);
 			break;
+		case 't':
+			num = strtol(optarg, NULL, 0);
+			if (0 >= num || INT_MAX < num)
+				usage("illegal read timeout: %s", optarg);
+			newopts->readtimeout = num;
+			break;
+		case 'T':
+			num = strtol(optarg, NULL, 0);
+			if (0 >= num || INT_MAX / 1000 < num)
+				usage("illegal disk timeout: %s", optarg);
+			newopts->disktimeout = num * 1000;
+			break;
 		case 'v':
 			newopts->verbosity++;
 			break;
@@ -179,15 +338,16 @@ readargs(int argc, char *argv[], struct opts *newopts,
 		}
 	}
 
-	if (dolist) {
-		/* XXX argument validation? */
-		set_options(newopts);
-		os_list_devices(stdout);
-		exit(EXIT_SUCCESS);
-	}
+	/* XXX argument validation? */
+	if (*dolist)
+		return (NULL);
 
 	if (newopts->label && !newopts->serialize)
 		usage("-w is required for -L");
+	if (newopts->progressive && newopts->serialize)
+		usage("-p can't be used with -w");
+	if (newopts->classify && (newopts->progressive || newopts->serialize))
+		usage("-c can't be used with -p or -w");
 	if (optind + 1 == argc)
 		return (argv[optind]);
 	else
@@ -208,23 +368,35 @@ usage(const char *message, ...)
 	}
 
 	printf("usage: %s [options] path\n"
+	    "  -c types  print the first map of types found and exit\n"
 	    "  -C cyls   total number of cylinders (cylinders)\n"
+	    "  -d        bypass the OS cache when reading, don't map files\n"
+	    "  -D depth  only load maps nested up to depth levels deep\n"
 	    "  -f        path is a plain file and not a device\n"
 	    "  -h        show human-readable sizes\n"
 	    "  -H heads  number of tracks per cylinder (heads)\n"
+	    "  -i        print disk read statistics when finished\n"
+	    "  -I        check image checksums before reading from them\n"
+	    "  -j jobs   probe up to jobs partitions at once\n"
 	    "  -k        keep going after I/O errors\n"
 	    "  -l        list valid disk devices and exit\n"
 	    "  -L label  label to use with -w option\n"
+	    "  -M maps   give up after loading maps partition maps\n"
+	    "  -N depth  never search maps nested over depth levels deep\n"
+	    "  -p        print each map as soon as it is read\n"
 	    "  -q        lower verbosity level when printing maps\n"
 	    "  -s        swap start and size columns\n"
 	    "  -r        relax some checks when reading maps\n"
+	    "  -R sects  read no more than sects sectors\n"
 	    "  -S sects  number of sectors per track (sectors)\n"
+	    "  -t msecs  give up on a read after msecs milliseconds\n"
+	    "  -T secs   give up on reading the disk after secs seconds\n"
 	    "  -v        raise verbosity level when printing maps\n"
 	    "  -V        display the version of %s and exit\n"
 	    "  -w file   write disk and partition info to file\n"
 	    "  -x        display numbers in hexadecimal\n"
 	    "  -z size   sector size in bytes\n",
-	    up_getname(), PACKAGE_NAME);
+	    st_progname, PACKAGE_NAME);
 
 	exit(EXIT_FAILURE);
 }
@@ -232,25 +404,36 @@ usage(const char *message, ...)
 static int
 serialize(const struct disk *disk)
 {
+	const struct opts *opts;
+	const char *name;
 	FILE *out;
 
-	out = fopen(opts->serialize, "wb");
+	/* - is the standard output, which may be a pipe */
+	opts = &disk->ctx->opts;
+	if (strcmp(opts->serialize, "-") == 0) {
+		out = stdout;
+		name = "standard output";
+	} else {
+		out = fopen(opts->serialize, "wb");
+		name = opts->serialize;
+	}
 	if (out == NULL) {
-		if (UP_NOISY(QUIET))
-			up_err("failed to open file for writing: %s: %s",
-			    opts->serialize, os_lasterrstr());
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "failed to open file for writing: "
+			    "%s: %s", opts->serialize, os_lasterrstr());
 		return (-1);
 	}
 
-	if (up_img_save(disk, out, opts->label, opts->serialize) < 0) {
-		fclose(out);
+	if (up_img_save(disk, out, opts->label, name) < 0) {
+		if (out != stdout)
+			fclose(out);
 		return (-1);
 	}
 
-	if (fclose(out)) {
-		if (UP_NOISY(QUIET))
-			up_err("failed to write to file: %s: %s",
-			    opts->serialize, os_lasterrstr());
+	if (out == stdout ? fflush(out) : fclose(out)) {
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx, "failed to write to file: %s: %s",
+			    name, os_lasterrstr());
 		return (-1);
 	}
 
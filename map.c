@@ -23,57 +23,197 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "bsdqueue.h"
+#include "bsdtree.h"
 #include "disk.h"
 #include "map.h"
+#include "os.h"
 #include "util.h"
 
 /* #define MAP_PROBE_DEBUG */
 
-#define CHECKTYPE(typ) \
-    assert(UP_MAP_NONE < (typ) && UP_MAP_ID_COUNT > (typ) && \
-           UP_TYPE_REGISTERED & st_types[(typ)].flags)
+/* most distinct sectors the signatures for all map types can be in */
+#define MAP_SIG_MAXSECTS	(32)
+
+/* containers map_loadall() has room for before its stack is grown */
+#define MAP_MINFRAMES		(16)
+
+/* partitions a map has room for before its array is first grown */
+#define MAP_MINPARTS		(8)
+
+/* arena chunks start small and double up to the maximum size */
+#define MAP_ARENA_MINCHUNK	(4096)
+#define MAP_ARENA_MAXCHUNK	(65536)
+#define MAP_ARENA_ROUND(size) \
+	(((size) + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1))
+
+/*
+  Everything allocated for the maps on a disk is carved out of a list
+  of chunks, which are only freed all at once by up_map_freeall().
+  Large items get a chunk of their own.
+*/
+struct map_arena_chunk {
+	struct map_arena_chunk *next;
+	size_t size;		/* usable bytes after the header */
+};
+
+#define MAP_ARENA_HDR		MAP_ARENA_ROUND(sizeof(struct map_arena_chunk))
+
+struct map_arena {
+	struct map_arena_chunk *chunks;	/* newest first */
+	size_t used;			/* bytes used in the newest chunk */
+	size_t next;			/* size of the next chunk */
+	int64_t allocs;			/* calls to up_map_alloc() */
+	int64_t bytes;			/* total size of all chunks */
+	int count;			/* number of chunks */
+	os_lock lock;
+};
+
+/* a partition probed as a task, maybe on another thread */
+struct map_job {
+	struct disk *disk;
+	struct part *part;
+	int maxdepth;
+	int parallel;		/* doesn't depend on its siblings */
+	struct up_task task;
+	int res;
+};
 
-static int		 map_loadall(struct disk *, struct part *);
-static struct part	*map_newcontainer(int64_t);
+/* a container being probed by map_loadall() */
+struct map_frame {
+	struct part *container;
+	enum mapid type;	/* next map type to try */
+	struct map *map;	/* map whose partitions are being probed */
+	int part;		/* next partition in map to probe */
+	struct map_job *jobs;	/* partitions in map probed on threads */
+	int jobcount;
+	int job;		/* next job to print the results of */
+	int matched[UP_MAP_ID_COUNT]; /* types with a signature, see sniff */
+};
+
+/* the start and end of a partition, for finding overlaps */
+struct map_span {
+	int64_t first;
+	int64_t last;
+	int job;
+};
+
+/*
+  A container a map type's load function said had no map. The verdict
+  holds until a map is freed, which may unmark sectors load checked.
+*/
+struct map_memo_ent {
+	int64_t start;		/* physical address */
+	int64_t size;
+	enum mapid type;
+	int ctx;		/* MAP_MEMO_* flags for the parent */
+	unsigned int gen;	/* stale unless it matches the memo's */
+	RB_ENTRY(map_memo_ent) link;
+};
+
+RB_HEAD(map_memo_tree, map_memo_ent);
+
+struct map_memo {
+	struct map_memo_tree tree;
+	unsigned int gen;
+	int64_t probes;		/* calls to load functions */
+	int64_t skipped;	/* probes answered by the memo */
+	int64_t nosig;		/* probes skipped for lack of a signature */
+	int64_t maps;		/* maps loaded, for opts.maxmaps */
+	int budget;		/* MAP_BUDGET_* limits already reported */
+	os_lock lock;
+};
+
+/* depth of the maps in a container */
+#define MAP_CONTAINER_DEPTH(part) \
+	((part)->map != NULL ? (part)->map->depth + 1 : 0)
+
+#define MAP_BUDGET_NEST		(1<<0) /* a map was nested too deep */
+#define MAP_BUDGET_MAPS		(1<<1) /* too many maps were loaded */
+
+#define MAP_MEMO_INMAP		(1<<0) /* parent is in a map */
+#define MAP_MEMO_VIRTDISK	(1<<1) /* parent is a virtual disk */
+
+#define CHECKTYPE(ctx, typ) \
+    assert(UP_MAP_NONE < (typ) && UP_MAP_ID_COUNT > (typ) && \
+           UP_TYPE_REGISTERED & (ctx)->types[(typ)].flags)
+
+static int		 map_init(struct disk *);
+static int		 map_loadall(struct disk *, struct part *, int);
+static int		 map_push(struct disk *, struct map_frame **, int *,
+    int *, struct part *, int);
+static int		 map_toodeep(struct disk *, const struct part *);
+static int		 map_overbudget(struct disk *);
+static int		 map_refused(const struct disk *);
+static int		 map_classify(struct disk *, struct part *, unsigned int,
+    int, enum mapid *);
+static int		 map_classifylast(struct disk *, struct part *,
+    const int *, enum mapid *);
+static int		 map_startjobs(struct disk *, struct map *, int,
+    struct map_job **);
+static void		 map_endjobs(struct disk *, struct map_frame *);
+static int		 map_findparallel(struct disk *, struct map_job *, int);
+static void		 map_runjob(void *);
+static int		 map_spancmp(const void *, const void *);
+static int		 map_memo_check(struct disk *, const struct part *,
+    enum mapid);
+static void		 map_memo_add(struct disk *, const struct part *,
+    enum mapid);
+static int		 map_memocmp(struct map_memo_ent *,
+    struct map_memo_ent *);
+static void		 map_prefetch(struct disk *, const struct part *,
+    int64_t, int64_t);
+static void		 map_footprints(struct disk *, const struct part *,
+    const int *);
+static void		 map_sniff(struct disk *, const struct part *,
+    unsigned int, int *);
+static int64_t		 map_sigsect(const struct disk *, const struct part *,
+    const struct map_sig *, int *);
+static int		 map_sigmatch(const struct disk *, const uint8_t *,
+    const struct map_sig *, int);
+static struct map_arena	*map_arena_new(int);
+static void		 map_arena_free(struct map_arena *);
+static struct part	*map_newcontainer(struct disk *, int64_t);
 static void		 map_freecontainer(struct disk *, struct part *);
 static struct map	*map_new(struct disk *, struct part *, enum mapid,
     void *);
-static void		 map_print(const struct map *, int, FILE *);
-static void		 map_printcontainer(const struct part *, int, FILE *);
+static void		 map_show(struct disk *, const struct map *);
+static void		 map_showall(struct disk *, const struct part *);
+static void		 map_print(const struct map *, int, int, FILE *);
+static void		 map_printcontainer(const struct disk *,
+    const struct part *, int, FILE *);
 static void		 map_indent(int, FILE *);
 
-static struct map_funcs st_types[UP_MAP_ID_COUNT];
+RB_GENERATE_STATIC(map_memo_tree, map_memo_ent, link, map_memocmp)
 
 void
 up_map_funcs_init(struct map_funcs *funcs)
 {
 	memset(funcs, 0, sizeof(*funcs));
-	funcs->free_partpriv = up_map_freeprivpart_def;
-	funcs->free_mappriv = up_map_freeprivmap_def;
 }
 
 void
-up_map_register(enum mapid type, const struct map_funcs *params)
+up_map_register(struct up_ctx *ctx, enum mapid type,
+    const struct map_funcs *params)
 {
 	struct map_funcs *funcs;
 
 	assert(type > UP_MAP_NONE && type < UP_MAP_ID_COUNT);
-	assert(!(UP_TYPE_REGISTERED & st_types[type].flags));
+	assert(!(UP_TYPE_REGISTERED & ctx->types[type].flags));
 	assert(!(UP_TYPE_REGISTERED & params->flags));
 
-	funcs = &st_types[type];
-	funcs->label = xstrdup(params->label, XA_FATAL);
+	funcs = &ctx->types[type];
+	funcs->label = up_xstrdup(params->label, XA_FATAL);
+	funcs->name = up_xstrdup(params->name, XA_FATAL);
 	funcs->flags = UP_TYPE_REGISTERED | params->flags;
 	funcs->load = params->load;
+	funcs->footprint = params->footprint;
+	funcs->sigs = params->sigs;
 	funcs->setup = params->setup;
 	funcs->get_index = params->get_index;
 	funcs->print_header = params->print_header;
 	funcs->print_extrahdr = params->print_extrahdr;
 	funcs->print_extra = params->print_extra;
 	funcs->dump_extra = params->dump_extra;
-	funcs->free_mappriv = params->free_mappriv;
-	funcs->free_partpriv = params->free_partpriv;
 }
 
 int
@@ -81,35 +221,37 @@ up_map_load(struct disk *disk, struct part *parent, enum mapid type,
     struct map **ret)
 {
 	struct map_funcs *funcs;
+	unsigned long msgs;
 	void *priv;
-	struct map *map;
+	struct map *map, **tail;
 	int res;
 
-	CHECKTYPE(type);
+	CHECKTYPE(disk->ctx, type);
 	assert(UP_PART_VIRTADDR(parent) >= 0 && parent->size >= 0 &&
 	    UP_PART_VIRTADDR(parent) + parent->size <=
 	    UP_DISK_SIZESECTS(disk));
 
-	funcs = &st_types[type];
+	funcs = &disk->ctx->types[type];
 	*ret = NULL;
 	priv = NULL;
 
+	/* don't repeat a probe which already found nothing here */
+	if (map_memo_check(disk, parent, type))
+		return (0);
+
 #ifdef MAP_PROBE_DEBUG
 	fprintf(stderr, "probe %"PRId64" %s\n",
 	    UP_PART_VIRTADDR(parent), funcs->label);
 #endif
+	msgs = up_msg_count(disk->ctx);
 	switch (funcs->load(disk, parent, &priv)) {
 	case 1:
 #ifdef MAP_PROBE_DEBUG
 		fprintf(stderr, "matched %"PRId64" %s\n",
 		    UP_PART_VIRTADDR(parent), funcs->label);
 #endif
-		map = map_new(disk, parent, type, priv);
-		if (map == NULL) {
-			if (funcs->free_mappriv && priv)
-				funcs->free_mappriv(NULL, priv);
+		if ((map = map_new(disk, parent, type, priv)) == NULL)
 			return (-1);
-		}
 		map->parent = parent; /* XXX this is so broken */
 		res = funcs->setup(disk, map);
 		if (res <= 0) {
@@ -120,12 +262,22 @@ up_map_load(struct disk *disk, struct part *parent, enum mapid type,
 			up_map_free(disk, map);
 			return (res);
 		}
-		SIMPLEQ_INSERT_TAIL(&parent->submap, map, link);
+		os_lock_acquire(disk->memo->lock);
+		disk->memo->maps++;
+		os_lock_release(disk->memo->lock);
+		for (tail = &parent->submap; *tail != NULL;
+		     tail = &(*tail)->next)
+			;
+		*tail = map;
 		*ret = map;
+		map_show(disk, map);
 		return (1);
 
 	case 0:
 		assert(priv == NULL);
+		/* a probe which printed something has to do so again */
+		if (up_msg_count(disk->ctx) == msgs)
+			map_memo_add(disk, parent, type);
 		return (0);
 
 	default:
@@ -140,57 +292,885 @@ up_map_load(struct disk *disk, struct part *parent, enum mapid type,
 int
 up_map_loadall(struct disk *disk)
 {
-	assert(disk->maps == NULL);
+	return (up_map_loaddepth(disk, 0));
+}
 
-	disk->maps = map_newcontainer(UP_DISK_SIZESECTS(disk));
-	if(disk->maps == NULL)
+/*
+  Load maps nested up to MAXDEPTH levels deep, or all of them if it's
+  0. Partitions below that are marked pending and are only probed
+  when up_map_expand() is called on them.
+*/
+int
+up_map_loaddepth(struct disk *disk, int maxdepth)
+{
+	if (map_init(disk) < 0)
+		return (-1);
+	if (map_loadall(disk, disk->maps, maxdepth) < 0) {
+		up_map_freeall(disk);
 		return (-1);
+	}
+
+	return (0);
+}
 
-	if(map_loadall(disk, disk->maps) < 0) {
+/*
+  Look for a map of one of a set of TYPES, at most MAXDEPTH levels
+  deep or at any depth if it's 0, stopping at the first one found.
+  In the deepest level searched only the signature sectors of TYPES
+  and what their load functions check are read, and other types are
+  loaded only to find the partitions of the next level. Returns 1 and
+  sets RET to its type if a map was found, 0 if none was, or -1 on
+  error.
+*/
+int
+up_map_classify(struct disk *disk, unsigned int types, int maxdepth,
+    enum mapid *ret)
+{
+	int res;
+
+	*ret = UP_MAP_NONE;
+	if (map_init(disk) < 0)
+		return (-1);
+	res = map_classify(disk, disk->maps, types, maxdepth, ret);
+	if (res < 0) {
 		up_map_freeall(disk);
 		return (-1);
 	}
 
+	return (res);
+}
+
+/*
+  Load the maps in a pending partition, leaving the partitions in them
+  pending. If that fails the partition is marked unreadable and isn't
+  tried again.
+*/
+int
+up_map_expand(struct disk *disk, struct part *part)
+{
+	if (!(part->flags & UP_PART_PENDING))
+		return (0);
+	part->flags &= ~UP_PART_PENDING;
+	if (map_loadall(disk, part, MAP_CONTAINER_DEPTH(part) + 1) < 0) {
+		map_freecontainer(disk, part);
+		part->flags |= UP_PART_UNREADABLE;
+		return (-1);
+	}
+
 	return (0);
 }
 
+/* Set up what loading the maps on a disk needs. */
 static int
-map_loadall(struct disk *disk, struct part *container)
+map_init(struct disk *disk)
 {
-    enum mapid    type;
-    struct map      *map;
-    struct part     *ii;
+	assert(disk->arena == NULL && disk->maps == NULL && disk->memo == NULL);
 
-    /* iterate through all partition types */
-    for(type = UP_MAP_NONE + 1; UP_MAP_ID_COUNT > type; type++)
-    {
-        CHECKTYPE(type);
+	if ((disk->arena = map_arena_new(disk->ctx->opts.jobs > 1)) == NULL)
+		return (-1);
+	disk->maps = map_newcontainer(disk, UP_DISK_SIZESECTS(disk));
+	if (disk->maps == NULL ||
+	    (disk->memo = up_map_alloc(disk, sizeof(*disk->memo))) == NULL) {
+		up_map_freeall(disk);
+		return (-1);
+	}
+	RB_INIT(&disk->memo->tree);
+	if (disk->ctx->opts.jobs > 1)
+		disk->memo->lock = os_lock_new();
 
-        /* try to load a map of this type */
-        if(0 > up_map_load(disk, container, type, &map))
-            return -1;
+	/* the calling thread also runs jobs while it waits for them */
+	if (disk->ctx->opts.jobs > 1 && disk->ctx->pool == NULL)
+		disk->ctx->pool = os_pool_open(disk->ctx->opts.jobs - 1);
 
-        if(!map)
-            continue;
+	return (0);
+}
 
-        /* try to recurse on each partition in the map */
-        for(ii = SIMPLEQ_FIRST(&map->list); ii; ii = SIMPLEQ_NEXT(ii, link))
-            if(!UP_PART_IS_BAD(ii->flags) && map_loadall(disk, ii))
-                return -1;
-    }
+/*
+  Load the maps in a container and everything nested in them, using a
+  stack of containers rather than recursion so a disk with deeply
+  nested maps can't run out of stack. Maps are still found in the
+  same order as by a depth-first search. Only partitions handed to
+  threads by map_startjobs() are probed with a stack of their own.
+*/
+static int
+map_loadall(struct disk *disk, struct part *container, int maxdepth)
+{
+	struct map_frame *stack, *top;
+	struct part *part;
+	struct map *map;
+	enum mapid type;
+	int count, max, res;
+
+	stack = NULL;
+	count = 0;
+	max = 0;
+	res = map_push(disk, &stack, &count, &max, container, maxdepth);
+	while (res == 0 && count > 0) {
+		top = &stack[count - 1];
+
+		/*
+		  Probe the next partition in the last map found here, or
+		  print what a thread found in it if it was already probed.
+		*/
+		if (top->map != NULL && top->part < top->map->partcount) {
+			part = &top->map->parts[top->part++];
+			if (top->job < top->jobcount &&
+			    top->jobs[top->job].part == part) {
+				up_task_flush(disk->ctx,
+				    &top->jobs[top->job].task);
+				map_showall(disk, part);
+				res = top->jobs[top->job++].res;
+			} else if (!UP_PART_IS_BAD(part->flags))
+				res = map_push(disk, &stack, &count, &max,
+				    part, maxdepth);
+			continue;
+		}
+		top->map = NULL;
+		map_endjobs(disk, top);
+
+		/* otherwise try the next map type */
+		while (top->type < UP_MAP_ID_COUNT && !top->matched[top->type])
+			top->type++;
+		if (top->type == UP_MAP_ID_COUNT) {
+			count--;
+			continue;
+		}
+		if (map_overbudget(disk)) {
+			top->container->flags |= UP_PART_SKIPPED;
+			count--;
+			continue;
+		}
+		type = top->type++;
+		CHECKTYPE(disk->ctx, type);
+
+		/*
+		  Try to load a map of this type. If a read didn't fit in
+		  what's left of the -R limit then move on to the next type,
+		  and if the disk stopped being read then give up on this
+		  container but keep what was found.
+		*/
+		up_disk_clearrefused(disk);
+		if (up_map_load(disk, top->container, type, &map) < 0) {
+			if (map_refused(disk))
+				continue;
+			if (!up_disk_degraded(disk))
+				res = -1;
+			top->container->flags |= UP_PART_UNREADABLE;
+			count--;
+			continue;
+		}
+
+		if (map == NULL)
+			continue;
+		top->map = map;
+		top->part = 0;
+		if (disk->ctx->pool != NULL &&
+		    (top->jobcount = map_startjobs(disk, map, maxdepth,
+			&top->jobs)) < 0) {
+			top->jobcount = 0;
+			res = -1;
+		}
+	}
+
+	/* after an error drop what wouldn't have been printed serially */
+	while (count > 0)
+		map_endjobs(disk, &stack[--count]);
+	free(stack);
+
+	return (res);
+}
+
+/*
+  Push a container onto the stack to be probed, unless it's too deep
+  or a budget ran out, and read the sectors its probes will need.
+*/
+static int
+map_push(struct disk *disk, struct map_frame **stack, int *count, int *max,
+    struct part *container, int maxdepth)
+{
+	struct map_frame *top;
+	enum mapid type;
+	int nosig;
+
+	if (map_toodeep(disk, container) || map_overbudget(disk)) {
+		container->flags |= UP_PART_SKIPPED;
+		return (0);
+	}
+
+	/* leave deeper partitions until something looks at them */
+	if (maxdepth > 0 && MAP_CONTAINER_DEPTH(container) >= maxdepth) {
+		container->flags |= UP_PART_PENDING;
+		return (0);
+	}
+
+	/* nothing can be found in a hole in a sparse file */
+	if (up_disk_ishole(disk, UP_PART_PHYSADDR(container), container->size))
+		return (0);
+
+	if (*count == *max) {
+		if ((top = up_xalloc(MAX(*max * 2, MAP_MINFRAMES), sizeof(*top),
+			    0)) == NULL)
+			return (-1);
+		if (*count > 0)
+			memcpy(top, *stack, *count * sizeof(*top));
+		free(*stack);
+		*stack = top;
+		*max = MAX(*max * 2, MAP_MINFRAMES);
+	}
+	top = &(*stack)[(*count)++];
+	top->container = container;
+	top->type = UP_MAP_NONE + 1;
+	top->map = NULL;
+	top->part = 0;
+	top->jobs = NULL;
+	top->jobcount = 0;
+	top->job = 0;
+
+	/* check every magic number at once, then read what loaders need */
+	map_sniff(disk, container, UP_MAP_ALLTYPES, top->matched);
+	map_footprints(disk, container, top->matched);
+	nosig = 0;
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++)
+		if (!top->matched[type])
+			nosig++;
+	os_lock_acquire(disk->memo->lock);
+	disk->memo->nosig += nosig;
+	os_lock_release(disk->memo->lock);
+
+	return (0);
+}
+
+/*
+  Return true if a container is nested too deeply to search at all,
+  saying so the first time it happens on a disk.
+*/
+static int
+map_toodeep(struct disk *disk, const struct part *container)
+{
+	struct map_memo *memo = disk->memo;
+	int warn;
+
+	if (disk->ctx->opts.maxnest <= 0 ||
+	    MAP_CONTAINER_DEPTH(container) < disk->ctx->opts.maxnest)
+		return (0);
+
+	os_lock_acquire(memo->lock);
+	warn = !(memo->budget & MAP_BUDGET_NEST);
+	memo->budget |= MAP_BUDGET_NEST;
+	os_lock_release(memo->lock);
+	if (warn && UP_NOISY(disk->ctx, QUIET))
+		up_warn(disk->ctx, "not searching maps nested more than %d "
+		    "level(s) deep in %s", disk->ctx->opts.maxnest,
+		    UP_DISK_PATH(disk));
+
+	return (1);
+}
+
+/*
+  Return true if as many maps as allowed were loaded from a disk and
+  no more containers should be searched.
+*/
+static int
+map_overbudget(struct disk *disk)
+{
+	struct map_memo *memo = disk->memo;
+	int over, warn;
+
+	if (disk->ctx->opts.maxmaps <= 0)
+		return (0);
+
+	os_lock_acquire(memo->lock);
+	over = (memo->maps >= disk->ctx->opts.maxmaps);
+	warn = (over && !(memo->budget & MAP_BUDGET_MAPS));
+	if (over)
+		memo->budget |= MAP_BUDGET_MAPS;
+	os_lock_release(memo->lock);
+	if (warn && UP_NOISY(disk->ctx, QUIET))
+		up_warn(disk->ctx, "giving up on %s after loading %d map(s)",
+		    UP_DISK_PATH(disk), disk->ctx->opts.maxmaps);
+
+	return (over);
+}
+
+/*
+  Return true if a load failed only because one of its reads was
+  refused for not fitting in the -R limit.
+*/
+static int
+map_refused(const struct disk *disk)
+{
+	return (up_disk_wasrefused(disk) && !up_disk_degraded(disk));
+}
+
+/*
+  Look for a map of one of TYPES in a container, then in each of the
+  partitions of the maps loaded there if MAXDEPTH allows it.
+*/
+static int
+map_classify(struct disk *disk, struct part *container, unsigned int types,
+    int maxdepth, enum mapid *ret)
+{
+	int matched[UP_MAP_ID_COUNT], deeper, res;
+	enum mapid type;
+	struct map *map;
+	struct part *ii;
+
+	if (map_toodeep(disk, container) || map_overbudget(disk)) {
+		container->flags |= UP_PART_SKIPPED;
+		return (0);
+	}
+	if (up_disk_ishole(disk, UP_PART_PHYSADDR(container), container->size))
+		return (0);
+
+	/* don't read what other types need unless looking inside them */
+	deeper = (maxdepth <= 0 || MAP_CONTAINER_DEPTH(container) + 1 <
+	    maxdepth);
+	map_sniff(disk, container, deeper ? UP_MAP_ALLTYPES : types, matched);
+	if (!deeper)
+		return (map_classifylast(disk, container, matched, ret));
+	map_footprints(disk, container, matched);
+
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++) {
+		if (!matched[type])
+			continue;
+		up_disk_clearrefused(disk);
+		if (up_map_load(disk, container, type, &map) < 0) {
+			if (map_refused(disk))
+				continue;
+			if (!up_disk_degraded(disk))
+				return (-1);
+			container->flags |= UP_PART_UNREADABLE;
+			return (0);
+		}
+		if (map != NULL && types & UP_MAP_BIT(type)) {
+			*ret = type;
+			return (1);
+		}
+	}
+
+	for (map = container->submap; map != NULL; map = map->next)
+		for (ii = map->parts; ii < map->parts + map->partcount; ii++)
+			if (!UP_PART_IS_BAD(ii->flags) &&
+			    (res = map_classify(disk, ii, types, maxdepth,
+				ret)) != 0)
+				return (res);
+
+	return (0);
+}
+
+/*
+  Look for the MATCHED types in the deepest container searched by
+  map_classify(). Nothing inside them is needed, so only their load
+  functions are called, which read just the sectors needed to tell
+  if they're there.
+*/
+static int
+map_classifylast(struct disk *disk, struct part *container,
+    const int *matched, enum mapid *ret)
+{
+	enum mapid type;
+	void *priv;
+	int res;
+
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++) {
+		if (!matched[type] || map_memo_check(disk, container, type))
+			continue;
+		priv = NULL;
+		up_disk_clearrefused(disk);
+		res = disk->ctx->types[type].load(disk, container, &priv);
+		if (res > 0) {
+			*ret = type;
+			return (1);
+		}
+		if (res < 0) {
+			if (map_refused(disk))
+				continue;
+			if (!up_disk_degraded(disk))
+				return (-1);
+			container->flags |= UP_PART_UNREADABLE;
+			return (0);
+		}
+	}
+
+	return (0);
+}
+
+/*
+  Start probing the partitions in a map which don't depend on each
+  other on threads, if there are threads and more than one partition.
+  The rest are left for map_loadall() to probe in order, and it prints
+  the messages of the jobs when it gets to them, so the output is the
+  same as if they had been probed one at a time. Sets JOBS to what
+  was probed and returns how many there are, or returns -1 on error.
+*/
+static int
+map_startjobs(struct disk *disk, struct map *map, int maxdepth,
+    struct map_job **ret)
+{
+	struct map_job *jobs;
+	struct part *ii;
+	int count, i, n;
+
+	*ret = NULL;
+	count = 0;
+	for (ii = map->parts; ii < map->parts + map->partcount; ii++)
+		if (!UP_PART_IS_BAD(ii->flags))
+			count++;
+	if (count < 2)
+		return (0);
+
+	if ((jobs = up_xalloc(count, sizeof(*jobs), XA_ZERO)) == NULL)
+		return (-1);
+	i = 0;
+	for (ii = map->parts; ii < map->parts + map->partcount; ii++)
+		if (!UP_PART_IS_BAD(ii->flags)) {
+			jobs[i].disk = disk;
+			jobs[i].part = ii;
+			jobs[i].maxdepth = maxdepth;
+			i++;
+		}
+	if (map_findparallel(disk, jobs, count) < 0) {
+		free(jobs);
+		return (-1);
+	}
+
+	/* only keep the jobs for threads, still in partition order */
+	n = 0;
+	for (i = 0; i < count; i++)
+		if (jobs[i].parallel)
+			jobs[n++] = jobs[i];
+	if (n == 0) {
+		free(jobs);
+		return (0);
+	}
+	os_pool_run(disk->ctx->pool, map_runjob, jobs, sizeof(*jobs), n);
+	*ret = jobs;
+
+	return (n);
+}
+
+/*
+  Free the jobs started for a frame's map. Any which weren't got to
+  were left after an error, so their messages are dropped.
+*/
+static void
+map_endjobs(struct disk *disk, struct map_frame *frame)
+{
+	for (; frame->job < frame->jobcount; frame->job++) {
+		frame->jobs[frame->job].task.msglen = 0;
+		up_task_flush(disk->ctx, &frame->jobs[frame->job].task);
+	}
+	free(frame->jobs);
+	frame->jobs = NULL;
+	frame->jobcount = 0;
+	frame->job = 0;
+}
+
+/*
+  Mark the partitions which can be probed in parallel: those which
+  don't overlap any sibling, since otherwise which one saves a sector
+  first would depend on timing, and which don't have to wait for
+  earlier ones. On disks without 512-byte sectors the disklabel scan
+  for misplaced labels reads outside the container, so nothing is.
+  Neither is anything with a -M or -R limit, since which partitions
+  got to use it up would depend on timing too.
+*/
+static int
+map_findparallel(struct disk *disk, struct map_job *jobs, int count)
+{
+	struct map_span *spans;
+	int64_t last;
+	int i, prev;
+
+	if (UP_DISK_1SECT(disk) != 512 || disk->ctx->opts.maxmaps > 0 ||
+	    disk->ctx->opts.maxsects > 0)
+		return (0);
+	if ((spans = up_xalloc(count, sizeof(*spans), 0)) == NULL)
+		return (-1);
+	for (i = 0; i < count; i++) {
+		spans[i].first = UP_PART_PHYSADDR(jobs[i].part);
+		spans[i].last = spans[i].first + jobs[i].part->size - 1;
+		spans[i].job = i;
+		jobs[i].parallel = !(jobs[i].part->flags & UP_PART_SERIAL);
+	}
+	qsort(spans, count, sizeof(*spans), map_spancmp);
+
+	/* a span overlaps if it starts before the furthest end so far */
+	last = INT64_MIN;
+	prev = -1;
+	for (i = 0; i < count; i++) {
+		if (spans[i].first <= last) {
+			jobs[spans[i].job].parallel = 0;
+			if (prev >= 0)
+				jobs[prev].parallel = 0;
+		}
+		if (spans[i].last > last) {
+			last = spans[i].last;
+			prev = spans[i].job;
+		}
+	}
+	free(spans);
+
+	return (0);
+}
+
+static void
+map_runjob(void *arg)
+{
+	struct map_job *job = arg;
+	struct up_task *old;
+
+	old = up_task_set(&job->task);
+	job->res = map_loadall(job->disk, job->part, job->maxdepth);
+	up_task_set(old);
+}
+
+static int
+map_spancmp(const void *left, const void *right)
+{
+	const struct map_span *a = left, *b = right;
+
+	if (a->first != b->first)
+		return (a->first < b->first ? -1 : 1);
+	return (a->job - b->job);
+}
+
+/*
+  Read the sectors at the head and tail of a container into the disk
+  cache in one go, so later reads of them don't each go to the disk.
+*/
+static void
+map_prefetch(struct disk *disk, const struct part *container, int64_t head,
+    int64_t tail)
+{
+	int64_t start;
+
+	head = MIN(head, container->size);
+	tail = MIN(tail, container->size);
+	start = UP_PART_PHYSADDR(container);
+	if (head + tail >= container->size)
+		up_disk_submit(disk, start, container->size);
+	else {
+		if (head > 0)
+			up_disk_submit(disk, start, head);
+		if (tail > 0)
+			up_disk_submit(disk,
+			    start + container->size - tail, tail);
+	}
+	up_disk_wait(disk);
+}
+
+/* Prefetch the union of the sectors each matched map type will read. */
+static void
+map_footprints(struct disk *disk, const struct part *container,
+    const int *matched)
+{
+	int64_t head, tail, typehead, typetail;
+	enum mapid type;
+
+	head = 0;
+	tail = 0;
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++) {
+		CHECKTYPE(disk->ctx, type);
+		if (!matched[type] || disk->ctx->types[type].footprint == NULL)
+			continue;
+		typehead = 0;
+		typetail = 0;
+		disk->ctx->types[type].footprint(disk, container->size,
+		    &typehead, &typetail);
+		head = MAX(head, typehead);
+		tail = MAX(tail, typetail);
+	}
+	if (head > 0 || tail > 0)
+		map_prefetch(disk, container, head, tail);
+}
+
+/*
+  Decide which map types could possibly load from a container by
+  reading each sector any signature lives in once and checking every
+  signature against it. MATCHED is set for each type which should be
+  probed: types with no signatures, types with a matching signature,
+  and types whose signature sectors couldn't be read so the loader
+  can report the error. Types not in the TYPES set aren't probed and
+  their signatures aren't read.
+*/
+static void
+map_sniff(struct disk *disk, const struct part *container,
+    unsigned int types, int *matched)
+{
+	int64_t sects[MAP_SIG_MAXSECTS], sect, head, tail;
+	const struct map_sig *sig;
+	const uint8_t *buf;
+	enum mapid type;
+	int count, i, off;
+
+	/* find and prefetch the distinct sectors the signatures are in */
+	count = 0;
+	head = 0;
+	tail = 0;
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++) {
+		CHECKTYPE(disk->ctx, type);
+		if (!(types & UP_MAP_BIT(type))) {
+			matched[type] = 0;
+			continue;
+		}
+		matched[type] = (disk->ctx->types[type].sigs == NULL ||
+		    disk->ctx->types[type].sigs->len == 0);
+		for (sig = disk->ctx->types[type].sigs; sig && sig->len; sig++) {
+			if (sig->flags & MAP_SIG_ONLY512 &&
+			    UP_DISK_1SECT(disk) != 512) {
+				matched[type] = 1;
+				continue;
+			}
+			if ((sect = map_sigsect(disk, container, sig,
+				    &off)) < 0)
+				continue;
+			if (sect < container->size / 2)
+				head = MAX(head, sect + 1);
+			else
+				tail = MAX(tail, container->size - sect);
+			for (i = 0; i < count && sects[i] != sect; i++)
+				;
+			if (i == count) {
+				assert(count < MAP_SIG_MAXSECTS);
+				sects[count++] = sect;
+			}
+		}
+	}
+	map_prefetch(disk, container, head, tail);
+
+	for (i = 0; i < count; i++) {
+		/* a hole is all zeros and can't contain a magic number */
+		sect = UP_PART_PHYSADDR(container) + sects[i];
+		if (up_disk_ishole(disk, sect, 1))
+			continue;
+		buf = up_disk_getsect(disk, sect);
+
+		for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++) {
+			if (!(types & UP_MAP_BIT(type)))
+				continue;
+			for (sig = disk->ctx->types[type].sigs;
+			     !matched[type] && sig && sig->len; sig++) {
+				if (map_sigsect(disk, container, sig, &off) !=
+				    sects[i])
+					continue;
+				if (buf == NULL ||
+				    map_sigmatch(disk, buf, sig, off))
+					matched[type] = 1;
+			}
+		}
+	}
+
+#ifdef MAP_PROBE_DEBUG
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++)
+		if (!matched[type])
+			fprintf(stderr, "sniff %"PRId64" %s: no signature\n",
+			    UP_PART_VIRTADDR(container),
+			    disk->ctx->types[type].label);
+#endif
+}
+
+/*
+  Return the sector a signature is in, relative to the start of the
+  container, and set OFF to its byte offset in the sector. Returns -1
+  if it falls outside the container.
+*/
+static int64_t
+map_sigsect(const struct disk *disk, const struct part *container,
+    const struct map_sig *sig, int *off)
+{
+	int64_t sect;
+
+	sect = sig->sect;
+	*off = sig->off;
+	if (sig->flags & MAP_SIG_UNIT512)
+		sect = sect * 512 / UP_DISK_1SECT(disk);
+	if (sect < 0)
+		sect += container->size;
+	if (sect < 0 || sect >= container->size ||
+	    *off + sig->len > UP_DISK_1SECT(disk))
+		return (-1);
+
+	return (sect);
+}
+
+/* Check for a signature at byte offset OFF of a sector. */
+static int
+map_sigmatch(const struct disk *disk, const uint8_t *buf,
+    const struct map_sig *sig, int off)
+{
+	int last;
+
+	last = (sig->flags & MAP_SIG_ANYOFF ?
+	    UP_DISK_1SECT(disk) - sig->len : off);
+	for (; off <= last; off++)
+		if (memcmp(buf + off, sig->magic, sig->len) == 0)
+			return (1);
+
+	return (0);
+}
+
+/*
+  Return true if a map type's load function already found nothing in a
+  container with the same physical range, and count the probe.
+*/
+static int
+map_memo_check(struct disk *disk, const struct part *parent,
+    enum mapid type)
+{
+	struct map_memo *memo = disk->memo;
+	struct map_memo_ent key, *ent;
+	int found;
+
+	if (memo == NULL)
+		return (0);
+	key.start = UP_PART_PHYSADDR(parent);
+	key.size = parent->size;
+	key.type = type;
+	key.ctx = (parent->map != NULL ? MAP_MEMO_INMAP : 0) |
+	    (parent->flags & UP_PART_VIRTDISK ? MAP_MEMO_VIRTDISK : 0);
+
+	os_lock_acquire(memo->lock);
+	ent = RB_FIND(map_memo_tree, &memo->tree, &key);
+	found = (ent != NULL && ent->gen == memo->gen);
+	memo->probes++;
+	if (found)
+		memo->skipped++;
+	os_lock_release(memo->lock);
+
+	return (found);
+}
+
+/* Remember that a map type's load function found nothing. */
+static void
+map_memo_add(struct disk *disk, const struct part *parent, enum mapid type)
+{
+	struct map_memo *memo = disk->memo;
+	struct map_memo_ent key, *ent;
+
+	if (memo == NULL || disk->ctx->types[type].flags & UP_TYPE_NOMEMO)
+		return;
+	key.start = UP_PART_PHYSADDR(parent);
+	key.size = parent->size;
+	key.type = type;
+	key.ctx = (parent->map != NULL ? MAP_MEMO_INMAP : 0) |
+	    (parent->flags & UP_PART_VIRTDISK ? MAP_MEMO_VIRTDISK : 0);
+
+	/* entries live in the arena, so only allocate new ones */
+	os_lock_acquire(memo->lock);
+	if ((ent = RB_FIND(map_memo_tree, &memo->tree, &key)) == NULL &&
+	    (ent = up_map_alloc(disk, sizeof(*ent))) != NULL) {
+		*ent = key;
+		RB_INSERT(map_memo_tree, &memo->tree, ent);
+	}
+	if (ent != NULL)
+		ent->gen = memo->gen;
+	os_lock_release(memo->lock);
+}
 
-    return 0;
+static int
+map_memocmp(struct map_memo_ent *left, struct map_memo_ent *right)
+{
+	if (left->start != right->start)
+		return (left->start < right->start ? -1 : 1);
+	if (left->size != right->size)
+		return (left->size < right->size ? -1 : 1);
+	if (left->type != right->type)
+		return (left->type < right->type ? -1 : 1);
+	return (left->ctx - right->ctx);
 }
 
+/*
+  Free every map on the disk at once. Nothing in the arena owns other
+  memory, so only the sectors the maps marked have to be let go of.
+*/
 void
 up_map_freeall(struct disk *disk)
 {
-    if(!disk->maps)
-        return;
+	if (disk->arena == NULL)
+		return;
 
-    map_freecontainer(disk, disk->maps);
-    free(disk->maps);
-    disk->maps = NULL;
+	up_disk_sectsunrefall(disk);
+	if (disk->memo != NULL)
+		os_lock_free(disk->memo->lock);
+	map_arena_free(disk->arena);
+	disk->arena = NULL;
+	disk->maps = NULL;
+	disk->memo = NULL;
+}
+
+void *
+up_map_alloc(const struct disk *disk, size_t size)
+{
+	struct map_arena *arena = disk->arena;
+	struct map_arena_chunk *chunk;
+	uint8_t *ptr;
+	size_t len;
+
+	assert(arena != NULL);
+	size = MAP_ARENA_ROUND(MAX(size, 1));
+	ptr = NULL;
+	os_lock_acquire(arena->lock);
+
+	/* give large items a chunk of their own behind the current one */
+	len = (size > arena->next / 2 ? size : arena->next);
+	if (len == size || arena->chunks == NULL ||
+	    arena->used + size > arena->chunks->size) {
+		if ((chunk = up_xalloc(1, MAP_ARENA_HDR + len, 0)) == NULL)
+			goto done;
+		chunk->size = len;
+		arena->count++;
+		arena->bytes += len;
+		if (len == size && arena->chunks != NULL) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+			ptr = (uint8_t *)chunk + MAP_ARENA_HDR;
+			arena->allocs++;
+			goto done;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->used = 0;
+		if (len == arena->next)
+			arena->next = MIN(arena->next * 2, MAP_ARENA_MAXCHUNK);
+	}
+
+	ptr = (uint8_t *)arena->chunks + MAP_ARENA_HDR + arena->used;
+	arena->used += size;
+	arena->allocs++;
+
+done:
+	os_lock_release(arena->lock);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+	return (ptr);
+}
+
+static struct map_arena *
+map_arena_new(int locked)
+{
+	struct map_arena *arena;
+
+	if ((arena = up_xalloc(1, sizeof(*arena), XA_ZERO)) == NULL)
+		return (NULL);
+	arena->next = MAP_ARENA_MINCHUNK;
+	if (locked)
+		arena->lock = os_lock_new();
+
+	return (arena);
+}
+
+static void
+map_arena_free(struct map_arena *arena)
+{
+	struct map_arena_chunk *chunk;
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	os_lock_free(arena->lock);
+	free(arena);
 }
 
 static struct map *
@@ -198,7 +1178,7 @@ map_new(struct disk *disk, struct part *parent, enum mapid type, void *priv)
 {
 	struct map *map;
 
-	if ((map = xalloc(1, sizeof(*map), XA_ZERO)) == NULL)
+	if ((map = up_map_alloc(disk, sizeof(*map))) == NULL)
 		return (NULL);
 
 	map->disk = disk;
@@ -213,22 +1193,20 @@ map_new(struct disk *disk, struct part *parent, enum mapid type, void *priv)
 	}
 	map->depth = (parent->map ? parent->map->depth + 1 : 0);
 	map->priv = priv;
-	SIMPLEQ_INIT(&map->list);
 
 	return (map);
 }
 
 static struct part *
-map_newcontainer(int64_t size)
+map_newcontainer(struct disk *disk, int64_t size)
 {
 	struct part *container;
 
-	if ((container = xalloc(1, sizeof(*container), XA_ZERO)) == NULL)
+	if ((container = up_map_alloc(disk, sizeof(*container))) == NULL)
 		return (NULL);
 
 	container->virtstart = 0;
 	container->size = size;
-	SIMPLEQ_INIT(&container->submap);
 
 	return (container);
 }
@@ -238,9 +1216,9 @@ map_freecontainer(struct disk *disk, struct part *container)
 {
     struct map *ii;
 
-    while((ii = SIMPLEQ_FIRST(&container->submap)))
+    while((ii = container->submap))
     {
-        SIMPLEQ_REMOVE_HEAD(&container->submap, link);
+        container->submap = ii->next;
         ii->parent = NULL;
         up_map_free(disk, ii);
     }
@@ -249,10 +1227,29 @@ map_freecontainer(struct disk *disk, struct part *container)
 struct part *
 up_map_add(struct map *map, int64_t start, int64_t size, int flags, void *priv)
 {
-	struct part *part;
-
-	if ((part = xalloc(1, sizeof(*part), XA_ZERO)) == NULL)
-		return (NULL);
+	struct part *part, *parts;
+	int max;
+
+	/*
+	  Grow the array by copying it, the old one stays in the arena.
+	  Nothing can point to the partitions yet since submaps are only
+	  loaded once the map is set up.
+	*/
+	if (map->partcount == map->partmax) {
+		max = MAX(MAP_MINPARTS, map->partmax * 2);
+		if ((parts = up_map_alloc(map->disk,
+			    max * sizeof(*parts))) == NULL)
+			return (NULL);
+		if (map->partcount > 0)
+			memcpy(parts, map->parts,
+			    map->partcount * sizeof(*parts));
+		map->parts = parts;
+		map->partmax = max;
+	}
+	if (map->partcount > 0)
+		map->parts[map->partcount - 1].flags &= ~UP_PART_LAST;
+	part = &map->parts[map->partcount++];
+	flags |= UP_PART_LAST;
 
 	if (0 == size)
 		flags |= UP_PART_EMPTY;
@@ -265,8 +1262,6 @@ up_map_add(struct map *map, int64_t start, int64_t size, int flags, void *priv)
 	part->flags = flags;
 	part->priv = priv;
 	part->map = map;
-	SIMPLEQ_INIT(&part->submap);
-	SIMPLEQ_INSERT_TAIL(&map->list, part, link);
 
 	return (part);
 }
@@ -274,69 +1269,70 @@ up_map_add(struct map *map, int64_t start, int64_t size, int flags, void *priv)
 void
 up_map_free(struct disk *disk, struct map *map)
 {
-    struct part *ii;
+    int ii;
 
     if(!map)
         return;
 
-    CHECKTYPE(map->type);
+    CHECKTYPE(disk->ctx, map->type);
     /* freeing a map with a parent isn't supported due to laziness */
     assert(!map->parent);
 
-    /* free partitions */
-    while((ii = SIMPLEQ_FIRST(&map->list)))
-    {
-        SIMPLEQ_REMOVE_HEAD(&map->list, link);
-        map_freecontainer(disk, ii);
-        if(st_types[ii->map->type].free_partpriv && ii->priv)
-            st_types[ii->map->type].free_partpriv(ii, ii->priv);
-        free(ii);
-    }
+    /*
+      Free the maps in the partitions. The memory stays in the arena
+      until up_map_freeall(), but the sectors are let go of now.
+    */
+    for(ii = 0; map->partcount > ii; ii++)
+        map_freecontainer(disk, &map->parts[ii]);
+    map->partcount = 0;
 
-    /* free private data */
-    if(st_types[map->type].free_mappriv && map->priv)
-        st_types[map->type].free_mappriv(map, map->priv);
-
-    /* mark sectors unused */
+    /* mark sectors unused, which may change what loads */
     up_disk_sectsunref(disk, map);
-
-    /* free map */
-    free(map);
+    if(disk->memo)
+    {
+        os_lock_acquire(disk->memo->lock);
+        disk->memo->gen++;
+        os_lock_release(disk->memo->lock);
+    }
 }
 
-void
-up_map_freeprivmap_def(struct map *map, void *priv)
+const char *
+up_map_label(const struct map *map)
 {
-    free(priv);
-}
+    CHECKTYPE(map->disk->ctx, map->type);
 
-void
-up_map_freeprivpart_def(struct part *part, void *priv)
-{
-    free(priv);
+    return map->disk->ctx->types[map->type].label;
 }
 
-const char *
-up_map_label(const struct map *map)
+/* Return the type with a short name, or UP_MAP_NONE if there isn't one. */
+enum mapid
+up_map_typebyname(const struct up_ctx *ctx, const char *name)
 {
-    CHECKTYPE(map->type);
+	enum mapid type;
+
+	for (type = UP_MAP_NONE + 1; type < UP_MAP_ID_COUNT; type++) {
+		CHECKTYPE(ctx, type);
+		if (strcmp(ctx->types[type].name, name) == 0)
+			return (type);
+	}
 
-    return st_types[map->type].label;
+	return (UP_MAP_NONE);
 }
 
 static void
-map_print(const struct map *map, int sizewidth, FILE *stream)
+map_print(const struct map *map, int sizewidth, int recurse, FILE *stream)
 {
 	struct map_funcs *funcs;
 	const struct part *part;
-	int indented;
+	int indented, swap;
 	char idx[5], flag;
 
-	CHECKTYPE(map->type);
-	funcs = &st_types[map->type];
+	CHECKTYPE(map->disk->ctx, map->type);
+	funcs = &map->disk->ctx->types[map->type];
+	swap = map->disk->ctx->opts.swapcols;
 	indented = 0;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return;
 
 	/* print info line(s) */
@@ -352,8 +1348,8 @@ map_print(const struct map *map, int sizewidth, FILE *stream)
 		if (!indented)
 			map_indent(map->depth, stream);
 		fprintf(stream, "       %*s %*s",
-		    sizewidth, (opts->swapcols ?  "Size" : "Start"),
-		    sizewidth, (opts->swapcols ?  "Start" : "Size"));
+		    sizewidth, (swap ?  "Size" : "Start"),
+		    sizewidth, (swap ?  "Start" : "Size"));
 		if (funcs->print_extrahdr != NULL)
 			funcs->print_extrahdr(map, stream);
 		putc('\n', stream);
@@ -363,14 +1359,19 @@ map_print(const struct map *map, int sizewidth, FILE *stream)
 	/* print partitions */
 	for (part = up_map_first(map); part != NULL; part = up_map_next(part)) {
 		/* skip empty partitions unless verbose */
-		if (UP_PART_EMPTY & part->flags && !UP_NOISY(EXTRA))
+		if (UP_PART_EMPTY & part->flags &&
+		    !UP_NOISY(map->disk->ctx, EXTRA))
 			continue;
 
 		if (!indented)
 			map_indent(map->depth, stream);
 
-		if (UP_PART_IS_BAD(part->flags))
+		if (UP_PART_SKIPPED & part->flags)
+			flag = '-';
+		else if (UP_PART_IS_BAD(part->flags))
 			flag = 'X';
+		else if (UP_PART_PENDING & part->flags)
+			flag = '+';
 		else
 			flag = ' ';
 
@@ -382,29 +1383,47 @@ map_print(const struct map *map, int sizewidth, FILE *stream)
 			strlcat(idx, ":", sizeof(idx));
 
 		fprintf(stream, "%-4s %c ", idx, flag);
-		printsect_pad((opts->swapcols ? part->size : part->virtstart),
+		up_printsect_pad(map->disk,
+		    (swap ? part->size : part->virtstart),
 		    sizewidth, stream);
 		putc(' ', stream);
-		printsect_pad((opts->swapcols ? part->virtstart : part->size),
+		up_printsect_pad(map->disk,
+		    (swap ? part->virtstart : part->size),
 		    sizewidth, stream);
 		if (funcs->print_extra != NULL)
 			funcs->print_extra(part, stream);
 		putc('\n', stream);
 		indented = 0;
 
-		/* recurse */
-		map_printcontainer(part, sizewidth, stream);
+		if (recurse)
+			map_printcontainer(map->disk, part, sizewidth,
+			    stream);
 	}
 }
 
 void
 up_map_printall(const struct disk *disk, void *stream)
 {
-	map_printcontainer(disk->maps, 0, stream);
+	map_printcontainer(disk, disk->maps, 0, stream);
+}
+
+void
+up_map_printstats(const struct disk *disk, void *stream)
+{
+	if (disk->memo == NULL)
+		return;
+	fprintf(stream, "%s: %"PRId64" probe(s), %"PRId64" skipped without "
+	    "a signature, %"PRId64" skipped as already known to find "
+	    "nothing\n", UP_DISK_PATH(disk), disk->memo->probes +
+	    disk->memo->nosig, disk->memo->nosig, disk->memo->skipped);
+	fprintf(stream, "%s: %"PRId64" map allocation(s) in %d chunk(s) "
+	    "totaling %"PRId64" bytes\n", UP_DISK_PATH(disk),
+	    disk->arena->allocs, disk->arena->count, disk->arena->bytes);
 }
 
 static void
-map_printcontainer(const struct part *up, int width, FILE *stream)
+map_printcontainer(const struct disk *disk, const struct part *up, int width,
+    FILE *stream)
 {
 	const struct map *map;
 	const struct part *part;
@@ -412,7 +1431,7 @@ map_printcontainer(const struct part *up, int width, FILE *stream)
 
 	if (width <= 0) {
 		size = 0;
-		for (map = up_map_firstmap(up); map != NULL;
+		for (map = up->submap; map != NULL;
 		     map = up_map_nextmap(map)) {
 			for (part = up_map_first(map); part != NULL;
 			     part = up_map_next(part)) {
@@ -422,13 +1441,62 @@ map_printcontainer(const struct part *up, int width, FILE *stream)
 					    part->size);
 			}
 		}
-		width = printsect(size, NULL);
+		width = up_printsect(disk, size, NULL);
 		if (width <= 0)
 			width = 15;
 	}
 
-	for (map = up_map_firstmap(up); map != NULL; map = up_map_nextmap(map))
-		map_print(map, width, stream);
+	/* print only what was loaded, don't expand pending partitions */
+	for (map = up->submap; map != NULL; map = up_map_nextmap(map))
+		map_print(map, width, 1, stream);
+}
+
+/*
+  With progressive output, print a map which was just set up. Maps
+  found by a job on another thread are held until map_showall() is
+  called for the job's partition, so they come out in the same order
+  as when probing one partition at a time.
+*/
+static void
+map_show(struct disk *disk, const struct map *map)
+{
+	const struct part *part;
+	int64_t size;
+	int width;
+
+	if (!disk->ctx->opts.progressive || up_task_get() != NULL)
+		return;
+
+	/*
+	  There's no telling how big later partitions are, so use the
+	  disk size unless this map has something bigger.
+	*/
+	size = UP_DISK_SIZESECTS(disk);
+	for (part = up_map_first(map); part != NULL; part = up_map_next(part))
+		size = MAX(size, MAX(part->virtstart, part->size));
+	width = up_printsect(disk, size, NULL);
+	if (width <= 0)
+		width = 15;
+	map_print(map, width, 0, disk->ctx->outstream);
+	fflush(disk->ctx->outstream);
+}
+
+/* Show every map in a partition, in the order they were loaded. */
+static void
+map_showall(struct disk *disk, const struct part *container)
+{
+	const struct map *map;
+	const struct part *part;
+
+	if (!disk->ctx->opts.progressive || up_task_get() != NULL)
+		return;
+
+	for (map = container->submap; map != NULL; map = map->next) {
+		map_show(disk, map);
+		for (part = up_map_first(map); part != NULL;
+		     part = up_map_next(part))
+			map_showall(disk, part);
+	}
 }
 
 static void
@@ -446,12 +1514,12 @@ up_map_dumpsect(const struct map *map, FILE *stream, int64_t start,
 {
 	struct map_funcs *funcs;
 
-	CHECKTYPE(map->type);
-	funcs = &st_types[map->type];
+	CHECKTYPE(map->disk->ctx, map->type);
+	funcs = &map->disk->ctx->types[map->type];
 
 	fprintf(stream, "\n\nDump of %s %s at ",
             UP_DISK_PATH(map->disk), funcs->label);
-	printsect_verbose(start, stream);
+	up_printsect_verbose(map->disk, start, stream);
 	fprintf(stream, " (0x%"PRIx64")", start);
 	if (funcs->dump_extra != NULL)
 		funcs->dump_extra(map, start, data, size, tag, stream);
@@ -464,23 +1532,28 @@ up_map_dumpsect(const struct map *map, FILE *stream, int64_t start,
 const struct part *
 up_map_first(const struct map *map)
 {
-    return SIMPLEQ_FIRST(&map->list);
+    return (map->partcount > 0 ? &map->parts[0] : NULL);
 }
 
 const struct part *
 up_map_next(const struct part *part)
 {
-    return SIMPLEQ_NEXT(part, link);
+    /* a flag rather than the count so there's only one load */
+    return (part->flags & UP_PART_LAST ? NULL : part + 1);
 }
 
+/*
+  Return the first map in a partition. A pending partition has none
+  until up_map_expand() is called on it.
+*/
 const struct map *
 up_map_firstmap(const struct part *part)
 {
-    return SIMPLEQ_FIRST(&part->submap);
+    return part->submap;
 }
 
 const struct map *
 up_map_nextmap(const struct map *map)
 {
-    return SIMPLEQ_NEXT(map, link);
+    return map->next;
 }
@@ -17,22 +17,27 @@
 #ifndef HDR_UPART_MAP
 #define HDR_UPART_MAP
 
-#include "bsdqueue.h"
-
 struct disk;
 struct map;
 struct part;
+struct up_ctx;
 
 #define UP_TYPE_REGISTERED      (1<<0)
 #define UP_TYPE_NOPRINTHDR      (1<<1)
+#define UP_TYPE_NOMEMO          (1<<2) /* load depends on the parent map */
 
 #define UP_PART_EMPTY           (1<<0) /* empty or deleted */
 #define UP_PART_OOB             (1<<1) /* out of bounds */
 #define UP_PART_VIRTDISK	(1<<2) /* partition defines a virtual disk */
 #define UP_PART_UNREADABLE	(1<<3) /* ignore partition contents */
+#define UP_PART_SERIAL		(1<<4) /* probe after earlier partitions */
+#define UP_PART_PENDING		(1<<5) /* submaps not loaded yet */
+#define UP_PART_LAST		(1<<6) /* last partition in its map */
+#define UP_PART_SKIPPED		(1<<7) /* not searched, a limit was reached */
 
 #define UP_PART_IS_BAD(flags) \
-	((UP_PART_EMPTY|UP_PART_OOB|UP_PART_UNREADABLE) & (flags))
+	((UP_PART_EMPTY|UP_PART_OOB|UP_PART_UNREADABLE|UP_PART_SKIPPED) & \
+	    (flags))
 
 #define UP_MAP_VIRTADDR(m)		((m)->virtstart)
 #define UP_MAP_PHYSADDR(m)		((m)->virtstart + (m)->virtoff)
@@ -47,17 +52,17 @@ struct part;
 #define UP_PART_PHYS_TO_VIRT(p, a)	((a) - UP_PART_VIRTOFFSET(p))
 #define UP_PART_VIRT_TO_PHYS(p, a)	((a) + UP_PART_VIRTOFFSET(p))
 
-SIMPLEQ_HEAD(map_list, map);
-SIMPLEQ_HEAD(part_list, part);
-
+/*
+  Partitions are kept in an array in their map and may move while the
+  map is being set up, so don't keep pointers to them until it is.
+*/
 struct part {
 	int64_t virtstart;
 	int64_t size;
 	int flags;
 	void *priv;
 	struct map *map;
-	struct map_list submap;
-	SIMPLEQ_ENTRY(part) link;
+	struct map *submap;	/* first map in partition, see map->next */
 };
 
 enum mapid {
@@ -76,6 +81,10 @@ enum mapid {
 	UP_MAP_ID_COUNT
 };
 
+/* sets of map types for up_map_classify() */
+#define UP_MAP_BIT(type)	(1U << (type))
+#define UP_MAP_ALLTYPES		(UP_MAP_BIT(UP_MAP_ID_COUNT) - 2U)
+
 struct map {
 	const struct disk *disk;
 	enum mapid type;
@@ -85,10 +94,28 @@ struct map {
 	int depth;
 	void *priv;
 	struct part *parent;
-	struct part_list list;
-	SIMPLEQ_ENTRY(map) link;
+	struct part *parts;	/* partitions in the order they were added */
+	int partcount;
+	int partmax;		/* room in parts before it's grown */
+	struct map *next;	/* next map in the parent partition */
+};
+
+/*
+  A magic number which must be present for a map type to load. Types
+  with several signatures are loaded if any one of them matches.
+*/
+struct map_sig {
+	int64_t sect;		/* sector in container, from end if negative */
+	int off;		/* byte offset in the sector */
+	const void *magic;
+	int len;		/* length of magic, 0 ends a list */
+	unsigned int flags;
 };
 
+#define MAP_SIG_ANYOFF		(1<<0) /* magic may be at or after off */
+#define MAP_SIG_UNIT512		(1<<1) /* sect is in 512-byte units */
+#define MAP_SIG_ONLY512		(1<<2) /* ignored if sectors aren't 512b */
+
 typedef int (*map_load_fn)(const struct disk *, const struct part *, void **);
 typedef int (*map_setup_fn)(struct disk *, struct map *);
 typedef int (*map_getmap_fn)(const struct map *, char *, size_t);
@@ -97,15 +124,20 @@ typedef int (*map_printmap_fn)(const struct map *, FILE *);
 typedef int (*map_printpart_fn)(const struct part *, FILE *);
 typedef int (*map_printdump_fn)(const struct map *, int64_t, const void *,
     int64_t, int, FILE *);
-typedef void (*map_freemap_fn)(struct map *, void *);
-typedef void (*map_freepart_fn)(struct part *, void *);
+typedef void (*map_footprint_fn)(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 
 struct map_funcs
 {
 	char *label;
+	char *name;		/* short name to select the type by */
 	unsigned int flags;
-	/* check if map exists and allocate private data */
+	/* check if map exists and allocate private data with up_map_alloc */
 	map_load_fn load;
+	/* sectors load will read at the head and tail of a container */
+	map_footprint_fn footprint;
+	/* magic numbers checked before calling load, none to always load */
+	const struct map_sig *sigs;
 	/* add partitions, and any misc. setup not done in load */
 	map_setup_fn setup;
 	/* print map header, can be several lines */
@@ -118,16 +150,17 @@ struct map_funcs
 	map_printpart_fn print_extra;
 	/* print extra information for sector dump */
 	map_printdump_fn dump_extra;
-	/* free private map data, map may be NULL if it was never allocated */
-	map_freemap_fn free_mappriv;
-	/* free private partition data */
-	map_freepart_fn free_partpriv;
 };
 
 void		 up_map_funcs_init(struct map_funcs *);
-void		 up_map_register(enum mapid, const struct map_funcs *);
+void		 up_map_register(struct up_ctx *, enum mapid,
+    const struct map_funcs *);
 
 int		 up_map_loadall(struct disk *);
+int		 up_map_loaddepth(struct disk *, int);
+int		 up_map_expand(struct disk *, struct part *);
+int		 up_map_classify(struct disk *, unsigned int, int,
+    enum mapid *);
 void		 up_map_freeall(struct disk *);
 
 int		 up_map_load(struct disk *, struct part *, enum mapid,
@@ -135,13 +168,19 @@ int		 up_map_load(struct disk *, struct part *, enum mapid,
 struct part	*up_map_add(struct map *, int64_t, int64_t, int, void *);
 
 void		 up_map_free(struct disk *, struct map *);
-void		 up_map_freeprivmap_def(struct map *, void *);
-void		 up_map_freeprivpart_def(struct part *, void *);
+
+/*
+  Allocate zeroed memory which lasts until up_map_freeall(), for maps,
+  partitions and their private data. It is never freed separately.
+*/
+void		*up_map_alloc(const struct disk *, size_t);
 
 const char	*up_map_label(const struct map *);
+enum mapid	 up_map_typebyname(const struct up_ctx *, const char *);
 void		 up_map_dumpsect(const struct map *, FILE *, int64_t,
     int64_t, const void *, int);
 void		 up_map_printall(const struct disk *, void *);
+void		 up_map_printstats(const struct disk *, void *);
 
 const struct part *up_map_first(const struct map *);
 const struct part *up_map_next(const struct part *);
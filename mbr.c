@@ -84,6 +84,8 @@ static int	mbr_load(const struct disk *, const struct part *,
     void **);
 static int	mbrext_load(const struct disk *, const struct part *,
     void **);
+static void	mbr_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	mbr_setup(struct disk *, struct map *);
 static int	mbrext_setup(struct disk *, struct map *);
 static int	mbr_getinfo(const struct map *, FILE *);
@@ -96,31 +98,49 @@ static int	mbr_read(const struct disk *, int64_t, int64_t,
     const struct up_mbr_p **);
 static const char *mbr_name(uint8_t type);
 
+static const struct map_sig mbr_sigs[] = {
+	{ 0, 510, "\x55\xaa", 2, 0 },
+	{ 0 }
+};
+
+/*
+  Extended MBRs are always loaded, mbrext_setup() checks the magic of
+  each one in the chain and complains if it's missing.
+*/
+static const struct map_sig mbrext_sigs[] = {
+	{ 0 }
+};
+
 void
-up_mbr_register(void)
+up_mbr_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = "MBR";
+	funcs.name = "mbr";
 	funcs.load = mbr_load;
+	funcs.footprint = mbr_footprint;
+	funcs.sigs = mbr_sigs;
 	funcs.setup = mbr_setup;
 	funcs.print_header = mbr_getinfo;
 	funcs.get_index = mbr_getindex;
 	funcs.print_extrahdr = mbr_getextrahdr;
 	funcs.print_extra = mbr_getextra;
-	up_map_register(UP_MAP_MBR, &funcs);
+	up_map_register(ctx, UP_MAP_MBR, &funcs);
 
 	up_map_funcs_init(&funcs);
 	funcs.label = "extended MBR";
-	funcs.flags |= UP_TYPE_NOPRINTHDR;
+	funcs.name = "mbrext";
+	funcs.flags |= UP_TYPE_NOPRINTHDR | UP_TYPE_NOMEMO;
 	funcs.load = mbrext_load;
+	funcs.footprint = mbr_footprint;
+	funcs.sigs = mbrext_sigs;
 	funcs.setup = mbrext_setup;
 	funcs.get_index = mbr_getindex;
 	funcs.print_extrahdr = mbr_getextrahdr;
 	funcs.print_extra = mbr_getextra;
-	funcs.free_mappriv = NULL;
-	up_map_register(UP_MAP_MBREXT, &funcs);
+	up_map_register(ctx, UP_MAP_MBREXT, &funcs);
 }
 
 static int
@@ -146,7 +166,7 @@ mbr_load(const struct disk *disk, const struct part *parent, void **priv)
 		return (res);
 
 	/* create map private struct */
-	if ((mbr = xalloc(1, sizeof(*mbr), XA_ZERO)) == NULL)
+	if ((mbr = up_map_alloc(disk, sizeof(*mbr))) == NULL)
 		return (-1);
 
 	mbr->mbr = *buf;
@@ -167,6 +187,14 @@ mbrext_load(const struct disk *disk, const struct part *parent,
             MBR_ID_IS_EXT(((const struct up_mbrpart*)parent->priv)->part.type));
 }
 
+static void
+mbr_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	*head = 1;
+	*tail = 0;
+}
+
 static int
 mbr_setup(struct disk *disk, struct map *map)
 {
@@ -195,6 +223,7 @@ mbrext_setup(struct disk *disk, struct map *map)
 	assert(map->parent->map->type == UP_MAP_MBR);
 
 	parent = map->parent->map->priv;
+	up_disk_clearrefused(disk);
 	diskoff = UP_MAP_VIRTADDR(map);
 	reloff = 0;
 	index = MBR_PART_COUNT + parent->extcount;
@@ -204,16 +233,22 @@ mbrext_setup(struct disk *disk, struct map *map)
 		assert(diskoff >= UP_MAP_VIRTADDR(map) &&
 		    diskoff - UP_MAP_VIRTADDR(map) < map->size);
 		physoff = UP_MAP_VIRT_TO_PHYS(map, diskoff);
-		if (!(buf = up_disk_save1sect(disk, physoff, map, 1)))
+		if (!(buf = up_disk_save1sect(disk, physoff, map, 1))) {
+			/* keep what was found before the disk was given up on */
+			if ((up_disk_degraded(disk) ||
+				up_disk_wasrefused(disk)) &&
+			    map->partcount > 0)
+				break;
 			return (-1);
+		}
 
 		if (UP_LETOH16(buf->magic) != MBR_MAGIC) {
-			if (UP_NOISY(QUIET))
-				up_msg((opts->relaxed ?
+			if (UP_NOISY(disk->ctx, QUIET))
+				up_msg(disk->ctx, (disk->ctx->opts.relaxed ?
 					UP_MSG_FWARN : UP_MSG_FERR),
 				    "extended MBR in sector %"PRId64" has "
 				    "invalid magic number", physoff);
-			if (!opts->relaxed)
+			if (!disk->ctx->opts.relaxed)
 				return 0;
 		}
 
@@ -224,14 +259,14 @@ mbrext_setup(struct disk *disk, struct map *map)
 		if (MBR_ID_UNUSED == buf->part[MBR_EXTNEXT].type)
 			break;
 		else if (!MBR_ID_IS_EXT(buf->part[MBR_EXTNEXT].type)) {
-			if (UP_NOISY(QUIET))
-				up_msg((opts->relaxed ?
+			if (UP_NOISY(disk->ctx, QUIET))
+				up_msg(disk->ctx, (disk->ctx->opts.relaxed ?
 					UP_MSG_FWARN : UP_MSG_FERR),
 				    "extended MBR in sector %"PRId64" has "
 				    "invalid type for partition %d 0x%02x",
 				    physoff, MBR_EXTNEXT,
 				    buf->part[MBR_EXTNEXT].type);
-			if (!opts->relaxed)
+			if (!disk->ctx->opts.relaxed)
 				return (0);
 			break;
 		}
@@ -242,8 +277,9 @@ mbrext_setup(struct disk *disk, struct map *map)
 		diskoff = UP_MAP_VIRTADDR(map) + reloff;
 
 		if (reloff < 0 || reloff >= map->size) {
-			if (UP_NOISY(QUIET))
-				up_warn("logical MBR partition %d out of "
+			if (UP_NOISY(disk->ctx, QUIET))
+				up_warn(disk->ctx,
+				    "logical MBR partition %d out of "
 				    "range: offset %"PRId64"+%"PRId64" size "
 				    "%"PRId64, index, UP_MAP_VIRTADDR(map),
 				    reloff, map->size);
@@ -259,11 +295,11 @@ mbrext_setup(struct disk *disk, struct map *map)
 static int
 mbr_getinfo(const struct map *map, FILE *stream)
 {
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	if (fprintf(stream, "%s partition table at ", up_map_label(map)) < 0 ||
-	    printsect_verbose(UP_MAP_VIRTADDR(map), stream) < 0 ||
+	    up_printsect_verbose(map->disk, UP_MAP_VIRTADDR(map), stream) < 0 ||
 	    fprintf(stream, " of %s:\n", UP_DISK_PATH(map->disk)) < 0)
 		return (-1);
 	return (1);
@@ -281,10 +317,10 @@ mbr_getindex(const struct part *part, char *buf, size_t size)
 static int
 mbr_getextrahdr(const struct map *map, FILE *stream)
 {
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
-	if (UP_NOISY(EXTRA))
+	if (UP_NOISY(map->disk->ctx, EXTRA))
 		return (fprintf(stream, " A    C   H  S    C   H  S Type"));
 	else
 		return (fprintf(stream, " A Type"));
@@ -298,7 +334,7 @@ mbr_getextra(const struct part *part, FILE *stream)
 	const char *label;
 	char active;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = part->priv;
@@ -310,7 +346,7 @@ mbr_getextra(const struct part *part, FILE *stream)
 	lastcyl = MBR_GETCYL(priv->part.lastsectcyl);
 	lastsect = MBR_GETSECT(priv->part.lastsectcyl);
 
-	if (UP_NOISY(EXTRA))
+	if (UP_NOISY(part->map->disk->ctx, EXTRA))
 		return (fprintf(stream, " %c %4u/%3u/%2u-%4u/%3u/%2u %s "
 			"(0x%02x)", active, firstcyl, priv->part.firsthead,
 			firstsect, lastcyl, priv->part.lasthead, lastsect,
@@ -330,7 +366,7 @@ mbr_addpart(struct map *map, const struct up_mbrpart_p *part, int index,
 	assert((MBR_PART_COUNT > index && 0 == extoff && !extmbr) ||
 	    (MBR_PART_COUNT <= index && 0 < extoff && extmbr));
 
-	if ((priv = xalloc(1, sizeof(*priv), XA_ZERO)) == NULL)
+	if ((priv = up_map_alloc(map->disk, sizeof(*priv))) == NULL)
 		return (-1);
 
 	priv->part = *part;
@@ -346,11 +382,12 @@ mbr_addpart(struct map *map, const struct up_mbrpart_p *part, int index,
 	flags = 0;
 	if (part->type == MBR_ID_UNUSED)
 		flags |= UP_PART_EMPTY;
+	/* logical partitions are numbered after earlier extended ones */
+	if (extmbr == NULL && MBR_ID_IS_EXT(part->type))
+		flags |= UP_PART_SERIAL;
 
-	if (!up_map_add(map, part->start, part->size, flags, priv)) {
-		free(priv);
+	if (!up_map_add(map, part->start, part->size, flags, priv))
 		return (-1);
-	}
 
 	return (0);
 }
@@ -17,7 +17,9 @@
 #ifndef HDR_UPART_MBR
 #define HDR_UPART_MBR
 
+struct up_ctx;
+
 /* register MBR partition map type */
-void up_mbr_register(void);
+void up_mbr_register(struct up_ctx *);
 
 #endif /* HDR_UPART_MBR */
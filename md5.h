@@ -15,6 +15,13 @@
 #ifndef _MD5_H_
 #define _MD5_H_
 
+/* renamed so they can't collide with the system's in libupart users */
+#define	MD5Init				up_MD5Init
+#define	MD5Update			up_MD5Update
+#define	MD5Pad				up_MD5Pad
+#define	MD5Final			up_MD5Final
+#define	MD5Transform			up_MD5Transform
+
 #define	MD5_BLOCK_LENGTH		64
 #define	MD5_DIGEST_LENGTH		16
 #define	MD5_DIGEST_STRING_LENGTH	(MD5_DIGEST_LENGTH * 2 + 1)
@@ -87,7 +87,8 @@ os_bsd_sysctl_alloc(int *name, unsigned int namelen)
   "wd0:a1d0642fc8eba9f5,cd0:,sd0:3e5540338a09c700,sd1:".
 */
 int
-os_bsd_listdev_hw_disknames(os_list_callback_func func, void *arg)
+os_bsd_listdev_hw_disknames(struct up_ctx *ctx, os_list_callback_func func,
+    void *arg)
 {
 	int mib[2] = { CTL_HW, HW_DISKNAMES };
 	char *names, *begin, *end;
@@ -99,7 +100,7 @@ os_bsd_listdev_hw_disknames(os_list_callback_func func, void *arg)
 		else if (errno == ENOMEM)
 			perror("malloc");
 		else
-			up_warn("failed to retrieve hw.disknames "
+			up_warn(ctx, "failed to retrieve hw.disknames "
 			    "sysctl: %s", strerror(errno));
 		return (-1);
 	}
@@ -128,7 +129,8 @@ os_bsd_listdev_hw_disknames(os_list_callback_func func, void *arg)
   of short device names.
  */
 int
-os_bsd_listdev_kern_disks(os_list_callback_func func, void *arg)
+os_bsd_listdev_kern_disks(struct up_ctx *ctx, os_list_callback_func func,
+    void *arg)
 {
 	char *names, *begin, *end;
 	int mib[2], once;
@@ -143,7 +145,7 @@ os_bsd_listdev_kern_disks(os_list_callback_func func, void *arg)
 		else if (errno == ENOMEM)
 			perror("malloc");
 		else
-			up_warn("failed to retrieve kern.disks "
+			up_warn(ctx, "failed to retrieve kern.disks "
 			    "sysctl: %s", strerror(errno));
 		return (-1);
 	}
@@ -164,19 +166,19 @@ os_bsd_listdev_kern_disks(os_list_callback_func func, void *arg)
 #    endif /* HAVE_SYSCTLNAMETOMIB */
 
 int
-os_listdev_sysctl(os_list_callback_func func, void *arg)
+os_listdev_sysctl(struct up_ctx *ctx, os_list_callback_func func, void *arg)
 {
 	int saved ATTR_UNUSED = 0;
 	int ret = 0;
 
 #if defined(CTL_HW) && defined(HW_DISKNAMES)
-	if ((ret = os_bsd_listdev_hw_disknames(func, arg)) < 0)
+	if ((ret = os_bsd_listdev_hw_disknames(ctx, func, arg)) < 0)
 		saved = errno;
 #endif
 
 #ifdef HAVE_SYSCTLNAMETOMIB
 	if (ret <= 0)
-		ret = os_bsd_listdev_kern_disks(func, arg);
+		ret = os_bsd_listdev_kern_disks(ctx, func, arg);
 	if (ret == 0 && saved != 0) {
 		ret = -1;
 		errno = saved;
@@ -230,7 +232,8 @@ OS_GENERATE_OPENDISK_STUB(os_opendisk_opendev)
 #if defined(HAVE_SYS_DISKLABEL_H) && \
     (defined(DIOCGPDINFO) || defined(DIOCGDINFO))
 int
-os_getparams_disklabel(int fd, struct disk_params *params, const char *name)
+os_getparams_disklabel(struct up_ctx *ctx, int fd, struct disk_params *params,
+    const char *name)
 {
 	struct disklabel dl;
 
@@ -242,8 +245,8 @@ os_getparams_disklabel(int fd, struct disk_params *params, const char *name)
 	if (ioctl(fd, DIOCGDINFO, &dl) < 0)
 #    endif
 	{
-		if (errno && UP_NOISY(QUIET))
-			up_err("failed to get disklabel for %s: %s",
+		if (errno && UP_NOISY(ctx, QUIET))
+			up_err(ctx, "failed to get disklabel for %s: %s",
 			    name, strerror(errno));
 		return (-1);
 	}
@@ -266,33 +269,35 @@ OS_GENERATE_GETPARAMS_STUB(os_getparams_disklabel)
 
 #if defined(HAVE_SYS_DISK_H) && defined(DIOCGSECTORSIZE)
 int
-os_getparams_freebsd(int fd, struct disk_params *params, const char *name)
+os_getparams_freebsd(struct up_ctx *ctx, int fd, struct disk_params *params,
+    const char *name)
 {
 	u_int ival;
 	off_t oval;
 
 	if (ioctl(fd, DIOCGSECTORSIZE, &ival) == 0)
 		params->sectsize = ival;
-	else if (UP_NOISY(QUIET))
-		up_warn("failed to get disk size for %s: %s",
+	else if (UP_NOISY(ctx, QUIET))
+		up_warn(ctx, "failed to get disk size for %s: %s",
 		    name, strerror(errno));
 
 	if (params->sectsize > 0 && ioctl(fd, DIOCGMEDIASIZE, &oval) == 0)
 		params->size = oval / params->sectsize;
-	else if (UP_NOISY(QUIET))
-		up_warn("failed to get sector size for %s: %s",
+	else if (UP_NOISY(ctx, QUIET))
+		up_warn(ctx, "failed to get sector size for %s: %s",
 		    name, strerror(errno));
 
 	if (ioctl(fd, DIOCGFWSECTORS, &ival) == 0)
 		params->sects = ival;
-	else if (UP_NOISY(QUIET))
-		up_warn("failed to get sectors per track for %s: %s",
+	else if (UP_NOISY(ctx, QUIET))
+		up_warn(ctx, "failed to get sectors per track for %s: %s",
 		    name, strerror(errno));
 
 	if (ioctl(fd, DIOCGFWHEADS, &ival) == 0)
 		params->heads = ival;
-	else if (UP_NOISY(QUIET))
-		up_warn("failed to get heads (tracks per cylinder) for %s: %s",
+	else if (UP_NOISY(ctx, QUIET))
+		up_warn(ctx,
+		    "failed to get heads (tracks per cylinder) for %s: %s",
 		    name, strerror(errno));
 
 	return (1);
@@ -51,7 +51,7 @@
 #include <mach/mach_error.h>
 
 int
-os_listdev_iokit(os_list_callback_func func, void *arg)
+os_listdev_iokit(struct up_ctx *ctx, os_list_callback_func func, void *arg)
 {
 	CFMutableDictionaryRef dict;
 	io_iterator_t iter;
@@ -61,7 +61,7 @@ os_listdev_iokit(os_list_callback_func func, void *arg)
 
 	if ((dict = IOServiceMatching(kIOMediaClass)) == NULL) {
 		/* XXX does this set errno? */
-		up_warn("failed to create matching dictionary: %s",
+		up_warn(ctx, "failed to create matching dictionary: %s",
 		    strerror(errno));
 		return (-1);
 	}
@@ -69,7 +69,7 @@ os_listdev_iokit(os_list_callback_func func, void *arg)
 
 	ret = IOServiceGetMatchingServices(kIOMasterPortDefault, dict, &iter);
 	if (ret != KERN_SUCCESS) {
-		up_warn("failed to get maching IOKit services: %s\n",
+		up_warn(ctx, "failed to get maching IOKit services: %s\n",
 		    mach_error_string(ret));
 		return (-1);
 	}
@@ -82,7 +82,7 @@ os_listdev_iokit(os_list_callback_func func, void *arg)
 		    CFSTR(kIOBSDNameKey), kCFAllocatorDefault, 0);
 		if (name == NULL) {
 			/* XXX does this set errno? */
-			up_warn("failed to get service property: %s",
+			up_warn(ctx, "failed to get service property: %s",
 			    strerror(errno));
 			IOObjectRelease(serv);
 			continue;
@@ -98,7 +98,7 @@ os_listdev_iokit(os_list_callback_func func, void *arg)
 		if (!CFStringGetCString(name, suchAFuckingPainInTheAss, len,
 			kCFStringEncodingASCII)) {
 			/* XXX does this set errno? */
-			up_warn("failed to convert string: %s",
+			up_warn(ctx, "failed to convert string: %s",
 			    strerror(errno));
 		} else {
 			func(suchAFuckingPainInTheAss, arg);
@@ -118,20 +118,21 @@ OS_GENERATE_LISTDEV_STUB(os_listdev_iokit)
 
 #if defined(HAVE_SYS_DISK_H) && defined(DKIOCGETBLOCKSIZE)
 int
-os_getparams_darwin(int fd, struct disk_params *params, const char *name)
+os_getparams_darwin(struct up_ctx *ctx, int fd, struct disk_params *params,
+    const char *name)
 {
 	uint32_t smallsize;
 	uint64_t bigsize;
 
 	if (ioctl(fd, DKIOCGETBLOCKSIZE, &smallsize) == 0)
 		params->sectsize = smallsize;
-	else if (UP_NOISY(QUIET))
-		up_warn("failed to get sector size for %s: %s",
+	else if (UP_NOISY(ctx, QUIET))
+		up_warn(ctx, "failed to get sector size for %s: %s",
 		    name, strerror(errno));
 	if (ioctl(fd, DKIOCGETBLOCKCOUNT, &bigsize) == 0)
 		params->size = bigsize;
-	else if (UP_NOISY(QUIET))
-		up_warn("failed to get block count for %s: %s",
+	else if (UP_NOISY(ctx, QUIET))
+		up_warn(ctx, "failed to get block count for %s: %s",
 		    name, strerror(errno));
 
 	return (1);
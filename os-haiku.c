@@ -117,7 +117,7 @@ stat_disk_id(partition_id id, size_t size)
 }
 
 int
-os_listdev_haiku(os_list_callback_func func, void *arg)
+os_listdev_haiku(struct up_ctx *ctx, os_list_callback_func func, void *arg)
 {
 	int32 cookie;
 	partition_id id;
@@ -133,7 +133,8 @@ os_listdev_haiku(os_list_callback_func func, void *arg)
 			return (1);
 		dev = stat_disk_id(id, size);
 		if (dev == NULL) {
-			up_warn("failed to get device parameters for %ld: %s",
+			up_warn(ctx,
+			    "failed to get device parameters for %ld: %s",
 			    id, strerror(errno));
 			return (-1);
 		}
@@ -239,7 +240,8 @@ trunc:
 }
 
 int
-os_getparams_haiku(int fd, struct disk_params *params, const char *name)
+os_getparams_haiku(struct up_ctx *ctx, int fd, struct disk_params *params,
+    const char *name)
 {
 	partition_id id;
 	size_t size;
@@ -248,17 +250,17 @@ os_getparams_haiku(int fd, struct disk_params *params, const char *name)
 	size = 0;
 	id = _kern_find_disk_device(name, &size);
 	if (id < 0) {
-		up_warn("not a disk device: %s", name);
+		up_warn(ctx, "not a disk device: %s", name);
 		return (-1);
 	}
 	dev = stat_disk_id(id, size);
 	if (dev == NULL) {
-		up_warn("failed to get device parameters for %s: %s",
+		up_warn(ctx, "failed to get device parameters for %s: %s",
 		    name, strerror(errno));
 		return (-1);
 	}
 	if ((dev->device_flags & B_DISK_DEVICE_HAS_MEDIA) == 0) {
-		up_warn("failed to get device parameters for %s: "
+		up_warn(ctx, "failed to get device parameters for %s: "
 		    "no media loaded", name);
 		return (-1);
 	}
@@ -36,6 +36,12 @@
 #ifdef HAVE_LINUX_HDREG_H
 #include <linux/hdreg.h>
 #endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 #include <ctype.h>
 #ifdef HAVE_DIRENT_H
@@ -49,6 +55,7 @@
 #endif
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -67,7 +74,8 @@
 static int	scanf_at(int, const char *, const char *, ...);
 
 static int
-os_linux_listdev_sysfs(os_list_callback_func func, void *arg)
+os_linux_listdev_sysfs(struct up_ctx *ctx, os_list_callback_func func,
+    void *arg)
 {
 	char const blockpath[] = "/sys/block";
 	int ret, cnt, devfd;
@@ -79,7 +87,7 @@ os_linux_listdev_sysfs(os_list_callback_func func, void *arg)
 	if ((dir = opendir(blockpath)) == NULL) {
 		if (errno == ENOENT)
 			return (0);
-		up_warn("failed to list /sys/block: %s", strerror(errno));
+		up_warn(ctx, "failed to list /sys/block: %s", strerror(errno));
 		return (-1);
 	}
 
@@ -89,8 +97,8 @@ os_linux_listdev_sysfs(os_list_callback_func func, void *arg)
 		if ((devfd = openat(dirfd(dir), name, O_RDONLY)) == -1) {
 			if (errno == ENOENT)
 				continue;
-			if (UP_NOISY(QUIET))
-				up_err("failed to open %s/%s: %s",
+			if (UP_NOISY(ctx, QUIET))
+				up_err(ctx, "failed to open %s/%s: %s",
 				    blockpath, name, strerror(errno));
 			return (-1);
 		}
@@ -102,8 +110,8 @@ os_linux_listdev_sysfs(os_list_callback_func func, void *arg)
 		/* ignore devices with a size of 0 */
 		size = -1;
 		if ((cnt = scanf_at(devfd, "size", "%"PRId64, &size)) == -1) {
-			if (UP_NOISY(QUIET))
-				up_err("failed to read %s/%s/size: %s",
+			if (UP_NOISY(ctx, QUIET))
+				up_err(ctx, "failed to read %s/%s/size: %s",
 				    blockpath, name, strerror(errno));
 			goto error;
 		}
@@ -113,8 +121,8 @@ os_linux_listdev_sysfs(os_list_callback_func func, void *arg)
 		/* ignore devices with an uninteresting major/minor number */
 		major = minor = -1;
 		if ((cnt = scanf_at(devfd, "dev", "%ld:%ld", &major, &minor)) == -1) {
-			if (UP_NOISY(QUIET))
-				up_err("failed to read %s/%s/dev: %s",
+			if (UP_NOISY(ctx, QUIET))
+				up_err(ctx, "failed to read %s/%s/dev: %s",
 				    blockpath, name, strerror(errno));
 			goto error;
 		}
@@ -164,7 +172,8 @@ scanf_at(int dirfd, const char *name, const char *format, ...)
 }
 
 static int
-os_linux_listdev_devfs(os_list_callback_func func, void *arg)
+os_linux_listdev_devfs(struct up_ctx *ctx, os_list_callback_func func,
+    void *arg)
 {
 	static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
 	struct dirent *ent;
@@ -173,7 +182,7 @@ os_linux_listdev_devfs(os_list_callback_func func, void *arg)
 	/* XXX ugh, there has to be a better way to do this */
 
 	if ((dir = opendir("/dev")) == NULL) {
-		up_warn("failed to list /dev: %s", strerror(errno));
+		up_warn(ctx, "failed to list /dev: %s", strerror(errno));
 		return (-1);
 	}
 
@@ -200,16 +209,16 @@ os_linux_listdev_devfs(os_list_callback_func func, void *arg)
 }
 
 int
-os_listdev_linux(os_list_callback_func func, void *arg)
+os_listdev_linux(struct up_ctx *ctx, os_list_callback_func func, void *arg)
 {
 	int saved = 0;
 	int ret = 0;
 
-	if ((ret = os_linux_listdev_sysfs(func, arg)) < 0)
+	if ((ret = os_linux_listdev_sysfs(ctx, func, arg)) < 0)
 		saved = errno;
 
 	if (ret <= 0)
-		ret = os_linux_listdev_devfs(func, arg);
+		ret = os_linux_listdev_devfs(ctx, func, arg);
 	if (ret == 0 && saved != 0) {
 		ret = -1;
 		errno = saved;
@@ -252,10 +261,12 @@ OS_GENERATE_GETDESC_STUB(os_getdesc_linux)
 
 #if defined(HAVE_LINUX_FS_H) || defined(HAVE_LINUX_HDREG_H)
 int
-os_getparams_linux(int fd, struct disk_params *params, const char *name)
+os_getparams_linux(struct up_ctx *ctx, int fd, struct disk_params *params,
+    const char *name)
 {
 	struct hd_geometry geom;
 	int smallsize;
+	unsigned int blksize;
 	uint64_t bigsize;
 
 	/* XXX rather than an ugly maze of #ifdefs I'll just assume these
@@ -272,14 +283,225 @@ os_getparams_linux(int fd, struct disk_params *params, const char *name)
 	} else if (ioctl(fd, BLKGETSIZE, &smallsize) == 0)
 		params->size = smallsize;
 	else {
-		if (UP_NOISY(QUIET))
-			up_err("failed to get disk size for %s: %s",
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "failed to get disk size for %s: %s",
 			    name, strerror(errno));
 		return (-1);
 	}
 
+	/* block topology, used to align reads */
+#ifdef BLKPBSZGET
+	if (ioctl(fd, BLKPBSZGET, &blksize) == 0)
+		params->physsectsize = blksize;
+#endif
+#ifdef BLKIOOPT
+	if (ioctl(fd, BLKIOOPT, &blksize) == 0)
+		params->iosize = blksize;
+#endif
+
 	return (1);
 }
 #else
 OS_GENERATE_GETPARAMS_STUB(os_getparams_linux)
 #endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+    defined(__NR_io_uring_enter)
+
+struct os_uring_slot {
+	struct iovec iov;
+	void *cookie;
+	int next;
+};
+
+struct os_uring {
+	int devfd;
+	int fd;
+	void *sqmap;
+	size_t sqmaplen;
+	void *cqmap;
+	size_t cqmaplen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+	unsigned int *sqtail;
+	unsigned int *sqmask;
+	unsigned int *sqarray;
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int *cqmask;
+	struct io_uring_cqe *cqes;
+	unsigned int queued;		/* not yet handed to the kernel */
+	unsigned int inflight;		/* handed to the kernel, not reaped */
+	struct os_uring_slot *slots;
+	int freeslot;
+};
+
+static int	os_uring_submit(void *, void *, size_t, int64_t, void *);
+static int	os_uring_wait(void *, void **, ssize_t *);
+static void	os_uring_close(void *);
+
+static const struct os_aio_engine os_uring_engine = {
+	os_uring_submit,
+	os_uring_wait,
+	os_uring_close,
+};
+
+#define URING_PTR(map, off)	((void *)((char *)(map) + (off)))
+
+int
+os_aioopen_uring(int fd, int depth, const struct os_aio_engine **engine,
+    void **priv)
+{
+	struct io_uring_params params;
+	struct os_uring *ring;
+	unsigned int i;
+
+	if ((ring = calloc(1, sizeof(*ring))) == NULL)
+		return (0);
+	ring->devfd = fd;
+	ring->sqmap = ring->cqmap = ring->sqes = MAP_FAILED;
+
+	/* any failure here means the kernel can't do it, so fall back */
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd < 0) {
+		free(ring);
+		return (0);
+	}
+
+	ring->sqmaplen = params.sq_off.array +
+	    params.sq_entries * sizeof(unsigned int);
+	ring->sqmap = mmap(NULL, ring->sqmaplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cqmaplen = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->cqmap = mmap(NULL, ring->cqmaplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->slots = calloc(params.sq_entries, sizeof(*ring->slots));
+	if (ring->sqmap == MAP_FAILED || ring->cqmap == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED || ring->slots == NULL) {
+		os_uring_close(ring);
+		return (0);
+	}
+
+	ring->sqtail = URING_PTR(ring->sqmap, params.sq_off.tail);
+	ring->sqmask = URING_PTR(ring->sqmap, params.sq_off.ring_mask);
+	ring->sqarray = URING_PTR(ring->sqmap, params.sq_off.array);
+	ring->cqhead = URING_PTR(ring->cqmap, params.cq_off.head);
+	ring->cqtail = URING_PTR(ring->cqmap, params.cq_off.tail);
+	ring->cqmask = URING_PTR(ring->cqmap, params.cq_off.ring_mask);
+	ring->cqes = URING_PTR(ring->cqmap, params.cq_off.cqes);
+
+	/* never have more reads outstanding than there are sq entries */
+	for (i = 0; i < params.sq_entries; i++)
+		ring->slots[i].next = i + 1;
+	ring->slots[params.sq_entries - 1].next = -1;
+	ring->freeslot = 0;
+
+	*engine = &os_uring_engine;
+	*priv = ring;
+	return (1);
+}
+
+static int
+os_uring_submit(void *priv, void *buf, size_t size, int64_t off,
+    void *cookie)
+{
+	struct os_uring *ring = priv;
+	struct os_uring_slot *slot;
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	int idx;
+
+	if ((idx = ring->freeslot) < 0)
+		return (0);
+	slot = &ring->slots[idx];
+	ring->freeslot = slot->next;
+	slot->iov.iov_base = buf;
+	slot->iov.iov_len = size;
+	slot->cookie = cookie;
+
+	/* only we write the tail, the kernel reads it */
+	tail = *ring->sqtail;
+	sqe = &ring->sqes[tail & *ring->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = ring->devfd;
+	sqe->addr = (uintptr_t)&slot->iov;
+	sqe->len = 1;
+	sqe->off = off;
+	sqe->user_data = idx;
+	ring->sqarray[tail & *ring->sqmask] = tail & *ring->sqmask;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+
+	return (1);
+}
+
+static int
+os_uring_wait(void *priv, void **cookie, ssize_t *res)
+{
+	struct os_uring *ring = priv;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int ret, idx;
+
+	for (;;) {
+		if (ring->queued == 0 && ring->inflight == 0)
+			return (0);
+
+		/* only we write the head, the kernel writes the tail */
+		head = *ring->cqhead;
+		if (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+			break;
+
+		/* hand over anything queued and wait for one to finish */
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		ring->queued -= ret;
+		ring->inflight += ret;
+	}
+
+	cqe = &ring->cqes[head & *ring->cqmask];
+	idx = cqe->user_data;
+	*cookie = ring->slots[idx].cookie;
+	if (cqe->res < 0) {
+		*res = -1;
+		errno = -cqe->res;
+	} else
+		*res = cqe->res;
+	__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+
+	ring->slots[idx].next = ring->freeslot;
+	ring->freeslot = idx;
+	ring->inflight--;
+
+	return (1);
+}
+
+static void
+os_uring_close(void *priv)
+{
+	struct os_uring *ring = priv;
+
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqeslen);
+	if (ring->cqmap != MAP_FAILED)
+		munmap(ring->cqmap, ring->cqmaplen);
+	if (ring->sqmap != MAP_FAILED)
+		munmap(ring->sqmap, ring->sqmaplen);
+	close(ring->fd);
+	free(ring->slots);
+	free(ring);
+}
+#else
+OS_GENERATE_AIOOPEN_STUB(os_aioopen_uring)
+#endif
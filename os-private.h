@@ -19,6 +19,7 @@
 
 struct disk_params;
 struct os_device_handle;
+struct up_ctx;
 
 #ifdef OS_TYPE_WINDOWS
 #define WIN32_LEAN_AND_MEAN
@@ -35,53 +36,80 @@ typedef int os_handle;
 #define OS_HANDLE_OUT(i)	((os_device_handle)(size_t)(i))
 
 typedef int (*os_list_callback_func)(const char *, void *);
-typedef int (*os_list_func)(os_list_callback_func, void *);
+typedef int (*os_list_func)(struct up_ctx *, os_list_callback_func, void *);
 typedef int (*os_open_func)(const char *, int, char *, size_t, os_handle *);
-typedef int (*os_params_func)(os_handle, struct disk_params *, const char *);
+typedef int (*os_params_func)(struct up_ctx *, os_handle,
+    struct disk_params *, const char *);
 typedef int (*os_desc_func)(os_handle, char *, size_t, const char *);
 
+/* an asynchronous read engine, see os_aio_open() */
+struct os_aio_engine {
+	/* queue a read, return 0 if full, 1 if queued, -1 on error */
+	int	(*submit)(void *, void *, size_t, int64_t, void *);
+	/* reap one read, return 0 if none outstanding, 1 if done, -1 on error */
+	int	(*wait)(void *, void **, ssize_t *);
+	void	(*close)(void *);
+};
+
+typedef int (*os_aioopen_func)(os_handle, int, const struct os_aio_engine **,
+    void **);
+
 /* os-bsd.c */
-int	os_listdev_sysctl(os_list_callback_func, void *);
+int	os_listdev_sysctl(struct up_ctx *, os_list_callback_func, void *);
 int	os_opendisk_opendisk(const char *, int, char *, size_t, os_handle *);
 int	os_opendisk_opendev(const char *, int, char *, size_t, os_handle *);
-int	os_getparams_disklabel(os_handle, struct disk_params *, const char *);
-int	os_getparams_freebsd(os_handle, struct disk_params *, const char *);
+int	os_getparams_disklabel(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
+int	os_getparams_freebsd(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
 int	os_getdesc_diocinq(os_handle, char *, size_t, const char *);
 
 /* os-darwin.c */
-int	os_listdev_iokit(os_list_callback_func, void *);
-int	os_getparams_darwin(os_handle, struct disk_params *, const char *);
+int	os_listdev_iokit(struct up_ctx *, os_list_callback_func, void *);
+int	os_getparams_darwin(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
 
 /* os-haiku.c */
-int	os_listdev_haiku(os_list_callback_func, void *);
+int	os_listdev_haiku(struct up_ctx *, os_list_callback_func, void *);
 int	os_opendisk_haiku(const char *, int, char *, size_t, os_handle *);
-int	os_getparams_haiku(os_handle, struct disk_params *, const char *);
+int	os_getparams_haiku(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
 
 /* os-linux.c */
-int	os_listdev_linux(os_list_callback_func, void *);
-int	os_getparams_linux(os_handle, struct disk_params *, const char *);
+int	os_listdev_linux(struct up_ctx *, os_list_callback_func, void *);
+int	os_getparams_linux(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
 int	os_getdesc_linux(os_handle, char *, size_t, const char *);
+int	os_aioopen_uring(os_handle, int, const struct os_aio_engine **,
+    void **);
 
 /* os-solaris.c */
-int	os_listdev_solaris(os_list_callback_func, void *);
+int	os_listdev_solaris(struct up_ctx *, os_list_callback_func, void *);
 int	os_opendisk_solaris(const char *, int, char *, size_t, os_handle *);
-int	os_getparams_solaris(os_handle, struct disk_params *, const char *);
+int	os_getparams_solaris(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
 
 /* os-unix.c */
 int	os_opendisk_unix(const char *, int, char *, size_t, os_handle *);
 
 /* os-windows.c */
-int	os_listdev_windows(os_list_callback_func, void *);
+int	os_listdev_windows(struct up_ctx *, os_list_callback_func, void *);
 int	os_opendisk_windows(const char *, int, char *, size_t, os_handle *);
-int	os_getparams_windows(os_handle, struct disk_params *, const char *);
+int	os_getparams_windows(struct up_ctx *, os_handle, struct disk_params *,
+    const char *);
 
 #define OS_GENERATE_LISTDEV_STUB(fn) \
-	int fn(os_list_callback_func f, void *a) { return (0); }
+	int fn(struct up_ctx *c, os_list_callback_func f, void *a) \
+	{ return (0); }
 #define OS_GENERATE_OPENDISK_STUB(fn) \
 	int fn(const char *n, int f, char *b, size_t l, os_handle *r) { return (0); }
 #define OS_GENERATE_GETPARAMS_STUB(fn) \
-	int fn(os_handle h, struct disk_params *p, const char *n) { return (0); }
+	int fn(struct up_ctx *c, os_handle h, struct disk_params *p, \
+	    const char *n) { return (0); }
 #define OS_GENERATE_GETDESC_STUB(fn) \
 	int fn(os_handle h, char *p, size_t s, const char *n) { return (0); }
+#define OS_GENERATE_AIOOPEN_STUB(fn) \
+	int fn(os_handle h, int d, const struct os_aio_engine **e, void **r) \
+	{ return (0); }
 
 #endif /* HDR_UPART_OS_PRIVATE */
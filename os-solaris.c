@@ -60,7 +60,7 @@
 #define WHOLE_PART		"s2"
 
 int
-os_listdev_solaris(os_list_callback_func func, void *arg)
+os_listdev_solaris(struct up_ctx *ctx, os_list_callback_func func, void *arg)
 {
 	static const char hex[] = "0123456789ABCDEF";
 	static const char num[] = "0123456789";
@@ -71,7 +71,7 @@ os_listdev_solaris(os_list_callback_func func, void *arg)
 	/* XXX this sucks */
 
 	if ((dir = opendir(DEVPATH_COOKED)) == NULL) {
-		up_warn("failed to list %s: %s",
+		up_warn(ctx, "failed to list %s: %s",
 		    DEVPATH_COOKED, strerror(errno));
 		return (-1);
 	}
@@ -112,13 +112,6 @@ int
 os_opendisk_solaris(const char *name, int flags, char *buf, size_t buflen,
     int *ret)
 {
-	static char mybuf[MAXPATHLEN];
-
-	if (NULL == buf) {
-		buf = mybuf;
-		buflen = sizeof(mybuf);
-	}
-
 	if (strlcpy(buf, name, buflen) >= buflen)
 		goto trunc;
 	if ((*ret = open(name, flags)) >= 0)
@@ -158,7 +151,8 @@ OS_GENERATE_OPENDISK_STUB(os_opendisk_solaris)
 #if defined(HAVE_SYS_DKIO_H) && \
     (defined(DKIOCGGEOM) || defined(DKIOCGMEDIAINFO))
 int
-os_getparams_solaris(int fd, struct disk_params *params, const char *name)
+os_getparams_solaris(struct up_ctx *ctx, int fd, struct disk_params *params,
+    const char *name)
 {
 #ifdef DKIOCGGEOM
 	struct dk_geom geom;
@@ -21,9 +21,13 @@
 #ifdef HAVE_SYS_PARAM_H
 #include <sys/param.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#include <sys/time.h>
 #include <assert.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
@@ -34,10 +38,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
+#include "bsdqueue.h"
 #include "disk.h"
 #include "os.h"
 #include "os-private.h"
@@ -52,6 +61,89 @@
 #endif
 
 #define DEVPREFIX		"/dev/"
+/* buffers for reads on helper threads are aligned for direct i/o */
+#define DEADLINE_ALIGN		(4096)
+
+/* wait for deadlines on a clock that can't be stepped, if possible */
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+#define READER_MONOTONIC
+#endif
+
+#ifdef HAVE_PTHREAD_H
+/*
+  A helper thread for os_dev_read_deadline(), kept on the idle list
+  between reads and stopped when the device it reads is closed.
+*/
+struct os_reader {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled for new reads and finished ones */
+#ifdef READER_MONOTONIC
+	clockid_t clock;	/* clock cond waits on */
+#endif
+	int srcfd;		/* descriptor this reader was made for */
+	int fd;			/* duplicate owned by the reader */
+	void *mem;		/* buffer owned by the reader */
+	uint8_t *data;		/* aligned start of mem */
+	size_t memsize;		/* usable size of data */
+	size_t size;
+	int64_t off;
+	ssize_t res;
+	int err;
+	int busy;		/* a read was handed to the thread */
+	int done;		/* set by the thread when the read finishes */
+	int abandoned;		/* set if the caller stopped waiting */
+	int stopping;		/* set when the device is closed */
+	LIST_ENTRY(os_reader) link;
+};
+
+LIST_HEAD(os_reader_list, os_reader);
+
+static struct os_reader	*reader_get(int);
+static void		 reader_put(struct os_reader *);
+static int		 reader_grow(struct os_reader *, size_t);
+static void		*reader_thread(void *);
+static void		 reader_free(struct os_reader *);
+
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct os_reader_list readers = LIST_HEAD_INITIALIZER(readers);
+
+struct os_lock {
+	pthread_mutex_t mutex;
+};
+
+/* a group of jobs queued by one call to os_pool_run() */
+struct os_pool_batch {
+	int left;		/* jobs not yet finished */
+};
+
+struct os_pool_job {
+	os_job_func func;
+	void *arg;
+	struct os_pool_batch *batch;
+	SIMPLEQ_ENTRY(os_pool_job) link;
+};
+
+SIMPLEQ_HEAD(os_pool_queue, os_pool_job);
+
+struct os_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled for new jobs and done batches */
+	struct os_pool_queue queue;
+	pthread_t *threads;
+	int count;
+	int stopping;
+};
+
+static void	*pool_thread(void *);
+static int	 pool_runone(struct os_pool *);
+static void	 threaddata_init(void);
+
+static pthread_once_t threaddata_once = PTHREAD_ONCE_INIT;
+static pthread_key_t threaddata_key;
+static int threaddata_ok;
+#else
+static void *threaddata;
+#endif
 
 int
 os_opendisk_unix(const char *name, int flags, char *buf, size_t buflen,
@@ -82,12 +174,469 @@ os_dev_read(os_device_handle ehand, void *buf, size_t size, off_t off)
 	return (pread(OS_HANDLE_IN(ehand), buf, size, off));
 }
 
+/*
+  Read from a device but stop waiting after MSECS milliseconds. The
+  read is done on a helper thread into a buffer of its own, so if it
+  has to be abandoned the thread can finish or hang by itself without
+  scribbling over memory the caller has reused. Sets TIMEDOUT and
+  returns -1 if the deadline passed.
+*/
+ssize_t
+os_dev_read_deadline(os_device_handle ehand, void *buf, size_t size,
+    int64_t off, int64_t msecs, int *timedout)
+{
+#ifdef HAVE_PTHREAD_H
+	struct os_reader *reader;
+	struct timespec when;
+#ifndef READER_MONOTONIC
+	struct timeval now;
+#endif
+	ssize_t res;
+	int err;
+
+	*timedout = 0;
+	/* fall back to reading here if no thread can be started */
+	if ((reader = reader_get(OS_HANDLE_IN(ehand))) == NULL)
+		return (os_dev_read(ehand, buf, size, off));
+	if (reader_grow(reader, size) < 0) {
+		reader_put(reader);
+		return (-1);
+	}
+
+#ifdef READER_MONOTONIC
+	clock_gettime(reader->clock, &when);
+#else
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec;
+	when.tv_nsec = now.tv_usec * 1000;
+#endif
+	when.tv_sec += msecs / 1000;
+	when.tv_nsec += (msecs % 1000) * 1000000;
+	when.tv_sec += when.tv_nsec / 1000000000;
+	when.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&reader->lock);
+	reader->size = size;
+	reader->off = off;
+	reader->done = 0;
+	reader->busy = 1;
+	pthread_cond_broadcast(&reader->cond);
+	while (!reader->done &&
+	    pthread_cond_timedwait(&reader->cond, &reader->lock,
+		&when) != ETIMEDOUT)
+		;
+	if (!reader->done) {
+		/* the thread will free it once the read returns */
+		reader->abandoned = 1;
+		pthread_mutex_unlock(&reader->lock);
+		*timedout = 1;
+		errno = ETIMEDOUT;
+		return (-1);
+	}
+	res = reader->res;
+	err = reader->err;
+	if (res > 0)
+		memcpy(buf, reader->data, res);
+	pthread_mutex_unlock(&reader->lock);
+	reader_put(reader);
+	errno = err;
+
+	return (res);
+#else
+	*timedout = 0;
+	return (os_dev_read(ehand, buf, size, off));
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+  Take an idle reader for FD off the list, or start a new one if there
+  isn't one. Returns NULL if a thread couldn't be started.
+*/
+static struct os_reader *
+reader_get(int fd)
+{
+	struct os_reader *reader;
+#ifdef READER_MONOTONIC
+	pthread_condattr_t cattr;
+#endif
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	pthread_mutex_lock(&readers_lock);
+	LIST_FOREACH(reader, &readers, link)
+		if (reader->srcfd == fd)
+			break;
+	if (reader != NULL)
+		LIST_REMOVE(reader, link);
+	pthread_mutex_unlock(&readers_lock);
+	if (reader != NULL)
+		return (reader);
+
+	if ((reader = up_xalloc(1, sizeof(*reader), XA_ZERO)) == NULL)
+		return (NULL);
+	reader->srcfd = fd;
+	if ((reader->fd = dup(fd)) < 0) {
+		free(reader);
+		return (NULL);
+	}
+	pthread_mutex_init(&reader->lock, NULL);
+#ifdef READER_MONOTONIC
+	/* fall back to the wall clock if the monotonic one is refused */
+	reader->clock = CLOCK_MONOTONIC;
+	pthread_condattr_init(&cattr);
+	if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) != 0)
+		reader->clock = CLOCK_REALTIME;
+	pthread_cond_init(&reader->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+#else
+	pthread_cond_init(&reader->cond, NULL);
+#endif
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, reader_thread, reader);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		reader_free(reader);
+		return (NULL);
+	}
+
+	return (reader);
+}
+
+/* Put a reader back on the idle list once its read is done. */
+static void
+reader_put(struct os_reader *reader)
+{
+	pthread_mutex_lock(&readers_lock);
+	LIST_INSERT_HEAD(&readers, reader, link);
+	pthread_mutex_unlock(&readers_lock);
+}
+
+/* Make sure an idle reader's buffer holds at least SIZE bytes. */
+static int
+reader_grow(struct os_reader *reader, size_t size)
+{
+	void *mem;
+
+	if (reader->memsize >= size)
+		return (0);
+	if ((mem = up_xalloc(1, size + DEADLINE_ALIGN - 1, 0)) == NULL)
+		return (-1);
+	free(reader->mem);
+	reader->mem = mem;
+	reader->data = (uint8_t *)mem +
+	    (DEADLINE_ALIGN - (uintptr_t)mem % DEADLINE_ALIGN) %
+	    DEADLINE_ALIGN;
+	reader->memsize = size;
+
+	return (0);
+}
+
+static void *
+reader_thread(void *arg)
+{
+	struct os_reader *reader = arg;
+	ssize_t res;
+	int err;
+
+	pthread_mutex_lock(&reader->lock);
+	for (;;) {
+		while (!reader->busy && !reader->stopping)
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		if (reader->stopping)
+			break;
+
+		pthread_mutex_unlock(&reader->lock);
+		res = pread(reader->fd, reader->data, reader->size,
+		    reader->off);
+		err = errno;
+		pthread_mutex_lock(&reader->lock);
+
+		reader->res = res;
+		reader->err = err;
+		reader->busy = 0;
+		reader->done = 1;
+		if (reader->abandoned)
+			break;
+		pthread_cond_broadcast(&reader->cond);
+	}
+	pthread_mutex_unlock(&reader->lock);
+	reader_free(reader);
+
+	return (NULL);
+}
+
+static void
+reader_free(struct os_reader *reader)
+{
+	close(reader->fd);
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->lock);
+	free(reader->mem);
+	free(reader);
+}
+#endif
+
 int
 os_dev_close(os_device_handle ehand)
 {
+#ifdef HAVE_PTHREAD_H
+	struct os_reader_list stop;
+	struct os_reader *reader, *next;
+
+	/* stop the idle readers for the device, they free themselves */
+	LIST_INIT(&stop);
+	pthread_mutex_lock(&readers_lock);
+	for (reader = LIST_FIRST(&readers); reader != NULL; reader = next) {
+		next = LIST_NEXT(reader, link);
+		if (reader->srcfd == OS_HANDLE_IN(ehand)) {
+			LIST_REMOVE(reader, link);
+			LIST_INSERT_HEAD(&stop, reader, link);
+		}
+	}
+	pthread_mutex_unlock(&readers_lock);
+	while ((reader = LIST_FIRST(&stop)) != NULL) {
+		LIST_REMOVE(reader, link);
+		pthread_mutex_lock(&reader->lock);
+		reader->stopping = 1;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->lock);
+	}
+#endif
+
 	return (close(OS_HANDLE_IN(ehand)));
 }
 
+/* Return a clock in milliseconds for measuring intervals. */
+int64_t
+os_msecs(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+#endif
+	struct timeval tv;
+
+	/* the wall clock can be stepped, only use it if there's no other */
+#ifdef CLOCK_MONOTONIC
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+	gettimeofday(&tv, NULL);
+	return ((int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/* Allocate a mutex, returns NULL if threads aren't supported. */
+os_lock
+os_lock_new(void)
+{
+#ifdef HAVE_PTHREAD_H
+	struct os_lock *lock;
+
+	if ((lock = up_xalloc(1, sizeof(*lock), 0)) == NULL)
+		return (NULL);
+	if (pthread_mutex_init(&lock->mutex, NULL) != 0) {
+		free(lock);
+		return (NULL);
+	}
+	return (lock);
+#else
+	return (NULL);
+#endif
+}
+
+void
+os_lock_acquire(os_lock lock)
+{
+#ifdef HAVE_PTHREAD_H
+	if (lock != NULL)
+		pthread_mutex_lock(&lock->mutex);
+#endif
+}
+
+void
+os_lock_release(os_lock lock)
+{
+#ifdef HAVE_PTHREAD_H
+	if (lock != NULL)
+		pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
+void
+os_lock_free(os_lock lock)
+{
+#ifdef HAVE_PTHREAD_H
+	if (lock == NULL)
+		return;
+	pthread_mutex_destroy(&lock->mutex);
+	free(lock);
+#endif
+}
+
+/*
+  Start COUNT worker threads for os_pool_run(). Returns NULL if threads
+  aren't supported, and os_pool_run() will run jobs one at a time.
+*/
+os_pool
+os_pool_open(int count)
+{
+#ifdef HAVE_PTHREAD_H
+	struct os_pool *pool;
+
+	if (count < 1 || (pool = up_xalloc(1, sizeof(*pool), XA_ZERO)) == NULL)
+		return (NULL);
+	if ((pool->threads = up_xalloc(count, sizeof(pool->threads[0]),
+		    0)) == NULL) {
+		free(pool);
+		return (NULL);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	SIMPLEQ_INIT(&pool->queue);
+	for (pool->count = 0; pool->count < count; pool->count++)
+		if (pthread_create(&pool->threads[pool->count], NULL,
+			pool_thread, pool) != 0)
+			break;
+	if (pool->count == 0) {
+		os_pool_close(pool);
+		return (NULL);
+	}
+	return (pool);
+#else
+	return (NULL);
+#endif
+}
+
+/*
+  Call FUNC on each of COUNT items of SIZE bytes in ARGS and wait for
+  all the calls to return. The calling thread runs queued jobs itself
+  while waiting, so jobs may call this again without deadlocking.
+*/
+void
+os_pool_run(os_pool pool, os_job_func func, void *args, size_t size,
+    int count)
+{
+#ifdef HAVE_PTHREAD_H
+	struct os_pool_batch batch;
+	struct os_pool_job *jobs;
+	int i;
+
+	if (pool != NULL && count > 1 &&
+	    (jobs = up_xalloc(count, sizeof(*jobs), 0)) != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		batch.left = count;
+		for (i = 0; i < count; i++) {
+			jobs[i].func = func;
+			jobs[i].arg = (uint8_t *)args + i * size;
+			jobs[i].batch = &batch;
+			SIMPLEQ_INSERT_TAIL(&pool->queue, &jobs[i], link);
+		}
+		pthread_cond_broadcast(&pool->cond);
+		while (batch.left > 0)
+			if (!pool_runone(pool))
+				pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		free(jobs);
+		return;
+	}
+#endif
+
+	for (; count > 0; count--, args = (uint8_t *)args + size)
+		func(args);
+}
+
+void
+os_pool_close(os_pool pool)
+{
+#ifdef HAVE_PTHREAD_H
+	int i;
+
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->count; i++)
+		pthread_join(pool->threads[i], NULL);
+	assert(SIMPLEQ_EMPTY(&pool->queue));
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+pool_thread(void *arg)
+{
+	struct os_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stopping)
+		if (!pool_runone(pool))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return (NULL);
+}
+
+/*
+  Run the next queued job, if any, with the pool lock held on entry
+  and exit but not while the job runs. Returns 0 if nothing was queued.
+*/
+static int
+pool_runone(struct os_pool *pool)
+{
+	struct os_pool_job *job;
+
+	if ((job = SIMPLEQ_FIRST(&pool->queue)) == NULL)
+		return (0);
+	SIMPLEQ_REMOVE_HEAD(&pool->queue, link);
+	pthread_mutex_unlock(&pool->lock);
+	job->func(job->arg);
+	pthread_mutex_lock(&pool->lock);
+	if (--job->batch->left == 0)
+		pthread_cond_broadcast(&pool->cond);
+
+	return (1);
+}
+
+static void
+threaddata_init(void)
+{
+	threaddata_ok = (pthread_key_create(&threaddata_key, NULL) == 0);
+}
+#endif
+
+/* Return the pointer set by os_thread_setdata() on this thread. */
+void *
+os_thread_data(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_once(&threaddata_once, threaddata_init);
+	return (threaddata_ok ? pthread_getspecific(threaddata_key) : NULL);
+#else
+	return (threaddata);
+#endif
+}
+
+void
+os_thread_setdata(void *data)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_once(&threaddata_once, threaddata_init);
+	if (threaddata_ok)
+		pthread_setspecific(threaddata_key, data);
+#else
+	threaddata = data;
+#endif
+}
+
 int64_t
 os_file_size(FILE *file)
 {
@@ -98,6 +647,73 @@ os_file_size(FILE *file)
 	return (sb.st_size);
 }
 
+ssize_t
+os_file_read(FILE *file, void *buf, size_t size, int64_t off)
+{
+	return (pread(fileno(file), buf, size, off));
+}
+
+/* Map SIZE bytes of a file read-only, returns NULL if it can't be. */
+const void *
+os_file_map(FILE *file, int64_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	void *ret;
+
+	if (size <= 0 || (uint64_t)size > SIZE_MAX)
+		return (NULL);
+	ret = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(file), 0);
+	if (ret == MAP_FAILED)
+		return (NULL);
+	return (ret);
+#else
+	return (NULL);
+#endif
+}
+
+void
+os_file_unmap(const void *addr, int64_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	munmap((void *)addr, size);
+#endif
+}
+
+/*
+  Call FUNC with the byte offset and length of each range of the first
+  SIZE bytes of a file which has data allocated, skipping holes. Stops
+  and returns -1 if FUNC does, or if holes can't be found at all.
+*/
+int
+os_file_extents(FILE *file, int64_t size,
+    int (*func)(int64_t, int64_t, void *), void *arg)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t data, hole;
+	int fd;
+
+	fd = fileno(file);
+	for (hole = 0; hole < size; ) {
+		if ((data = lseek(fd, hole, SEEK_DATA)) < 0) {
+			/* ENXIO means there's no more data */
+			if (errno == ENXIO)
+				break;
+			return (-1);
+		}
+		if (data >= size)
+			break;
+		if ((hole = lseek(fd, data, SEEK_HOLE)) < 0)
+			return (-1);
+		if (func(data, MIN(hole, size) - data, arg) < 0)
+			return (-1);
+	}
+
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
 int
 os_handle_type(os_device_handle ehand, enum disk_type *type)
 {
@@ -128,6 +744,11 @@ os_open_flags(const char *str)
 		case 'r':
 			flags |= O_RDONLY;
 			break;
+		case 'd':
+#ifdef O_DIRECT
+			flags |= O_DIRECT;
+#endif
+			break;
 		default:
 			assert(!"bad format character");
 			break;
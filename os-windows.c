@@ -36,8 +36,17 @@
 #define DEV_NAME	"PhysicalDrive"
 #define DEV_PREFIX	"\\\\.\\"
 
+/* longest message os_errstr() will return */
+#define OS_ERRSTR_LEN	(256)
+
+#ifdef _MSC_VER
+#define OS_THREADLOCAL	__declspec(thread)
+#else
+#define OS_THREADLOCAL	__thread
+#endif
+
 int
-os_listdev_windows(os_list_callback_func func, void *arg)
+os_listdev_windows(struct up_ctx *ctx, os_list_callback_func func, void *arg)
 {
 	char *buf, *new;
 	size_t size;
@@ -115,7 +124,8 @@ os_opendisk_windows(const char *name, int flags, char *buf, size_t buflen,
 }
 
 int
-os_getparams_windows(HANDLE hdl, struct disk_params *params, const char *name)
+os_getparams_windows(struct up_ctx *ctx, HANDLE hdl, struct disk_params *params,
+    const char *name)
 {
 	DISK_GEOMETRY geom;
 	DWORD whoops;
@@ -149,6 +159,15 @@ os_dev_read(os_device_handle ehand, void *buf, size_t size, int64_t off)
 	return (res);
 }
 
+/* XXX could use overlapped i/o and CancelIoEx() here */
+ssize_t
+os_dev_read_deadline(os_device_handle ehand, void *buf, size_t size,
+    int64_t off, int64_t msecs, int *timedout)
+{
+	*timedout = 0;
+	return (os_dev_read(ehand, buf, size, off));
+}
+
 int
 os_dev_close(os_device_handle ehand)
 {
@@ -157,12 +176,107 @@ os_dev_close(os_device_handle ehand)
 	return (0);
 }
 
+/* Return a clock in milliseconds for measuring intervals. */
+int64_t
+os_msecs(void)
+{
+	return (GetTickCount64());
+}
+
+/* XXX could use critical sections and the thread pool API */
+os_lock
+os_lock_new(void)
+{
+	return (NULL);
+}
+
+void
+os_lock_acquire(os_lock lock)
+{
+}
+
+void
+os_lock_release(os_lock lock)
+{
+}
+
+void
+os_lock_free(os_lock lock)
+{
+}
+
+os_pool
+os_pool_open(int count)
+{
+	return (NULL);
+}
+
+void
+os_pool_run(os_pool pool, os_job_func func, void *args, size_t size,
+    int count)
+{
+	for (; count > 0; count--, args = (uint8_t *)args + size)
+		func(args);
+}
+
+void
+os_pool_close(os_pool pool)
+{
+}
+
+static OS_THREADLOCAL void *threaddata;
+
+void *
+os_thread_data(void)
+{
+	return (threaddata);
+}
+
+void
+os_thread_setdata(void *data)
+{
+	threaddata = data;
+}
+
 int64_t
 os_file_size(FILE *file)
 {
 	return (_filelengthi64(_fileno(file)));
 }
 
+ssize_t
+os_file_read(FILE *file, void *buf, size_t size, int64_t off)
+{
+	size_t res;
+
+	if (_fseeki64(file, off, SEEK_SET) != 0)
+		return (-1);
+	res = fread(buf, 1, size, file);
+	if (res == 0 && ferror(file))
+		return (-1);
+	return (res);
+}
+
+/* XXX could use CreateFileMapping() here */
+const void *
+os_file_map(FILE *file, int64_t size)
+{
+	return (NULL);
+}
+
+void
+os_file_unmap(const void *addr, int64_t size)
+{
+}
+
+/* XXX could use FSCTL_QUERY_ALLOCATED_RANGES here */
+int
+os_file_extents(FILE *file, int64_t size,
+    int (*func)(int64_t, int64_t, void *), void *arg)
+{
+	return (-1);
+}
+
 int
 os_handle_type(os_device_handle ehand, enum disk_type *type)
 {
@@ -186,6 +300,9 @@ os_open_flags(const char *str)
 		case 'r':
 			flags |= GENERIC_READ;
 			break;
+		case 'd':
+			/* XXX FILE_FLAG_NO_BUFFERING goes in another argument */
+			break;
 		default:
 			assert(!"bad format character");
 			break;
@@ -214,18 +331,15 @@ os_lasterrstr(void)
 	return (os_errstr(GetLastError()));
 }
 
+/* The string is kept per thread, so this is safe like strerror(). */
 const char *
 os_errstr(os_error num)
 {
-	static char *buf = NULL;
+	static OS_THREADLOCAL char buf[OS_ERRSTR_LEN];
 
-	if (buf != NULL)
-		LocalFree(buf);
-	buf = NULL;
-	if (FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-		FORMAT_MESSAGE_FROM_SYSTEM |
+	if (FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM |
 		FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL, (DWORD)num, 0, (char*)&buf, 0, NULL) == 0)
+		NULL, (DWORD)num, 0, buf, sizeof(buf), NULL) == 0)
 		return (NULL);
 	return (buf);
 }
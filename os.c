@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bsdqueue.h"
 #include "bsdtree.h"
 #include "disk.h"
 #include "os.h"
@@ -39,16 +40,36 @@ struct os_listdev_node {
 
 RB_HEAD(os_listdev_map, os_listdev_node);
 
+/* a read which was done synchronously, waiting to be reaped */
+struct os_aio_done {
+	void *cookie;
+	ssize_t res;
+	os_error err;
+	SIMPLEQ_ENTRY(os_aio_done) link;
+};
+
+SIMPLEQ_HEAD(os_aio_donelist, os_aio_done);
+
+struct os_aio {
+	os_device_handle dev;
+	int depth;
+	const struct os_aio_engine *engine;
+	void *priv;
+	int donecount;
+	struct os_aio_donelist done;
+};
+
 static int	sortdisk(struct os_listdev_node *, struct os_listdev_node *);
 static int	listdev_add(const char *, void *);
 static int	listdev_print(struct os_listdev_map *, FILE *);
-static int	listdev_print_details(struct os_listdev_map *, FILE *);
+static int	listdev_print_details(struct up_ctx *, struct os_listdev_map *,
+    FILE *);
 static void	listdev_free(struct os_listdev_map *);
 
 RB_GENERATE_STATIC(os_listdev_map, os_listdev_node, entry, sortdisk)
 
 int
-os_list_devices(FILE *stream)
+os_list_devices(struct up_ctx *ctx, FILE *stream)
 {
 	static os_list_func funcs[] = {
 		os_listdev_windows,
@@ -63,10 +84,10 @@ os_list_devices(FILE *stream)
 
 	RB_INIT(&map);
 	for (i = 0; i < NITEMS(funcs); i++) {
-		switch ((funcs[i])(listdev_add, &map)) {
+		switch ((funcs[i])(ctx, listdev_add, &map)) {
 		case -1:
-			if (UP_NOISY(QUIET))
-				up_err("failed to list devices: %s",
+			if (UP_NOISY(ctx, QUIET))
+				up_err(ctx, "failed to list devices: %s",
 				    os_lasterrstr());
 			break;
 		case 0:
@@ -83,22 +104,28 @@ os_list_devices(FILE *stream)
 
 done:
 	if (RB_EMPTY(&map)) {
-		if (UP_NOISY(QUIET))
-			up_err("don't know how to list devices "
+		if (UP_NOISY(ctx, QUIET))
+			up_err(ctx, "don't know how to list devices "
 			    "on this platform");
 		return (-1);
 	}
 	
-	if (UP_NOISY(EXTRA))
-		listdev_print_details(&map, stream);
+	if (UP_NOISY(ctx, EXTRA))
+		listdev_print_details(ctx, &map, stream);
 	else
 		listdev_print(&map, stream);
 	listdev_free(&map);
 	return (0);
 }
 
+/*
+  Open a device or find out that NAME is a plain file. If the device
+  was found under a different path then an allocated copy of it is
+  stored in PATH, which the caller must free.
+*/
 enum disk_type
-os_dev_open(const char *name, const char **path, os_device_handle *ret)
+os_dev_open(struct up_ctx *ctx, const char *name, char **path,
+    os_device_handle *ret)
 {
 	static os_open_func funcs[] = {
 		os_opendisk_windows,
@@ -108,7 +135,7 @@ os_dev_open(const char *name, const char **path, os_device_handle *ret)
 		os_opendisk_solaris,
 		os_opendisk_unix,
 	};
-	static char buf[MAXPATHLEN];
+	char buf[MAXPATHLEN];
 	enum disk_type type;
 	os_handle hand;
 	int i, flags;
@@ -116,9 +143,9 @@ os_dev_open(const char *name, const char **path, os_device_handle *ret)
 	assert(sizeof(os_device_handle) >= sizeof(os_handle));
 
 	*path = NULL;
-	flags = os_open_flags("r");
+	flags = os_open_flags(ctx->opts.directio ? "rd" : "r");
 
-	if (opts->plainfile)
+	if (ctx->opts.plainfile)
 		return (DT_FILE);
 
 	for (i = 0; i < NITEMS(funcs); i++) {
@@ -146,8 +173,11 @@ os_dev_open(const char *name, const char **path, os_device_handle *ret)
 			os_dev_close(OS_HANDLE_OUT(hand));
 			break;
 		case DT_DEVICE:
-			if (buf[0] != '\0')
-				*path = buf;
+			if (buf[0] != '\0' &&
+			    (*path = up_xstrdup(buf, 0)) == NULL) {
+				os_dev_close(OS_HANDLE_OUT(hand));
+				return (DT_UNKNOWN);
+			}
 			*ret = OS_HANDLE_OUT(hand);
 			break;
 		default:
@@ -162,7 +192,8 @@ os_dev_open(const char *name, const char **path, os_device_handle *ret)
 }
 
 int
-os_dev_params(os_device_handle ehand, struct disk_params *params, const char *name)
+os_dev_params(struct up_ctx *ctx, os_device_handle ehand,
+    struct disk_params *params, const char *name)
 {
 	static os_params_func funcs[] = {
 		os_getparams_windows,
@@ -185,7 +216,7 @@ os_dev_params(os_device_handle ehand, struct disk_params *params, const char *na
 	hand = OS_HANDLE_IN(ehand);
 
 	for (i = 0; i < NITEMS(funcs); i++) {
-		switch (funcs[i](hand, params, name)) {
+		switch (funcs[i](ctx, hand, params, name)) {
 		case -1:
 			return (-1);
 		case 0:
@@ -197,8 +228,8 @@ os_dev_params(os_device_handle ehand, struct disk_params *params, const char *na
 			break;
 		}
 	}
-	if (UP_NOISY(QUIET))
-		up_err("don't know how to get disk parameters "
+	if (UP_NOISY(ctx, QUIET))
+		up_err(ctx, "don't know how to get disk parameters "
 		    "on this platform");
 
 	return (-1);
@@ -237,6 +268,110 @@ os_dev_desc(os_device_handle ehand, char *buf, size_t size, const char *name)
 	return (0);
 }
 
+/*
+  Open an asynchronous read queue for a device, which can hold up to
+  DEPTH outstanding reads. If no asynchronous engine is available on
+  this platform then reads are done with os_dev_read() when submitted.
+*/
+os_aio
+os_aio_open(os_device_handle ehand, int depth)
+{
+	static os_aioopen_func funcs[] = {
+		os_aioopen_uring,
+	};
+	struct os_aio *aio;
+	int i;
+
+	assert(depth > 0);
+
+	if ((aio = up_xalloc(1, sizeof(*aio), XA_ZERO)) == NULL)
+		return (NULL);
+	aio->dev = ehand;
+	aio->depth = depth;
+	SIMPLEQ_INIT(&aio->done);
+
+	/* failing to set up an engine just means using the fallback */
+	for (i = 0; i < NITEMS(funcs); i++)
+		if (funcs[i](OS_HANDLE_IN(ehand), depth,
+			&aio->engine, &aio->priv) == 1)
+			break;
+	if (i == NITEMS(funcs)) {
+		aio->engine = NULL;
+		aio->priv = NULL;
+	}
+
+	return (aio);
+}
+
+/*
+  Queue a read of SIZE bytes at offset OFF into BUF. COOKIE is
+  returned by os_aio_wait() when the read completes. Returns 1 if the
+  read was queued, 0 if the queue is full, or -1 on error.
+*/
+int
+os_aio_submit(os_aio aio, void *buf, size_t size, int64_t off, void *cookie)
+{
+	struct os_aio_done *done;
+
+	if (aio->engine != NULL)
+		return (aio->engine->submit(aio->priv, buf, size, off, cookie));
+
+	if (aio->donecount >= aio->depth)
+		return (0);
+	if ((done = up_xalloc(1, sizeof(*done), 0)) == NULL)
+		return (-1);
+	done->cookie = cookie;
+	done->res = os_dev_read(aio->dev, buf, size, off);
+	done->err = (done->res < 0 ? os_lasterr() : 0);
+	SIMPLEQ_INSERT_TAIL(&aio->done, done, link);
+	aio->donecount++;
+
+	return (1);
+}
+
+/*
+  Wait for a queued read to complete and return its cookie and
+  result, with the error number set if the read failed. Returns 1 if a
+  read completed, 0 if there are none outstanding, or -1 on error.
+*/
+int
+os_aio_wait(os_aio aio, void **cookie, ssize_t *res)
+{
+	struct os_aio_done *done;
+
+	if (aio->engine != NULL)
+		return (aio->engine->wait(aio->priv, cookie, res));
+
+	if ((done = SIMPLEQ_FIRST(&aio->done)) == NULL)
+		return (0);
+	SIMPLEQ_REMOVE_HEAD(&aio->done, link);
+	aio->donecount--;
+	*cookie = done->cookie;
+	*res = done->res;
+	if (done->res < 0)
+		os_setlasterr(done->err);
+	free(done);
+
+	return (1);
+}
+
+/* Free the queue, all submitted reads must have been waited for. */
+void
+os_aio_close(os_aio aio)
+{
+	struct os_aio_done *done;
+
+	if (aio == NULL)
+		return;
+	if (aio->engine != NULL)
+		aio->engine->close(aio->priv);
+	while ((done = SIMPLEQ_FIRST(&aio->done)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&aio->done, link);
+		free(done);
+	}
+	free(aio);
+}
+
 static int
 sortdisk(struct os_listdev_node *a, struct os_listdev_node *b)
 {
@@ -253,9 +388,9 @@ listdev_add(const char *name, void *arg)
 	if (RB_FIND(os_listdev_map, map, &key) != NULL)
 		return (0);
 
-	if ((new = xalloc(1, sizeof(*new), 0)) == NULL)
+	if ((new = up_xalloc(1, sizeof(*new), 0)) == NULL)
 		return (-1);
-	if ((new->name = xstrdup(name, 0)) == NULL) {
+	if ((new->name = up_xstrdup(name, 0)) == NULL) {
 		free(new);
 		return (-1);
 	}
@@ -298,7 +433,8 @@ listdev_print(struct os_listdev_map *map, FILE *stream)
 }
 
 static int
-listdev_print_details(struct os_listdev_map *map, FILE *stream)
+listdev_print_details(struct up_ctx *ctx, struct os_listdev_map *map,
+    FILE *stream)
 {
 	struct os_listdev_node *node;
 	struct disk_params params;
@@ -306,7 +442,7 @@ listdev_print_details(struct os_listdev_map *map, FILE *stream)
 
 	RB_FOREACH(node, os_listdev_map, map) {
 		memset(&params, 0, sizeof(params));
-		disk = up_disk_open(node->name);
+		disk = up_disk_open(ctx, node->name);
 		if (disk == NULL || up_disk_setup(disk, &params) < 0)
 			fprintf(stream, "%s: error\n", node->name);
 		else {
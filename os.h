@@ -18,21 +18,48 @@
 #define HDR_UPART_OS
 
 struct disk_params;
+struct up_ctx;
 enum disk_type;
 
 typedef struct os_device_handle * os_device_handle;
+typedef struct os_aio * os_aio;
+typedef struct os_lock * os_lock;
+typedef struct os_pool * os_pool;
+typedef void (*os_job_func)(void *);
 typedef int os_error;
 
-int		 os_list_devices(FILE *);
-enum disk_type	 os_dev_open(const char *, const char **, os_device_handle *);
-int		 os_dev_params(os_device_handle, struct disk_params *,
-    const char *);
+int		 os_list_devices(struct up_ctx *, FILE *);
+enum disk_type	 os_dev_open(struct up_ctx *, const char *, char **,
+    os_device_handle *);
+int		 os_dev_params(struct up_ctx *, os_device_handle,
+    struct disk_params *, const char *);
 int		 os_dev_desc(os_device_handle, char *, size_t, const char *);
 ssize_t		 os_dev_read(os_device_handle, void *, size_t, int64_t);
+ssize_t		 os_dev_read_deadline(os_device_handle, void *, size_t,
+    int64_t, int64_t, int *);
 int		 os_dev_close(os_device_handle);
+os_aio		 os_aio_open(os_device_handle, int);
+int		 os_aio_submit(os_aio, void *, size_t, int64_t, void *);
+int		 os_aio_wait(os_aio, void **, ssize_t *);
+void		 os_aio_close(os_aio);
 int64_t		 os_file_size(FILE *);
+ssize_t		 os_file_read(FILE *, void *, size_t, int64_t);
+const void	*os_file_map(FILE *, int64_t);
+void		 os_file_unmap(const void *, int64_t);
+int		 os_file_extents(FILE *, int64_t,
+    int (*)(int64_t, int64_t, void *), void *);
 int		 os_handle_type(os_device_handle, enum disk_type *);
 int		 os_open_flags(const char *);
+int64_t		 os_msecs(void);
+os_lock		 os_lock_new(void);
+void		 os_lock_acquire(os_lock);
+void		 os_lock_release(os_lock);
+void		 os_lock_free(os_lock);
+os_pool		 os_pool_open(int);
+void		 os_pool_run(os_pool, os_job_func, void *, size_t, int);
+void		 os_pool_close(os_pool);
+void		*os_thread_data(void);
+void		 os_thread_setdata(void *);
 os_error	 os_lasterr(void);
 void		 os_setlasterr(os_error);
 const char	*os_lasterrstr(void);
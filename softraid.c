@@ -71,6 +71,7 @@
 #define SR_VERSION_MIN	(5)
 #define SR_VERSION_MAX	(6)
 #define SR_META_SIZE	(64)
+#define SR_LEVELLEN	(32) /* buffer size for sr_raidlevel_label() */
 
 #define SR_LEVEL_CRYPTO	('C')
 #define SR_LEVEL_CONCAT	('c')
@@ -126,7 +127,7 @@ struct up_sr
 	unsigned int	level;
 };
 
-struct {
+static const struct {
 	int id;
 	const char *name;
 } raidlevel_names[] = {
@@ -138,6 +139,8 @@ struct {
 };
 
 static int	sr_load(const struct disk *, const struct part *, void **);
+static void	sr_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	sr_setup(struct disk *, struct map *);
 static int	sr_info(const struct map *, FILE *);
 static int	sr_extrahdr(const struct map *, FILE *);
@@ -145,22 +148,31 @@ static int	sr_extra(const struct part *, FILE *);
 static int	sr_readmeta(const struct disk *, int64_t, int64_t,
     const uint8_t **, int *);
 static int	sr_checksum(const void *, const void *, const uint8_t *md5);
-static const char *sr_raidlevel_label(int);
+static const char *sr_raidlevel_label(int, char *, size_t);
+
+static const struct map_sig sr_sigs[] = {
+	{ SR_OFFSET, 0, "marcCRAM", 8, MAP_SIG_UNIT512 },
+	{ SR_OFFSET, 0, "MARCcram", 8, MAP_SIG_UNIT512 },
+	{ 0 }
+};
 
 void
-up_softraid_register(void)
+up_softraid_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = SR_LABEL;
+	funcs.name = "softraid";
 	funcs.load = sr_load;
+	funcs.footprint = sr_footprint;
+	funcs.sigs = sr_sigs;
 	funcs.setup = sr_setup;
 	funcs.print_header = sr_info;
 	funcs.print_extrahdr = sr_extrahdr;
 	funcs.print_extra = sr_extra;
 
-	up_map_register(UP_MAP_SOFTRAID, &funcs);
+	up_map_register(ctx, UP_MAP_SOFTRAID, &funcs);
 }
 
 static int
@@ -179,7 +191,7 @@ sr_load(const struct disk *disk, const struct part *parent, void **privret)
 		    parent->size - off, &buf, &endian)) <= 0)
 		return (ret);
 
-	if ((priv = xalloc(1, sizeof(*priv), XA_ZERO)) == NULL)
+	if ((priv = up_map_alloc(disk, sizeof(*priv))) == NULL)
 		return (-1);
 
 	memcpy(&priv->meta, buf, sizeof(priv->meta));
@@ -192,6 +204,14 @@ sr_load(const struct disk *disk, const struct part *parent, void **privret)
 	return (1);
 }
 
+static void
+sr_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	*head = SR_BLKTOSEC(disk, SR_OFFSET + SR_META_SIZE);
+	*tail = 0;
+}
+
 static int
 sr_setup(struct disk *disk, struct map *map)
 {
@@ -213,10 +233,10 @@ sr_setup(struct disk *disk, struct map *map)
 	/* verify the checksum */
 	if (!sr_checksum(meta, &meta->checksum,
 		    meta->checksum)) {
-		if (UP_NOISY(QUIET))
-			up_msg((opts->relaxed ? UP_MSG_FWARN : UP_MSG_FERR),
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, relaxed),
 			    "bad softraid metadata checksum");
-		if (!opts->relaxed)
+		if (!disk->ctx->opts.relaxed)
 			return (0);
 	}
 
@@ -236,21 +256,21 @@ sr_info(const struct map *map, FILE *stream)
 {
 	static const char hex[] = "0123456789abcdef";
 	struct up_sr *priv;
-	char buf[33];
+	char buf[33], level[SR_LEVELLEN];
 	int i;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = map->priv;
 
 	if (fprintf(stream, "%s at ", up_map_label(map)) < 0 ||
-	    printsect_verbose(UP_MAP_VIRTADDR(map) +
+	    up_printsect_verbose(map->disk, UP_MAP_VIRTADDR(map) +
 		SR_BLKTOSEC(map->disk, SR_OFFSET), stream) < 0 ||
 	    fprintf(stream, " of %s:\n", UP_DISK_PATH(map->disk)) < 0)
 		return (-1);
 
-	if (!UP_NOISY(EXTRA))
+	if (!UP_NOISY(map->disk->ctx, EXTRA))
 		return (1);
 
 	assert(sizeof(buf) > sizeof(priv->meta.vendor));
@@ -296,7 +316,7 @@ sr_info(const struct map *map, FILE *stream)
 		UP_ETOH32(priv->meta.chunk_id, priv->endian),
 		UP_ETOH32(priv->meta.opt_num, priv->endian),
 		UP_ETOH32(priv->meta.volid, priv->endian),
-		sr_raidlevel_label(priv->level),
+		sr_raidlevel_label(priv->level, level, sizeof(level)),
 		priv->level,
 		UP_ETOH64(priv->meta.size, priv->endian),
 		UP_ETOH32(priv->meta.strip_size, priv->endian),
@@ -312,7 +332,7 @@ sr_info(const struct map *map, FILE *stream)
 static int
 sr_extrahdr(const struct map *map, FILE *stream)
 {
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	return (fprintf(stream, " Level"));
@@ -322,13 +342,15 @@ static int
 sr_extra(const struct part *part, FILE *stream)
 {
 	struct up_sr *priv;
+	char level[SR_LEVELLEN];
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = part->map->priv;
 
-	return (fprintf(stream, " %s", sr_raidlevel_label(priv->level)));
+	return (fprintf(stream, " %s",
+		sr_raidlevel_label(priv->level, level, sizeof(level))));
 }
 
 static int
@@ -356,8 +378,9 @@ sr_readmeta(const struct disk *disk, int64_t start, int64_t size,
 
 	vers = UP_ETOH32(meta->vers, endian);
 	if (vers < SR_VERSION_MIN || vers > SR_VERSION_MAX) {
-		if (UP_NOISY(QUIET))
-			up_err("ignoring version %d %s in sector %"PRId64,
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx,
+			    "ignoring version %d %s in sector %"PRId64,
 			    vers, SR_LABEL, start);
 		return (0);
 	}
@@ -369,8 +392,9 @@ sr_readmeta(const struct disk *disk, int64_t start, int64_t size,
 	else
 		sectsize = UP_ETOH32(meta->secsize, endian);
 	if (sectsize != disk->params.sectsize) {
-		if (UP_NOISY(QUIET))
-			up_err("ignoring %d-byte sector %s in sector %"PRId64,
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_err(disk->ctx,
+			    "ignoring %d-byte sector %s in sector %"PRId64,
 			    sectsize, SR_LABEL, start);
 		return (0);
 	}
@@ -394,10 +418,10 @@ sr_checksum(const void *start, const void *end, const uint8_t *md5)
 	return (!memcmp(sum, md5, MD5_DIGEST_LENGTH));
 }
 
+/* return a name for a raid level, BUF is used if it isn't a known one */
 static const char *
-sr_raidlevel_label(int id)
+sr_raidlevel_label(int id, char *buf, size_t size)
 {
-	static char buf[32];
 	int i;
 
 	for (i = 0; raidlevel_names[i].id != -1; i++)
@@ -407,6 +431,6 @@ sr_raidlevel_label(int id)
 	if (id >= 32)
 		return ("Unknown");
 
-	snprintf(buf, sizeof(buf), "RAID-%u", id);
+	snprintf(buf, size, "RAID-%u", id);
 	return (buf);
 }
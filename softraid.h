@@ -17,7 +17,9 @@
 #ifndef HDR_UPART_SOFTRAID
 #define HDR_UPART_SOFTRAID
 
+struct up_ctx;
+
 /* register apple partition map type */
-void up_softraid_register(void);
+void up_softraid_register(struct up_ctx *);
 
 #endif /* HDR_UPART_SOFTRAID */
@@ -137,6 +137,8 @@ struct up_sparcpart
 
 static int	sparc_load(const struct disk *, const struct part *,
     void **priv);
+static void	sparc_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	sparc_setup(struct disk *, struct map *);
 static int	sparc_info(const struct map *, FILE *);
 static int	sparc_index(const struct part *, char *, size_t);
@@ -148,20 +150,30 @@ static unsigned int sparc_check_vtoc(const struct up_sparc_p *);
 static unsigned int sparc_check_obsd(const struct up_sparcobsd_p *);
 static uint32_t	sparc_obsd_cksum(const struct up_sparcobsd_p *, const void *);
 
-void up_sunlabel_sparc_register(void)
+/* the little endian magic is matched only to warn about it */
+static const struct map_sig sparc_sigs[] = {
+	{ 0, SPARC_MAGIC_OFF, "\xda\xbe", 2, 0 },
+	{ 0, SPARC_MAGIC_OFF, "\xbe\xda", 2, 0 },
+	{ 0 }
+};
+
+void up_sunlabel_sparc_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = SPARC_LABEL;
+	funcs.name = "sparc";
 	funcs.load = sparc_load;
+	funcs.footprint = sparc_footprint;
+	funcs.sigs = sparc_sigs;
 	funcs.setup = sparc_setup;
 	funcs.print_header = sparc_info;
 	funcs.get_index = sparc_index;
 	funcs.print_extrahdr = sparc_extrahdr;
 	funcs.print_extra = sparc_extra;
 
-	up_map_register(UP_MAP_SUN_SPARC, &funcs);
+	up_map_register(ctx, UP_MAP_SUN_SPARC, &funcs);
 }
 
 static int
@@ -186,7 +198,7 @@ sparc_load(const struct disk *disk, const struct part *parent, void **priv)
 		return (res);
 
 	/* allocate map struct */
-	if ((label = xalloc(1, sizeof *label, XA_ZERO)) == NULL)
+	if ((label = up_map_alloc(disk, sizeof(*label))) == NULL)
 		return (-1);
 	memcpy(&label->packed, buf, sizeof label->packed);
 	label->ext = sparc_check_obsd(&label->packed.ext.obsd);
@@ -198,6 +210,14 @@ sparc_load(const struct disk *disk, const struct part *parent, void **priv)
 	return (1);
 }
 
+static void
+sparc_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	*head = 1;
+	*tail = 0;
+}
+
 static int
 sparc_setup(struct disk *disk, struct map *map)
 {
@@ -215,7 +235,7 @@ sparc_setup(struct disk *disk, struct map *map)
 	max = (SPARC_ISEXT(priv->ext, OBSD) ? OBSD_MAXPART : SPARC_MAXPART);
 
 	for (i = 0; max > i; i++) {
-		if ((part = xalloc(1, sizeof *part, XA_ZERO)) == NULL)
+		if ((part = up_map_alloc(disk, sizeof(*part))) == NULL)
 			return (-1);
 
 		part->part = (SPARC_MAXPART > i ? packed->parts[i] :
@@ -226,10 +246,8 @@ sparc_setup(struct disk *disk, struct map *map)
 		size = UP_BETOH32(part->part.size);
 		flags = 0;
 
-		if (!up_map_add(map, start, size, flags, part)) {
-			free(part);
+		if (!up_map_add(map, start, size, flags, part))
 			return (-1);
-		}
 	}
 
 	return (1);
@@ -246,7 +264,7 @@ sparc_info(const struct map *map, FILE *stream)
 	const char *extstr;
 	int i;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = map->priv;
@@ -262,11 +280,11 @@ sparc_info(const struct map *map, FILE *stream)
 		extstr = "";
 
 	if (fprintf(stream, "%s%s at ", up_map_label(map), extstr) < 0 ||
-	    printsect_verbose(UP_MAP_VIRTADDR(map), stream) < 0 ||
+	    up_printsect_verbose(map->disk, UP_MAP_VIRTADDR(map), stream) < 0 ||
 	    fprintf(stream, " of %s:\n", UP_DISK_PATH(map->disk)) < 0)
 		return (-1);
 
-	if (!UP_NOISY(EXTRA))
+	if (!UP_NOISY(map->disk->ctx, EXTRA))
 		return (1);
 
 	if (fprintf(stream,
@@ -345,14 +363,14 @@ sparc_extrahdr(const struct map *map, FILE *stream)
 	struct up_sparc *priv;
 	const char *hdr;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = map->priv;
 	if (SPARC_ISEXT(priv->ext, VTOC))
 		hdr = UP_SUNLABEL_FMT_HDR;
 	else if (SPARC_ISEXT(priv->ext, OBSD_TYPES))
-		hdr = UP_BSDLABEL_FMT_HDR();
+		hdr = UP_BSDLABEL_FMT_HDR(map->disk->ctx);
 	else
 		hdr = NULL;
 
@@ -369,7 +387,7 @@ sparc_extra(const struct part *part, FILE *stream)
 	struct up_sparcobsd_p *obsd;
 	struct up_sparcpart *priv;
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (0);
 
 	label = part->map->priv;
@@ -377,7 +395,8 @@ sparc_extra(const struct part *part, FILE *stream)
 	obsd = &label->packed.ext.obsd;
 	priv = part->priv;
 
-	if (SPARC_ISEXT(label->ext, VTOC) && UP_NOISY(NORMAL))
+	if (SPARC_ISEXT(label->ext, VTOC) &&
+	    UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (up_sunlabel_fmt(stream,
 			UP_BETOH16(vtoc->parts[priv->index].tag),
 			UP_BETOH16(vtoc->parts[priv->index].flag)));
@@ -418,9 +437,9 @@ sparc_read(const struct disk *disk, int64_t start, int64_t size,
     if(SPARC_MAGIC != UP_BETOH16(magic))
     {
         if(SPARC_MAGIC == UP_LETOH16(magic) &&
-           UP_NOISY(QUIET))
+           UP_NOISY(disk->ctx, QUIET))
             /* this is kind of silly but hey, why not? */
-            up_err("%s in sector %"PRId64" with unknown "
+            up_err(disk->ctx, "%s in sector %"PRId64" with unknown "
                    "byte order: little endian", SPARC_LABEL, start);
         return 0;
     }
@@ -433,11 +452,11 @@ sparc_read(const struct disk *disk, int64_t start, int64_t size,
 
     if(calc != sum)
     {
-        if(UP_NOISY(QUIET))
-            up_msg((opts->relaxed ? UP_MSG_FWARN : UP_MSG_FERR),
+        if(UP_NOISY(disk->ctx, QUIET))
+            up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, relaxed),
                    "%s in sector %"PRId64" with bad checksum",
                    SPARC_LABEL, start);
-        if(!opts->relaxed)
+        if(!disk->ctx->opts.relaxed)
             return 0;
     }
 
@@ -17,7 +17,9 @@
 #ifndef HDR_UPART_SUNLABEL_SPARC
 #define HDR_UPART_SUNLABEL_SPARC
 
+struct up_ctx;
+
 /* register sparc disklabel type */
-void up_sunlabel_sparc_register(void);
+void up_sunlabel_sparc_register(struct up_ctx *);
 
 #endif /* HDR_UPART_SUNLABEL_SPARC */
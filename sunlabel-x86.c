@@ -95,6 +95,8 @@ struct up_sunx86part
 
 static int	sun_x86_load(const struct disk *, const struct part *,
     void **priv);
+static void	sun_x86_footprint(const struct disk *, int64_t, int64_t *,
+    int64_t *);
 static int	sun_x86_setup(struct disk *, struct map *);
 static int	sun_x86_info(const struct map *, FILE *);
 static int	sun_x86_index(const struct part *, char *, size_t);
@@ -103,20 +105,30 @@ static int	sun_x86_extra(const struct part *, FILE *);
 static int	sun_x86_read(const struct disk *, int64_t, int64_t,
     const uint8_t **);
 
-void up_sunlabel_x86_register(void)
+/* the big endian magic is matched only to warn about it */
+static const struct map_sig sun_x86_sigs[] = {
+	{ SUNX86_OFF, SUNX86_MAGIC1_OFF, "\xee\xde\x0d\x60", 4, 0 },
+	{ SUNX86_OFF, SUNX86_MAGIC1_OFF, "\x60\x0d\xde\xee", 4, 0 },
+	{ 0 }
+};
+
+void up_sunlabel_x86_register(struct up_ctx *ctx)
 {
 	struct map_funcs funcs;
 
 	up_map_funcs_init(&funcs);
 	funcs.label = SUNX86_LABEL;
+	funcs.name = "sunx86";
 	funcs.load = sun_x86_load;
+	funcs.footprint = sun_x86_footprint;
+	funcs.sigs = sun_x86_sigs;
 	funcs.setup = sun_x86_setup;
 	funcs.print_header = sun_x86_info;
 	funcs.get_index = sun_x86_index;
 	funcs.print_extrahdr = sun_x86_extrahdr;
 	funcs.print_extra = sun_x86_extra;
 
-	up_map_register(UP_MAP_SUN_X86, &funcs);
+	up_map_register(ctx, UP_MAP_SUN_X86, &funcs);
 }
 
 static int
@@ -138,7 +150,7 @@ sun_x86_load(const struct disk *disk, const struct part *parent, void **priv)
 		return (res);
 
 	/* allocate map struct */
-	if ((label = xalloc(1, sizeof *label, XA_ZERO)) == NULL)
+	if ((label = up_map_alloc(disk, sizeof(*label))) == NULL)
 		return (-1);
 	memcpy(&label->packed, buf, sizeof label->packed);
 
@@ -147,6 +159,14 @@ sun_x86_load(const struct disk *disk, const struct part *parent, void **priv)
 	return (1);
 }
 
+static void
+sun_x86_footprint(const struct disk *disk, int64_t size, int64_t *head,
+    int64_t *tail)
+{
+	*head = SUNX86_OFF + 1;
+	*tail = 0;
+}
+
 static int
 sun_x86_setup(struct disk *disk, struct map *map)
 {
@@ -162,15 +182,16 @@ sun_x86_setup(struct disk *disk, struct map *map)
 	max = UP_LETOH16(packed->partcount);
 	/* this probably isn't worth checking for */
 	if (SUNX86_MAXPARTITIONS < max) {
-		if (UP_NOISY(QUIET))
-			up_warn("clamping partition count in %s from %d "
+		if (UP_NOISY(disk->ctx, QUIET))
+			up_warn(disk->ctx,
+			    "clamping partition count in %s from %d "
 			    "down to %d", up_map_label(map), max,
 			    SUNX86_MAXPARTITIONS);
 		max = SUNX86_MAXPARTITIONS;
 	}
 
 	for (i = 0; i < max; i++) {
-		if ((part = xalloc(1, sizeof *part, XA_ZERO)) == NULL)
+		if ((part = up_map_alloc(disk, sizeof(*part))) == NULL)
 			return (-1);
 
 		memcpy(&part->part, &packed->parts[i], sizeof part->part);
@@ -179,10 +200,8 @@ sun_x86_setup(struct disk *disk, struct map *map)
 		size = UP_LETOH32(part->part.size);
 		flags = 0;
 
-		if (!up_map_add(map, start, size, flags, part)) {
-			free(part);
+		if (!up_map_add(map, start, size, flags, part))
 			return (-1);
-		}
 	}
 
 	return (1);
@@ -195,19 +214,19 @@ sun_x86_info(const struct map *map, FILE *stream)
 	const struct up_sunx86_p *packed;
 	char name[sizeof(packed->name)+1];
 
-	if (!UP_NOISY(NORMAL))
+	if (!UP_NOISY(map->disk->ctx, NORMAL))
 		return (0);
 
 	priv = map->priv;
 	packed = &priv->packed;
 
 	if (fprintf(stream, "%s at ", up_map_label(map)) < 0 ||
-	    printsect_verbose(UP_MAP_VIRTADDR(map), stream) < 0 ||
+	    up_printsect_verbose(map->disk, UP_MAP_VIRTADDR(map), stream) < 0 ||
 	    fprintf(stream, " (offset %d) of %s:\n",
 		SUNX86_OFF, UP_DISK_PATH(map->disk)) < 0)
 		return (-1);
 
-	if (!UP_NOISY(EXTRA))
+	if (!UP_NOISY(map->disk->ctx, EXTRA))
 		return (1);
 
         memcpy(name, packed->name, sizeof(packed->name));
@@ -259,7 +278,7 @@ sun_x86_index(const struct part *part, char *buf, size_t size)
 static int
 sun_x86_extrahdr(const struct map *map, FILE *stream)
 {
-	if (UP_NOISY(NORMAL))
+	if (UP_NOISY(map->disk->ctx, NORMAL))
 		return (fprintf(stream, " %s", UP_SUNLABEL_FMT_HDR));
 	else
 		return (0);
@@ -272,7 +291,7 @@ sun_x86_extra(const struct part *part, FILE *stream)
 
 	priv = part->priv;
 
-	if (UP_NOISY(NORMAL))
+	if (UP_NOISY(part->map->disk->ctx, NORMAL))
 		return (up_sunlabel_fmt(stream,
 			UP_LETOH16(priv->part.type),
 			UP_LETOH16(priv->part.flags)));
@@ -306,8 +325,8 @@ sun_x86_read(const struct disk *disk, int64_t start, int64_t size,
     if(SUNX86_MAGIC1 != UP_LETOH32(magic1))
     {
         if(SUNX86_MAGIC1 == UP_BETOH32(magic1) &&
-           UP_NOISY(QUIET))
-            up_err("%s in sector %"PRId64" (offset %d) "
+           UP_NOISY(disk->ctx, QUIET))
+            up_err(disk->ctx, "%s in sector %"PRId64" (offset %d) "
                    "with unknown byte order: big endian",
                    SUNX86_LABEL, start, SUNX86_OFF);
         return 0;
@@ -315,8 +334,8 @@ sun_x86_read(const struct disk *disk, int64_t start, int64_t size,
 
     if(SUNX86_VERSION != UP_LETOH32(vers))
     {
-        if(UP_NOISY(QUIET))
-            up_err("%s in sector %"PRId64" (offset %d) "
+        if(UP_NOISY(disk->ctx, QUIET))
+            up_err(disk->ctx, "%s in sector %"PRId64" (offset %d) "
                    "with unknown version: %u",
                    SUNX86_LABEL, start, SUNX86_OFF, UP_LETOH32(vers));
         return 0;
@@ -324,8 +343,8 @@ sun_x86_read(const struct disk *disk, int64_t start, int64_t size,
 
     if(SUNX86_MAGIC2 != UP_LETOH16(magic2))
     {
-        if(UP_NOISY(QUIET))
-            up_err("%s in sector %"PRId64" (offset %d) "
+        if(UP_NOISY(disk->ctx, QUIET))
+            up_err(disk->ctx, "%s in sector %"PRId64" (offset %d) "
                    "with bad secondary magic number: 0x%04x",
                    SUNX86_LABEL, start, SUNX86_OFF, UP_LETOH16(magic2));
         return 0;
@@ -339,12 +358,12 @@ sun_x86_read(const struct disk *disk, int64_t start, int64_t size,
 
     if(calc != sum)
     {
-        if(UP_NOISY(QUIET))
-            up_msg((opts->relaxed ? UP_MSG_FWARN : UP_MSG_FERR),
+        if(UP_NOISY(disk->ctx, QUIET))
+            up_msg(disk->ctx, UP_MSG_FOPTWARN(disk->ctx, relaxed),
                    "%s in sector %"PRId64" (offset %d) "
                    "with bad checksum",
                    SUNX86_LABEL, start, SUNX86_OFF);
-        if(!opts->relaxed)
+        if(!disk->ctx->opts.relaxed)
             return 0;
     }
 
@@ -17,7 +17,9 @@
 #ifndef HDR_UPART_SUNLABEL_X86
 #define HDR_UPART_SUNLABEL_X86
 
+struct up_ctx;
+
 /* register Sun x86 disk label map type */
-void up_sunlabel_x86_register(void);
+void up_sunlabel_x86_register(struct up_ctx *);
 
 #endif /* HDR_UPART_SUNLABEL_X86 */
@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2026 Joshua R. Elsasser.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  Run upart against real devices and report how many bytes the kernel
+  actually transferred for each run, as counted in the block input
+  field of getrusage(). Each run starts with the device's pages
+  dropped from the buffer cache, so buffered reads pay for readahead.
+
+  With -e it also generates a sparse file containing a chain of
+  extended MBRs with the given number of logical partitions and times
+  reading it and writing it out as an image, which mostly exercises
+  the bookkeeping for saved sectors rather than I/O. It then saves the
+  image to a file and times reading that, which has a separate group
+  of sectors for every extended MBR.
+
+  With -g it generates a sparse file with a GPT of the given number of
+  partitions, times reading it, then loads it with libupart and times
+  walking every partition with up_map_first() and up_map_next(), which
+  only measures the layout of the map tree in memory.
+
+  This needs a unix-like system and usually root, it isn't part of
+  the regression tests.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* XXX dependencies from this file are hardcoded in build.mk */
+#include "crc32.h"
+#include "upart.h"
+
+#define UPART_PATH	"./upart"
+/* getrusage() block counts are in 512 byte units */
+#define RUSAGE_BLOCK	(512)
+/* used to build the generated extended partition chain */
+#define SECTSIZE	(512)
+#define MBR_PART_OFF	(446)
+#define MBR_PART_SIZE	(16)
+#define MBR_TYPE_OFF	(4)
+#define MBR_START_OFF	(8)
+#define MBR_SIZE_OFF	(12)
+#define MBR_ID_EXTDOS	(0x05)
+#define MBR_ID_LINUX	(0x83)
+#define GPT_HDR_SIZE	(92)
+#define GPT_PART_SIZE	(128)
+#define GPT_MAGIC	UINT64_C(0x5452415020494645)
+#define GPT_REVISION	(0x10000)
+/* linux filesystem data, as it's stored on disk */
+#define GPT_TYPE_LINUX \
+	"\xaf\x3d\xc6\x0f\x83\x84\x72\x47\x8e\x79\x3d\x69\xd8\x47\x7d\xe4"
+/* times to walk the partitions in a loaded map */
+#define WALK_PASSES	(1000)
+/* maximum number of options passed to upart for a mode */
+#define MODE_MAXARGS	(4)
+
+struct mode {
+	const char *name;
+	const char *args[MODE_MAXARGS];
+};
+
+static const struct mode devmodes[] = {
+	{ "buffered",	{ "-q" } },
+	{ "direct",	{ "-qd" } },
+};
+
+static const struct mode filemodes[] = {
+	{ "read",	{ "-qf" } },
+	{ "image",	{ "-qf", "-w", "/dev/null" } },
+};
+
+static const struct mode imgmodes[] = {
+	{ "imgread",	{ "-q" } },
+};
+
+void	 benchone(const char *, const char *, const struct mode *, int, int);
+void	 mkebrchain(char *, long);
+void	 setpart(uint8_t *, int, int, uint32_t, uint32_t);
+void	 mkgpt(char *, long);
+void	 putle(uint8_t *, uint64_t, int);
+void	 benchwalk(const char *, int);
+int64_t	 walkmaps(const struct part *);
+void	 dropcache(const char *);
+int	 runone(const char *, const char * const *, const char *,
+    int64_t *, double *);
+void	 fail(const char *, ...) ATTR_PRINTF(1, 2);
+
+char *myname;
+volatile int64_t walksink;
+
+int
+main(int argc, char *argv[])
+{
+	char genpath[] = "/tmp/upart-bench.XXXXXX";
+	char gptpath[] = "/tmp/upart-bench.XXXXXX";
+	char imgpath[] = "/tmp/upart-bench.XXXXXX";
+	const char *saveargs[MODE_MAXARGS] = { "-qf", "-w" };
+	int64_t bytes;
+	double ms;
+	int fd;
+	const char *upart;
+	long ebrs, gptparts;
+	int opt, runs, i;
+
+	myname = argv[0];
+	upart = UPART_PATH;
+	runs = 3;
+	ebrs = 0;
+	gptparts = 0;
+	while ((opt = getopt(argc, argv, "e:g:n:u:")) != -1) {
+		switch (opt) {
+		case 'e':
+			ebrs = strtol(optarg, NULL, 0);
+			if (ebrs <= 0 || ebrs > INT32_MAX / 2 - 1)
+				fail("illegal partition count: %s", optarg);
+			break;
+		case 'g':
+			gptparts = strtol(optarg, NULL, 0);
+			if (gptparts <= 0 || gptparts > INT32_MAX / 4)
+				fail("illegal partition count: %s", optarg);
+			break;
+		case 'n':
+			runs = strtol(optarg, NULL, 0);
+			if (runs <= 0)
+				fail("illegal run count: %s", optarg);
+			break;
+		case 'u':
+			upart = optarg;
+			break;
+		default:
+			printf("usage: %s [-e count] [-g count] [-n runs] "
+			    "[-u upart] device...\n"
+			    "  -e count  also run on a generated chain of "
+			    "count logical partitions\n"
+			    "  -g count  also run on a generated gpt with "
+			    "count partitions\n"
+			    "  -n runs   number of runs to average (3)\n"
+			    "  -u upart  path to upart binary (%s)\n",
+			    myname, UPART_PATH);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc && ebrs == 0 && gptparts == 0)
+		fail("no devices given");
+
+	printf("%-24s %-10s %14s %10s\n", "device", "mode", "bytes read",
+	    "ms");
+	for (i = optind; i < argc; i++)
+		benchone(upart, argv[i], devmodes, NITEMS(devmodes), runs);
+	if (ebrs > 0) {
+		mkebrchain(genpath, ebrs);
+		benchone(upart, genpath, filemodes, NITEMS(filemodes), runs);
+		if ((fd = mkstemp(imgpath)) == -1)
+			fail("failed to create %s: %s", imgpath,
+			    strerror(errno));
+		close(fd);
+		saveargs[2] = imgpath;
+		if (runone(upart, saveargs, genpath, &bytes, &ms) != 0)
+			fail("%s -w %s %s failed", upart, imgpath, genpath);
+		benchone(upart, imgpath, imgmodes, NITEMS(imgmodes), runs);
+		unlink(imgpath);
+		unlink(genpath);
+	}
+	if (gptparts > 0) {
+		mkgpt(gptpath, gptparts);
+		benchone(upart, gptpath, filemodes, 1, runs);
+		benchwalk(gptpath, runs);
+		unlink(gptpath);
+	}
+
+	return (0);
+}
+
+/* Run upart on PATH RUNS times in each of MODES and print averages. */
+void
+benchone(const char *upart, const char *path, const struct mode *modes,
+    int nmodes, int runs)
+{
+	int64_t bytes, total;
+	double ms, totalms;
+	int m, r;
+
+	for (m = 0; m < nmodes; m++) {
+		total = 0;
+		totalms = 0;
+		for (r = 0; r < runs; r++) {
+			dropcache(path);
+			if (runone(upart, modes[m].args, path,
+				&bytes, &ms) != 0)
+				fail("%s %s %s failed", upart,
+				    modes[m].args[0], path);
+			total += bytes;
+			totalms += ms;
+		}
+		printf("%-24s %-10s %14"PRId64" %10.3f\n", path,
+		    modes[m].name, total / runs, totalms / runs);
+	}
+}
+
+/*
+  Create a sparse file at TEMPLATE, replacing its trailing Xs, with an
+  MBR holding one extended partition which contains COUNT logical
+  partitions. Each extended MBR is followed by its one-sector logical
+  partition.
+*/
+void
+mkebrchain(char *template, long count)
+{
+	uint8_t sect[SECTSIZE];
+	uint32_t extsize;
+	long i;
+	int fd;
+
+	if ((fd = mkstemp(template)) == -1)
+		fail("failed to create %s: %s", template, strerror(errno));
+	extsize = count * 2;
+
+	memset(sect, 0, sizeof(sect));
+	setpart(sect, 0, MBR_ID_EXTDOS, 1, extsize);
+	if (pwrite(fd, sect, SECTSIZE, 0) != SECTSIZE)
+		fail("failed to write %s: %s", template, strerror(errno));
+
+	for (i = 0; i < count; i++) {
+		memset(sect, 0, sizeof(sect));
+		setpart(sect, 0, MBR_ID_LINUX, 1, 1);
+		if (i + 1 < count)
+			setpart(sect, 1, MBR_ID_EXTDOS, (i + 1) * 2, 2);
+		if (pwrite(fd, sect, SECTSIZE, (1 + i * 2) * SECTSIZE) !=
+		    SECTSIZE)
+			fail("failed to write %s: %s", template,
+			    strerror(errno));
+	}
+
+	if (ftruncate(fd, (off_t)(1 + extsize) * SECTSIZE) != 0)
+		fail("failed to resize %s: %s", template, strerror(errno));
+	close(fd);
+}
+
+/* Fill in partition IDX of the MBR in SECT and set the magic number. */
+void
+setpart(uint8_t *sect, int idx, int type, uint32_t start, uint32_t size)
+{
+	uint8_t *part;
+	int i;
+
+	part = sect + MBR_PART_OFF + idx * MBR_PART_SIZE;
+	part[MBR_TYPE_OFF] = type;
+	for (i = 0; i < 4; i++) {
+		part[MBR_START_OFF + i] = (start >> (i * 8)) & 0xff;
+		part[MBR_SIZE_OFF + i] = (size >> (i * 8)) & 0xff;
+	}
+	sect[SECTSIZE - 2] = 0x55;
+	sect[SECTSIZE - 1] = 0xaa;
+}
+
+/*
+  Create a sparse file at TEMPLATE, replacing its trailing Xs, with a
+  GPT holding COUNT two-sector partitions after the partition array.
+  Only the primary header is written, the backup is left as a hole.
+*/
+void
+mkgpt(char *template, long count)
+{
+	uint8_t hdr[SECTSIZE], *parts, *ent;
+	uint64_t partsects, first, last;
+	long i;
+	int fd;
+
+	if ((fd = mkstemp(template)) == -1)
+		fail("failed to create %s: %s", template, strerror(errno));
+	partsects = (count * GPT_PART_SIZE + SECTSIZE - 1) / SECTSIZE;
+	first = 2 + partsects;
+	last = first + count * 2 - 1;
+
+	if ((parts = calloc(partsects, SECTSIZE)) == NULL)
+		fail("failed to allocate memory");
+	for (i = 0; i < count; i++) {
+		ent = parts + i * GPT_PART_SIZE;
+		memcpy(ent, GPT_TYPE_LINUX, 16);
+		putle(ent + 16, i + 1, 4);
+		putle(ent + 32, first + i * 2, 8);
+		putle(ent + 40, first + i * 2 + 1, 8);
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	putle(hdr, GPT_MAGIC, 8);
+	putle(hdr + 8, GPT_REVISION, 4);
+	putle(hdr + 12, GPT_HDR_SIZE, 4);
+	putle(hdr + 24, 1, 8);
+	putle(hdr + 32, last + partsects + 1, 8);
+	putle(hdr + 40, first, 8);
+	putle(hdr + 48, last, 8);
+	putle(hdr + 72, 2, 8);
+	putle(hdr + 80, count, 4);
+	putle(hdr + 84, GPT_PART_SIZE, 4);
+	putle(hdr + 88,
+	    up_crc32(parts, count * GPT_PART_SIZE, ~0) ^ ~0, 4);
+	putle(hdr + 16, up_crc32(hdr, GPT_HDR_SIZE, ~0) ^ ~0, 4);
+
+	if (pwrite(fd, hdr, SECTSIZE, SECTSIZE) != SECTSIZE ||
+	    pwrite(fd, parts, partsects * SECTSIZE, 2 * SECTSIZE) !=
+	    (ssize_t)(partsects * SECTSIZE))
+		fail("failed to write %s: %s", template, strerror(errno));
+	free(parts);
+
+	if (ftruncate(fd, (off_t)(last + partsects + 2) * SECTSIZE) != 0)
+		fail("failed to resize %s: %s", template, strerror(errno));
+	close(fd);
+}
+
+/* Store the LEN low bytes of VAL at BUF in little-endian order. */
+void
+putle(uint8_t *buf, uint64_t val, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (val >> (i * 8)) & 0xff;
+}
+
+/*
+  Load the maps on PATH with libupart and print the average time to
+  walk all of them WALK_PASSES times, over RUNS runs.
+*/
+void
+benchwalk(const char *path, int runs)
+{
+	struct disk_params params;
+	struct timeval start, end;
+	struct up_ctx *ctx;
+	struct disk *disk;
+	struct opts opts;
+	double totalms;
+	int r, i;
+
+	memset(&params, 0, sizeof(params));
+	params.sectsize = SECTSIZE;
+	params.heads = 255;
+	params.sects = 63;
+	up_init_options(&opts);
+	opts.verbosity = UP_VERBOSITY_SILENT;
+	opts.plainfile = 1;
+	if ((ctx = up_ctx_new(myname, &opts)) == NULL ||
+	    (disk = up_disk_open(ctx, path)) == NULL ||
+	    up_disk_setup(disk, &params) < 0 ||
+	    up_map_loadall(disk) < 0)
+		fail("failed to load maps from %s", path);
+
+	totalms = 0;
+	for (r = 0; r < runs; r++) {
+		gettimeofday(&start, NULL);
+		for (i = 0; i < WALK_PASSES; i++)
+			walksink += walkmaps(UP_DISK_MAPS(disk));
+		gettimeofday(&end, NULL);
+		totalms += (end.tv_sec - start.tv_sec) * 1000.0 +
+		    (end.tv_usec - start.tv_usec) / 1000.0;
+	}
+	printf("%-24s %-10s %14s %10.3f\n", path, "walk", "-",
+	    totalms / runs / WALK_PASSES);
+
+	up_disk_close(disk);
+	up_ctx_free(ctx);
+}
+
+/* Return the total size of every partition in or under CONTAINER. */
+int64_t
+walkmaps(const struct part *container)
+{
+	const struct map *map;
+	const struct part *part;
+	int64_t sum;
+
+	sum = 0;
+	for (map = up_map_firstmap(container); map != NULL;
+	     map = up_map_nextmap(map))
+		for (part = up_map_first(map); part != NULL;
+		     part = up_map_next(part))
+			sum += part->size + walkmaps(part);
+
+	return (sum);
+}
+
+/* Drop any of the device's pages from the buffer cache. */
+void
+dropcache(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		fail("failed to open %s: %s", path, strerror(errno));
+	fsync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/*
+  Run upart once with ARGS on PATH and return the bytes transferred
+  from the device and the elapsed time in milliseconds.
+*/
+int
+runone(const char *upart, const char * const *args, const char *path,
+    int64_t *bytes, double *ms)
+{
+	const char *argv[MODE_MAXARGS + 3];
+	int argc;
+	struct rusage before, after;
+	struct timeval start, end;
+	int status, fd;
+	pid_t pid;
+
+	if (getrusage(RUSAGE_CHILDREN, &before) != 0)
+		fail("getrusage() failed: %s", strerror(errno));
+	gettimeofday(&start, NULL);
+
+	if ((pid = fork()) == -1)
+		fail("failed to fork: %s", strerror(errno));
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) == -1 ||
+		    dup2(fd, STDOUT_FILENO) == -1 ||
+		    dup2(fd, STDERR_FILENO) == -1) {
+			perror("failed to redirect output");
+			_exit(EXIT_FAILURE);
+		}
+		argc = 0;
+		argv[argc++] = upart;
+		while (argc - 1 < MODE_MAXARGS &&
+		    args[argc - 1] != NULL) {
+			argv[argc] = args[argc - 1];
+			argc++;
+		}
+		argv[argc++] = path;
+		argv[argc] = NULL;
+		execv(upart, (char * const *)argv);
+		_exit(EXIT_FAILURE);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		fail("waitpid() failed: %s", strerror(errno));
+
+	gettimeofday(&end, NULL);
+	if (getrusage(RUSAGE_CHILDREN, &after) != 0)
+		fail("getrusage() failed: %s", strerror(errno));
+
+	*bytes = (int64_t)(after.ru_inblock - before.ru_inblock) *
+	    RUSAGE_BLOCK;
+	*ms = (end.tv_sec - start.tv_sec) * 1000.0 +
+	    (end.tv_usec - start.tv_usec) / 1000.0;
+
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+void
+fail(const char *format, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", myname);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	putc('\n', stderr);
+
+	exit(EXIT_FAILURE);
+}
@@ -50,20 +50,44 @@
 #endif
 
 /* XXX dependencies from this file are hardcoded in build.mk */
+#include "crc32.h"
 #include "util.h"
 
 #define UPART_PATH	"../upart"
 #define TESTDIR_PATH	"tests"
 #define TESTINDEX_PATH	"index.txt"
 
+/* used to build the generated images */
+#define GEN_IMG_MAGIC	UINT64_C(0x5550415254eaf2e5)
+#define GEN_HDR_LEN	(352)
+#define GEN_SECT_LEN	(16)
+#define GEN_IDX_LEN	(32)
+#define GEN_SECTSIZE	(512)
+#define GEN_HEADS	(255)
+#define GEN_SPT		(63)
+#define GEN_DISKSIZE	(UINT64_C(16) * 1024 * 1024)
+/* the unused sectors which push the data past 4GB */
+#define GEN_FILLSTART	(UINT64_C(1024) * 1024)
+#define GEN_FILLSIZE	(UINT64_C(8) * 1024 * 1024)
+#define GEN_EXTSTART	(GEN_FILLSTART + GEN_FILLSIZE)
+#define GEN_GROUPS	(3)
+
 #ifdef OS_TYPE_WINDOWS
 #define RMFILE_DISPLAY	"\tdel"
 #define DIRSEP_DISPLAY	"\\"
+#define NULL_PATH	"NUL"
 #else
 #define RMFILE_DISPLAY	"rm -f"
 #define DIRSEP_DISPLAY	"/"
+#define NULL_PATH	"/dev/null"
 #endif
 
+/* set to make upart write version 2 images, see img.c */
+#define FORCEV2_ENV	"UPART_IMG_FORCEV2"
+
+/* the most arguments an index line can give after the image name */
+#define TEST_MAXARGS	(8)
+
 #ifndef NITEMS
 #define NITEMS(a)		(sizeof(a) / sizeof((a)[0]))
 #endif
@@ -73,10 +97,45 @@
 #define strdup _strdup
 #endif
 
+/*
+  An index line is either the name of an image, which is tested with
+  each of the flags below, or a test name, an image name and the
+  arguments to test it with once.
+*/
+struct test {
+	char *name;
+	char *img;
+	char *args[TEST_MAXARGS + 1];
+	size_t nargs;
+	size_t variants;
+};
+
+/*
+  An image built before testing in a temporary directory rather than
+  kept with the others. MAKE writes it to PATH, or returns why it can't
+  be built here and the tests of it are skipped.
+*/
+struct genimg {
+	const char *name;
+	const char *(*make)(const char *path, const char *name);
+};
+
+void	 makeimages(void);
+void	 rmimages(void);
+const char *imgdir(const char *, const char **);
+const char *mkbigimg(const char *, const char *);
+const char *mkwideimg(const char *, const char *);
+void	 setmbrpart(uint8_t *, int, int, uint32_t, uint32_t);
+void	 putbe(uint8_t *, uint64_t, int);
+uint32_t crczeros(uint32_t, uint64_t);
+uint32_t gf2times(const uint32_t *, uint32_t);
+void	 gf2square(uint32_t *, const uint32_t *);
 void	 cleanfiles(FILE *);
 void	 regenfiles(FILE *);
 void	 testfiles(FILE *);
 char	*nextname(const char *, FILE *);
+int	 nexttest(const char *, FILE *, struct test *);
+char	*testvariant(struct test *, size_t, char **);
 char	*strjoin(const char *, ...) ATTR_SENTINEL(0);
 int	 checkexitval(const char *, int, const char *);
 int	 checkfiles(const char *, char *, char *, int);
@@ -85,20 +144,39 @@ char	*appendname(char *, const char *);
 char	*getmyname(char *);
 void	 fail(const char *, ...) ATTR_PRINTF(1, 2);
 void	 changedir(void);
+char	*maketempdir(void);
+void	 removedir(const char *);
+int	 sparsefiles(const char *);
+void	 setenvvar(const char *, const char *);
 void	 rmfile(const char *);
 int	 diff(char *, char *);
-int	 runtest(char *, char *, const char *, const char *);
+int	 runtest(char *const *, const char *, const char *, const char *,
+    const char *);
 off_t	 filesize(const char *);
 FILE	*maybefopen(const char *, const char *);
 
 #ifdef OS_TYPE_UNIX
-int	runprog(const char *, char *const *, const char *, const char *, int);
+int	runprog(const char *, char *const *, const char *, const char *,
+    const char *, int);
 #endif
 
 
 static char * const flags[] = { "", "-v", "-vv" };
 
+/*
+  Images with more than 4GB of data are too big to keep with the other
+  test images, so they're generated as sparse files before testing.
+  Images written by upart itself are generated to test the writer.
+*/
+static const struct genimg genimgs[] = {
+	{ "big-data.img", mkbigimg },
+	{ "gpt-v2.img", mkwideimg },
+};
+static const char *genskip[NITEMS(genimgs)];
+
 char *myname;
+char *gendir;		/* where images are generated */
+char *upartpath;	/* UPART_PATH from anywhere */
 int verbose;
 
 int
@@ -141,28 +219,283 @@ main(int argc, char *argv[])
 
 	if ((idx = fopen(TESTINDEX_PATH, "r")) == NULL)
 		fail("failed to open %s for reading", TESTINDEX_PATH);
+	if (mode != cleanfiles)
+		makeimages();
 
 	(*mode)(idx);
 
 	return (0);
 }
 
+void
+makeimages(void)
+{
+	char *path;
+	size_t i;
+
+	gendir = maketempdir();
+	atexit(rmimages);
+	for (i = 0; i < NITEMS(genimgs); i++) {
+		path = strjoin(gendir, DIRSEP_DISPLAY, genimgs[i].name,
+		    (void *)NULL);
+		genskip[i] = genimgs[i].make(path, genimgs[i].name);
+		if (genskip[i] != NULL)
+			printf("skipping tests of %s: %s\n",
+			    genimgs[i].name, genskip[i]);
+		free(path);
+	}
+}
+
+void
+rmimages(void)
+{
+	char *path;
+	size_t i;
+
+	for (i = 0; i < NITEMS(genimgs); i++) {
+		path = strjoin(gendir, DIRSEP_DISPLAY, genimgs[i].name,
+		    (void *)NULL);
+		rmfile(path);
+		free(path);
+	}
+	removedir(gendir);
+}
+
+/*
+  Return the directory to test IMG in, or NULL for the test directory.
+  Generated images are tested where they were generated, so their name
+  is all that appears in the output. SKIP is set to why the image
+  couldn't be generated, if it couldn't.
+*/
+const char *
+imgdir(const char *img, const char **skip)
+{
+	size_t i;
+
+	*skip = NULL;
+	for (i = 0; i < NITEMS(genimgs); i++) {
+		if (strcmp(img, genimgs[i].name) == 0) {
+			*skip = genskip[i];
+			return (gendir);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+  Write a version 2 image of a disk with an MBR and an extended
+  partition, with a group of unused zeroed sectors between them which
+  puts the extended partition more than 4GB into the data. The zeroed
+  sectors are skipped over rather than written, and their crc is
+  calculated without them.
+*/
+const char *
+mkbigimg(const char *path, const char *name)
+{
+	static const uint64_t offs[GEN_GROUPS] =
+	    { 0, GEN_FILLSTART, GEN_EXTSTART };
+	static const uint64_t sizes[GEN_GROUPS] = { 1, GEN_FILLSIZE, 1 };
+	uint8_t hdr[GEN_HDR_LEN], grp[GEN_SECT_LEN];
+	uint8_t idx[GEN_GROUPS * GEN_IDX_LEN];
+	uint8_t data[GEN_GROUPS][GEN_SECTSIZE];
+	uint64_t dataoff;
+	uint32_t crc, datacrc;
+	FILE *fh;
+	int i;
+
+	if (!sparsefiles(gendir))
+		return ("sparse files aren't supported");
+
+	memset(data, 0, sizeof(data));
+	setmbrpart(data[0], 0, 0x83, GEN_SPT, GEN_FILLSTART - GEN_SPT);
+	setmbrpart(data[0], 1, 0x05, GEN_EXTSTART,
+	    GEN_DISKSIZE - GEN_EXTSTART);
+	setmbrpart(data[2], 0, 0x83, GEN_SPT,
+	    GEN_DISKSIZE - GEN_EXTSTART - GEN_SPT);
+
+	if ((fh = fopen(path, "wb")) == NULL)
+		fail("failed to open %s for writing", path);
+
+	/* write the groups after the header and build the index */
+	memset(idx, 0, sizeof(idx));
+	dataoff = 0;
+	datacrc = 0;
+	if (fseeko(fh, GEN_HDR_LEN, SEEK_SET) != 0)
+		fail("failed to seek %s", path);
+	for (i = 0; i < GEN_GROUPS; i++) {
+		putbe(grp, offs[i], 8);
+		putbe(grp + 8, sizes[i], 8);
+		if (fwrite(grp, GEN_SECT_LEN, 1, fh) != 1)
+			fail("failed to write to %s", path);
+		crc = up_crc32(grp, GEN_SECT_LEN, 0);
+		datacrc = up_crc32(grp, GEN_SECT_LEN, datacrc);
+		if (sizes[i] == 1) {
+			if (fwrite(data[i], GEN_SECTSIZE, 1, fh) != 1)
+				fail("failed to write to %s", path);
+			crc = up_crc32(data[i], GEN_SECTSIZE, crc);
+			datacrc = up_crc32(data[i], GEN_SECTSIZE, datacrc);
+		} else {
+			if (fseeko(fh, sizes[i] * GEN_SECTSIZE,
+				SEEK_CUR) != 0)
+				fail("failed to seek %s", path);
+			crc = crczeros(crc, sizes[i] * GEN_SECTSIZE);
+			datacrc = crczeros(datacrc, sizes[i] * GEN_SECTSIZE);
+		}
+		putbe(idx + i * GEN_IDX_LEN, offs[i], 8);
+		putbe(idx + i * GEN_IDX_LEN + 8, sizes[i], 8);
+		putbe(idx + i * GEN_IDX_LEN + 16, dataoff, 8);
+		putbe(idx + i * GEN_IDX_LEN + 24, crc, 4);
+		dataoff += GEN_SECT_LEN + sizes[i] * GEN_SECTSIZE;
+	}
+	if (fwrite(idx, sizeof(idx), 1, fh) != 1)
+		fail("failed to write to %s", path);
+
+	/* the header goes last since it has the crcs */
+	memset(hdr, 0, sizeof(hdr));
+	putbe(hdr, GEN_IMG_MAGIC, 8);
+	putbe(hdr + 8, 2, 2);
+	putbe(hdr + 10, 0, 2);
+	putbe(hdr + 12, GEN_HDR_LEN, 4);
+	putbe(hdr + 20, GEN_SECTSIZE, 4);
+	putbe(hdr + 24, GEN_HDR_LEN, 8);
+	putbe(hdr + 32, dataoff, 8);
+	putbe(hdr + 40, datacrc, 4);
+	putbe(hdr + 44, GEN_GROUPS, 4);
+	putbe(hdr + 48, GEN_HDR_LEN + dataoff, 8);
+	putbe(hdr + 56, up_crc32(idx, sizeof(idx), 0), 4);
+	putbe(hdr + 64, GEN_DISKSIZE, 8);
+	putbe(hdr + 72, GEN_DISKSIZE / (GEN_HEADS * GEN_SPT), 8);
+	putbe(hdr + 80, GEN_HEADS, 8);
+	putbe(hdr + 88, GEN_SPT, 8);
+	snprintf((char *)hdr + 96, 256, "regression-tests/%s", name);
+	putbe(hdr + 16, up_crc32(hdr, sizeof(hdr), 0), 4);
+	if (fseeko(fh, 0, SEEK_SET) != 0 ||
+	    fwrite(hdr, sizeof(hdr), 1, fh) != 1 || fclose(fh) != 0)
+		fail("failed to write to %s", path);
+
+	return (NULL);
+}
+
+/*
+  Have upart write a version 2 image of one of the test images, which
+  it would otherwise only do for one with more than 4GB of data.
+*/
+const char *
+mkwideimg(const char *path, const char *name)
+{
+	char *args[] = { "-w", NULL, NULL };
+
+	args[1] = (char *)path;
+	setenvvar(FORCEV2_ENV, "1");
+	if (runtest(args, "gpt.img", NULL, NULL_PATH, NULL_PATH) != 0)
+		fail("failed to write %s", name);
+	setenvvar(FORCEV2_ENV, NULL);
+
+	return (NULL);
+}
+
+void
+setmbrpart(uint8_t *sect, int idx, int type, uint32_t start,
+    uint32_t size)
+{
+	uint8_t *part;
+
+	part = sect + 446 + idx * 16;
+	part[4] = type;
+	part[8] = start & 0xff;
+	part[9] = (start >> 8) & 0xff;
+	part[10] = (start >> 16) & 0xff;
+	part[11] = (start >> 24) & 0xff;
+	part[12] = size & 0xff;
+	part[13] = (size >> 8) & 0xff;
+	part[14] = (size >> 16) & 0xff;
+	part[15] = (size >> 24) & 0xff;
+	sect[510] = 0x55;
+	sect[511] = 0xaa;
+}
+
+void
+putbe(uint8_t *buf, uint64_t val, int len)
+{
+	while (len-- > 0) {
+		buf[len] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+/*
+  Continue a crc over LEN zero bytes, using the same method as zlib's
+  crc32_combine() so it takes log(LEN) steps.
+*/
+uint32_t
+crczeros(uint32_t crc, uint64_t len)
+{
+	uint32_t even[32], odd[32];
+	int i;
+
+	/* the operator for one zero bit, then two and four */
+	odd[0] = 0xedb88320;
+	for (i = 1; i < 32; i++)
+		odd[i] = UINT32_C(1) << (i - 1);
+	gf2square(even, odd);
+	gf2square(odd, even);
+
+	while (len != 0) {
+		gf2square(even, odd);
+		if (len & 1)
+			crc = gf2times(even, crc);
+		if ((len >>= 1) == 0)
+			break;
+		gf2square(odd, even);
+		if (len & 1)
+			crc = gf2times(odd, crc);
+		len >>= 1;
+	}
+
+	return (crc);
+}
+
+uint32_t
+gf2times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum;
+
+	for (sum = 0; vec != 0; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return (sum);
+}
+
+void
+gf2square(uint32_t *square, const uint32_t *mat)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		square[i] = gf2times(mat, mat[i]);
+}
+
 void
 cleanfiles(FILE *idx)
 {
-	char *name, *outfile, *errfile;
+	char *name, *imgfile, *outfile, *errfile;
+	struct test test;
 	size_t i;
 
-	while ((name = nextname(TESTINDEX_PATH, idx)) != NULL) {
+	while (nexttest(TESTINDEX_PATH, idx, &test)) {
 		printf("%s", RMFILE_DISPLAY);
-		for (i = 0; i < NITEMS(flags); i++) {
-			outfile = strjoin("test-", name, flags[i], ".out", (void *)NULL);
-			errfile = strjoin("test-", name, flags[i], ".err", (void *)NULL);
+		for (i = 0; i < test.variants; i++) {
+			name = testvariant(&test, i, &imgfile);
+			outfile = strjoin("test-", name, ".out", (void *)NULL);
+			errfile = strjoin("test-", name, ".err", (void *)NULL);
 			printf(" %s%s%s %s%s%s",
 			    TESTDIR_PATH, DIRSEP_DISPLAY, outfile,
 			    TESTDIR_PATH, DIRSEP_DISPLAY, errfile);
 			rmfile(outfile);
 			rmfile(errfile);
+			free(name);
+			free(imgfile);
 			free(outfile);
 			free(errfile);
 		}
@@ -174,21 +507,31 @@ void
 regenfiles(FILE *idx)
 {
 	char *imgfile, *outfile, *errfile, *exitfile;
+	const char *dir, *skip;
+	struct test test;
 	int exitval;
 	char *name;
 	size_t i;
 
-	while ((name = nextname(TESTINDEX_PATH, idx)) != NULL) {
-		for (i = 0; i < NITEMS(flags); i++) {
-			imgfile = strjoin(name, ".img", (void *)NULL);
-			outfile = strjoin(name, flags[i], ".out", (void *)NULL);
-			errfile = strjoin(name, flags[i], ".err", (void *)NULL);
-			exitfile = strjoin(name, flags[i], ".exit", (void *)NULL);
+	while (nexttest(TESTINDEX_PATH, idx, &test)) {
+		for (i = 0; i < test.variants; i++) {
+			name = testvariant(&test, i, &imgfile);
+			if ((dir = imgdir(imgfile, &skip)) != NULL &&
+			    skip != NULL) {
+				/* keep the old output */
+				free(name);
+				free(imgfile);
+				continue;
+			}
+			outfile = strjoin(name, ".out", (void *)NULL);
+			errfile = strjoin(name, ".err", (void *)NULL);
+			exitfile = strjoin(name, ".exit", (void *)NULL);
 
 			rmfile(outfile);
 			rmfile(errfile);
 			rmfile(exitfile);
-			exitval = runtest(flags[i], imgfile, outfile, errfile);
+			exitval = runtest(test.args, imgfile, dir, outfile,
+			    errfile);
 
 			if (filesize(outfile) == 0)
 				rmfile(outfile);
@@ -204,6 +547,7 @@ regenfiles(FILE *idx)
 				fclose(eh);
 			}
 
+			free(name);
 			free(imgfile);
 			free(outfile);
 			free(errfile);
@@ -215,9 +559,11 @@ regenfiles(FILE *idx)
 void
 testfiles(FILE *idx)
 {
-	char *bad, *name, *fullname, *imgfile, *outfile, *errfile, *exitfile;
+	char *bad, *fullname, *imgfile, *outfile, *errfile, *exitfile;
 	char *newoutfile, *newerrfile;
-	int exitval, failed, failures, testcount;
+	int exitval, failed, failures, skipped, testcount;
+	const char *dir, *skip;
+	struct test test;
 	size_t i;
 
 	printf("running tests...\n");
@@ -225,10 +571,17 @@ testfiles(FILE *idx)
 	bad = NULL;
 	testcount = 0;
 	failures = 0;
-	while ((name = nextname(TESTINDEX_PATH, idx)) != NULL) {
-		for (i = 0; i < NITEMS(flags); i++) {
-			fullname = strjoin(name, flags[i], (void *)NULL);
-			imgfile = strjoin(name, ".img", (void *)NULL);
+	skipped = 0;
+	while (nexttest(TESTINDEX_PATH, idx, &test)) {
+		for (i = 0; i < test.variants; i++) {
+			fullname = testvariant(&test, i, &imgfile);
+			if ((dir = imgdir(imgfile, &skip)) != NULL &&
+			    skip != NULL) {
+				skipped++;
+				free(fullname);
+				free(imgfile);
+				continue;
+			}
 			outfile = strjoin(fullname, ".out", (void *)NULL);
 			errfile = strjoin(fullname, ".err", (void *)NULL);
 			exitfile = strjoin(fullname, ".exit", (void *)NULL);
@@ -237,7 +590,7 @@ testfiles(FILE *idx)
 
 			rmfile(newoutfile);
 			rmfile(newerrfile);
-			exitval = runtest(flags[i], imgfile,
+			exitval = runtest(test.args, imgfile, dir,
 			    newoutfile, newerrfile);
 			failed = 0;
 
@@ -264,6 +617,8 @@ testfiles(FILE *idx)
 		}
 	}
 
+	if (skipped != 0)
+		printf("%d tests skipped.\n", skipped);
 	printf("%d tests failed out of %d total.\n", failures, testcount);
 	if (failures != 0) {
 		printf("The following tests failed:\n  %s\n", bad);
@@ -298,6 +653,55 @@ nextname(const char *filename, FILE *fh)
 	return (NULL);
 }
 
+/*
+  Read the next line of the index into TEST, splitting it into words.
+  Returns 0 at the end of the index.
+*/
+int
+nexttest(const char *filename, FILE *fh, struct test *test)
+{
+	char *line, *word;
+
+	if ((line = nextname(filename, fh)) == NULL)
+		return (0);
+
+	memset(test, 0, sizeof(*test));
+	test->name = strtok(line, " \t");
+	if ((test->img = strtok(NULL, " \t")) == NULL) {
+		/* just an image, test it with each of the flags */
+		test->img = test->name;
+		test->variants = NITEMS(flags);
+		return (1);
+	}
+
+	while ((word = strtok(NULL, " \t")) != NULL) {
+		if (test->nargs == TEST_MAXARGS) {
+			errno = E2BIG;
+			fail("too many arguments for %s in %s",
+			    test->name, filename);
+		}
+		test->args[test->nargs++] = word;
+	}
+	test->variants = 1;
+
+	return (1);
+}
+
+/*
+  Set up the arguments for variant VARIANT of TEST, returning the name
+  of its output files and the image name in IMG.
+*/
+char *
+testvariant(struct test *test, size_t variant, char **img)
+{
+	*img = strjoin(test->img, ".img", (void *)NULL);
+	if (test->nargs != 0)
+		return (strjoin(test->name, (void *)NULL));
+
+	test->args[0] = (flags[variant][0] != '\0' ? flags[variant] : NULL);
+	return (strjoin(test->name, flags[variant], (void *)NULL));
+}
+
 char *
 strjoin(const char *first, ...)
 {
@@ -456,8 +860,67 @@ fail(const char *format, ...)
 void
 changedir(void)
 {
+	char buf[MAXPATHLEN];
+
 	if (chdir(TESTDIR_PATH) != 0)
 		fail("failed to change directory to %s", TESTDIR_PATH);
+	if (getcwd(buf, sizeof(buf)) == NULL)
+		fail("failed to get the current directory");
+	upartpath = strjoin(buf, "/", UPART_PATH, (void *)NULL);
+}
+
+char *
+maketempdir(void)
+{
+	const char *tmp;
+	char *path;
+
+	if ((tmp = getenv("TMPDIR")) == NULL || *tmp == '\0')
+		tmp = "/tmp";
+	path = strjoin(tmp, "/upart-tests.XXXXXX", (void *)NULL);
+	if (mkdtemp(path) == NULL)
+		fail("failed to create a directory in %s", tmp);
+
+	return (path);
+}
+
+void
+removedir(const char *path)
+{
+	/* this is only cleaning up, a stray directory in /tmp is fine */
+	rmdir(path);
+}
+
+/*
+  Return true if files in DIR can have holes which take up no space,
+  by checking how much a file with a 1MB hole in it takes up.
+*/
+int
+sparsefiles(const char *dir)
+{
+	struct stat sb;
+	char *path;
+	int fd, res;
+
+	path = strjoin(dir, "/sparse", (void *)NULL);
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+		fail("failed to open %s for writing", path);
+	if (lseek(fd, 1024 * 1024, SEEK_SET) == -1 ||
+	    write(fd, "", 1) != 1 || fstat(fd, &sb) != 0)
+		fail("failed to write to %s", path);
+	res = ((off_t)sb.st_blocks * 512 < 1024 * 1024);
+	close(fd);
+	rmfile(path);
+	free(path);
+
+	return (res);
+}
+
+void
+setenvvar(const char *name, const char *value)
+{
+	if ((value != NULL ? setenv(name, value, 1) : unsetenv(name)) != 0)
+		fail("failed to set %s in the environment", name);
 }
 
 void
@@ -475,27 +938,31 @@ diff(char *old, char *new)
 	argv[2] = old;
 	argv[3] = new;
 
-	return (runprog("diff", argv, NULL, NULL, 1));
+	return (runprog("diff", argv, NULL, NULL, NULL, 1));
 }
 
+/* Run upart with ARGS on IMG in DIR, or the test directory if NULL. */
 int
-runtest(char *flags, char *img, const char *out, const char *err)
+runtest(char *const *args, const char *img, const char *dir,
+    const char *out, const char *err)
 {
-	char *argv[4];
+	char *argv[TEST_MAXARGS + 3];
+	char *prog;
 	int i;
 
+	prog = (dir != NULL ? upartpath : UPART_PATH);
 	i = 0;
-	argv[i++] = UPART_PATH;
-	if (flags && flags[0] != '\0')
-		argv[i++] = flags;
-	argv[i++] = img;
+	argv[i++] = prog;
+	while (*args != NULL)
+		argv[i++] = *args++;
+	argv[i++] = (char *)img;
 	argv[i++] = NULL;
 
-	return (runprog(UPART_PATH, argv, out, err, 0));
+	return (runprog(prog, argv, dir, out, err, 0));
 }
 
 int
-runprog(const char *prog, char *const argv[],
+runprog(const char *prog, char *const argv[], const char *dir,
     const char *out, const char *err, int search)
 {
 	int ifd, ofd, efd, status;
@@ -537,6 +1004,10 @@ runprog(const char *prog, char *const argv[],
 		close(ofd);
 	if (err)
 		close(efd);
+	if (dir != NULL && chdir(dir) != 0) {
+		perror("chdir() failed");
+		_exit(EXIT_FAILURE);
+	}
 
 	if (search)
 		execvp(prog, argv);
@@ -624,8 +1095,51 @@ fail(const char *format, ...)
 void
 changedir(void)
 {
+	char buf[MAX_PATH];
+
 	if (!SetCurrentDirectory(TESTDIR_PATH))
 		fail("failed to change directory to %s", TESTDIR_PATH);
+	if (GetCurrentDirectory(sizeof(buf), buf) == 0)
+		fail("failed to get the current directory");
+	upartpath = strjoin(buf, "\\", UPART_PATH, (void *)NULL);
+}
+
+char *
+maketempdir(void)
+{
+	char tmp[MAX_PATH], path[MAX_PATH];
+	char *ret;
+
+	/* GetTempFileName() creates a file, make it a directory instead */
+	if (GetTempPath(sizeof(tmp), tmp) == 0 ||
+	    GetTempFileName(tmp, "upt", 0, path) == 0)
+		fail("failed to create a temporary file");
+	if (!DeleteFile(path) || !CreateDirectory(path, NULL))
+		fail("failed to create a directory in %s", tmp);
+	if ((ret = strdup(path)) == NULL)
+		fail("failed to allocate memory");
+
+	return (ret);
+}
+
+void
+removedir(const char *path)
+{
+	RemoveDirectory(path);
+}
+
+int
+sparsefiles(const char *dir)
+{
+	/* files have to be marked as sparse, stdio doesn't do that */
+	return (0);
+}
+
+void
+setenvvar(const char *name, const char *value)
+{
+	if (!SetEnvironmentVariable(name, value))
+		fail("failed to set %s in the environment", name);
 }
 
 void
@@ -642,17 +1156,26 @@ diff(char *old, char *new)
 }
 
 int
-runtest(const char *args, const char *img, const char *out, const char *err)
+runtest(char *const *args, const char *img, const char *dir,
+    const char *out, const char *err)
 {
 	SECURITY_ATTRIBUTES sa;
 	PROCESS_INFORMATION pi;
 	STARTUPINFO si;
 	HANDLE nh, oh, eh;
 	DWORD ecode;
-	char *cmd;
+	char *cmd, *next;
 
 	/* XXX should do escaping here */
-	cmd = strjoin(UPART_PATH, " ", args, " ", img, (void *)NULL);
+	cmd = strjoin((dir != NULL ? upartpath : UPART_PATH), (void *)NULL);
+	for (; *args != NULL; args++) {
+		next = strjoin(cmd, " ", *args, (void *)NULL);
+		free(cmd);
+		cmd = next;
+	}
+	next = strjoin(cmd, " ", img, (void *)NULL);
+	free(cmd);
+	cmd = next;
 
 	memset(&sa, 0, sizeof(sa));
 	sa.nLength = sizeof(sa);
@@ -678,7 +1201,7 @@ runtest(const char *args, const char *img, const char *out, const char *err)
 	si.hStdOutput = oh;
 	si.hStdError = eh;
 
-	if (!CreateProcess(NULL, cmd, NULL, NULL, 1, 0, NULL, NULL, &si, &pi))
+	if (!CreateProcess(NULL, cmd, NULL, NULL, 1, 0, NULL, dir, &si, &pi))
 		fail("failed to create process %s", cmd);
 
 	if (WaitForSingleObject(pi.hProcess, INFINITE) == WAIT_FAILED)
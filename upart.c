@@ -0,0 +1,86 @@
+/* 
+ * Copyright (c) 2026 Joshua R. Elsasser.
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apm.h"
+#include "bsdlabel.h"
+#include "gpt.h"
+#include "mbr.h"
+#include "os.h"
+#include "softraid.h"
+#include "sunlabel-sparc.h"
+#include "sunlabel-x86.h"
+#include "upart.h"
+
+struct up_ctx *
+up_ctx_new(const char *name, const struct opts *opts)
+{
+	struct up_ctx *ctx;
+
+	if (up_getendian() < 0 ||
+	    (ctx = up_xalloc(1, sizeof(*ctx), XA_ZERO)) == NULL)
+		return (NULL);
+	ctx->opts = *opts;
+	ctx->msgstream = stderr;
+	ctx->outstream = stdout;
+	if ((ctx->name = up_xstrdup(name, 0)) == NULL ||
+	    (ctx->types = up_xalloc(UP_MAP_ID_COUNT, sizeof(*ctx->types),
+		XA_ZERO)) == NULL) {
+		up_ctx_free(ctx);
+		return (NULL);
+	}
+
+	up_mbr_register(ctx);
+	up_bsdlabel_register(ctx);
+	up_apm_register(ctx);
+	up_sunlabel_sparc_register(ctx);
+	up_sunlabel_x86_register(ctx);
+	up_gpt_register(ctx);
+	up_softraid_register(ctx);
+
+	return (ctx);
+}
+
+void
+up_ctx_free(struct up_ctx *ctx)
+{
+	int i;
+
+	if (ctx == NULL)
+		return;
+	os_pool_close(ctx->pool);
+	if (ctx->types != NULL)
+		for (i = 0; i < UP_MAP_ID_COUNT; i++) {
+			free(ctx->types[i].label);
+			free(ctx->types[i].name);
+		}
+	free(ctx->types);
+	free(ctx->name);
+	free(ctx);
+}
+
+int
+up_ctx_listdevices(struct up_ctx *ctx, FILE *stream)
+{
+	return (os_list_devices(ctx, stream));
+}
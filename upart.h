@@ -0,0 +1,67 @@
+/* 
+ * Copyright (c) 2026 Joshua R. Elsasser.
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  The interface to libupart. Everything a scan needs besides the disk
+  itself is kept in a context, so any number of disks may be scanned in
+  one process. A context and the disks opened with it must only be used
+  by one thread at a time, but separate contexts may be used on
+  separate threads. A scan looks something like this:
+
+	struct disk_params params = { 0 };
+	struct opts opts;
+	struct up_ctx *ctx;
+	struct disk *disk;
+
+	up_init_options(&opts);
+	ctx = up_ctx_new("myprog", &opts);
+	disk = up_disk_open(ctx, "sd0");
+	if (up_disk_setup(disk, &params) == 0 &&
+	    up_map_loadall(disk) == 0)
+		up_map_printall(disk, stdout);
+	up_disk_close(disk);
+	up_ctx_free(ctx);
+
+  Errors are printed to the context's msgstream, prefixed with the name
+  passed to up_ctx_new(). The maps found on a disk may be walked with
+  up_map_firstmap(UP_DISK_MAPS(disk)) and the other functions in map.h.
+  Walking doesn't read the disk, so partitions left pending by
+  up_map_loaddepth() have no maps until they are loaded by passing
+  them to up_map_expand().
+*/
+
+#ifndef HDR_UPART_UPART
+#define HDR_UPART_UPART
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "disk.h"
+#include "img.h"
+#include "map.h"
+#include "util.h"
+
+/* Create a context with a copy of OPTS and all map types registered,
+   or return NULL on failure. NAME is prefixed to messages. */
+struct up_ctx	*up_ctx_new(const char *name, const struct opts *opts);
+
+/* Free a context after all disks opened with it are closed. */
+void		 up_ctx_free(struct up_ctx *);
+
+/* List the disk devices which can be opened to STREAM. */
+int		 up_ctx_listdevices(struct up_ctx *, FILE *stream);
+
+#endif /* HDR_UPART_UPART */
@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include "disk.h"
+#include "os.h"
 #include "util.h"
 
 /* Consider everything above 0x19 and belot 0x7f printable */
@@ -34,9 +35,12 @@
      (0x7f & ((int)(chr) + 1)) && \
      !(0x80 & (int)(chr)))
 
-static void up_vmsg(unsigned int flags, const char *fmt, va_list ap);
+static void up_vmsg(struct up_ctx *, unsigned int, const char *, va_list);
+static void task_printf(struct up_task *, const char *, ...) ATTR_PRINTF(2, 3);
+static void task_vprintf(struct up_task *, const char *, va_list);
+static void task_append(struct up_task *, const char *, size_t);
 
-int up_endian = 0;
+const union up_endian_probe up_endian_probe = { UINT32_C(0x04030201) };
 
 int
 up_getendian(void)
@@ -46,16 +50,8 @@ up_getendian(void)
     uint8_t bufle[4] = {1, 2, 3, 4};
 
     assert(4 == sizeof(num) && 4 == sizeof(bufbe) && 4 == sizeof(bufle));
-    if(!memcmp(&num, bufbe, 4))
-    {
-        up_endian = UP_ENDIAN_BIG;
+    if(!memcmp(&num, bufbe, 4) || !memcmp(&num, bufle, 4))
         return 0;
-    }
-    else if(!memcmp(&num, bufle, 4))
-    {
-        up_endian = UP_ENDIAN_LITTLE;
-        return 0;
-    }
     else
     {
         /* XXX should call this after parsing args so verbosity is known */
@@ -167,7 +163,7 @@ up_scatprintf(char *str, size_t size, const char *format, ...)
 }
 
 void *
-xalloc(size_t nmemb, size_t size, unsigned int flags)
+up_xalloc(size_t nmemb, size_t size, unsigned int flags)
 {
 	void *ptr;
 
@@ -191,114 +187,197 @@ xalloc(size_t nmemb, size_t size, unsigned int flags)
 }
 
 char *
-xstrdup(const char *old, unsigned int flags)
+up_xstrdup(const char *old, unsigned int flags)
 {
 	size_t len;
 	char *new;
 
 	len = strlen(old);
-	if ((new = xalloc(len + 1, 1, flags)) != NULL)
+	if ((new = up_xalloc(len + 1, 1, flags)) != NULL)
 		memcpy(new, old, len + 1);
 
 	return (new);
 }
 
-static char *up_savedname = NULL;
-
-int
-up_savename(const char *argv0)
-{
-	const char *name;
-	char *new;
-
-	if (!(name = strrchr(argv0, '/')) || !*(++name))
-		name = argv0;
-
-	if ((new = xstrdup(name, 0)) == NULL)
-		return (-1);
-
-	free(up_savedname);
-	up_savedname = new;
-
-	return (0);
-}
-
-const char *
-up_getname(void)
-{
-    return up_savedname;
-}
-
 void
-up_err(const char *fmt, ...)
+up_err(struct up_ctx *ctx, const char *fmt, ...)
 {
     va_list ap;
 
     va_start(ap, fmt);
-    up_vmsg(UP_MSG_FERR, fmt, ap);
+    up_vmsg(ctx, UP_MSG_FERR, fmt, ap);
     va_end(ap);
 }
 
 void
-up_warn(const char *fmt, ...)
+up_warn(struct up_ctx *ctx, const char *fmt, ...)
 {
     va_list ap;
 
     va_start(ap, fmt);
-    up_vmsg(UP_MSG_FWARN, fmt, ap);
+    up_vmsg(ctx, UP_MSG_FWARN, fmt, ap);
     va_end(ap);
 }
 
 void
-up_msg(unsigned int flags, const char *fmt, ...)
+up_msg(struct up_ctx *ctx, unsigned int flags, const char *fmt, ...)
 {
     va_list ap;
 
     va_start(ap, fmt);
-    up_vmsg(flags, fmt, ap);
+    up_vmsg(ctx, flags, fmt, ap);
     va_end(ap);
 }
 
+unsigned long
+up_msg_count(const struct up_ctx *ctx)
+{
+    struct up_task *task;
+
+    if(NULL != (task = up_task_get()))
+        return task->msgcount;
+    return ctx->msgcount;
+}
+
 static void
-up_vmsg(unsigned int flags, const char *fmt, va_list ap)
+up_vmsg(struct up_ctx *ctx, unsigned int flags, const char *fmt, va_list ap)
 {
+    struct up_task *task;
+
+    if(NULL != (task = up_task_get()))
+    {
+        task->msgcount++;
+        if(!(flags & UP_MSG_FBARE))
+            task_printf(task, "%s: %s", ctx->name,
+                        (flags & UP_MSG_FWARN ? "warning: " : ""));
+        task_vprintf(task, fmt, ap);
+        if(!(flags & UP_MSG_FBARE))
+            task_append(task, "\n", 1);
+        return;
+    }
+
+    ctx->msgcount++;
     if(!(flags & UP_MSG_FBARE))
     {
         if(flags & UP_MSG_FWARN)
-            fprintf(stderr, "%s: warning: ", up_getname());
+            fprintf(ctx->msgstream, "%s: warning: ", ctx->name);
         else if(flags & UP_MSG_FWARN)
-            fprintf(stderr, "%s: error: ", up_getname());
+            fprintf(ctx->msgstream, "%s: error: ", ctx->name);
         else
-            fprintf(stderr, "%s: ", up_getname());
+            fprintf(ctx->msgstream, "%s: ", ctx->name);
     }
-    vfprintf(stderr, fmt, ap);
+    vfprintf(ctx->msgstream, fmt, ap);
     if(!(flags & UP_MSG_FBARE))
-        putc('\n', stderr);
+        putc('\n', ctx->msgstream);
+}
+
+struct up_task *
+up_task_get(void)
+{
+	return (os_thread_data());
+}
+
+struct up_task *
+up_task_set(struct up_task *task)
+{
+	struct up_task *old;
+
+	old = os_thread_data();
+	os_thread_setdata(task);
+
+	return (old);
+}
+
+void
+up_task_flush(struct up_ctx *ctx, struct up_task *task)
+{
+	struct up_task *cur;
+
+	if (task->msglen > 0) {
+		if ((cur = up_task_get()) != NULL)
+			task_append(cur, task->msgs, task->msglen);
+		else
+			fwrite(task->msgs, 1, task->msglen, ctx->msgstream);
+	}
+	free(task->msgs);
+	free(task->sect);
+	memset(task, 0, sizeof(*task));
+}
+
+static void
+task_printf(struct up_task *task, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	task_vprintf(task, fmt, ap);
+	va_end(ap);
+}
+
+static void
+task_vprintf(struct up_task *task, const char *fmt, va_list ap)
+{
+	char buf[256], *big;
+	va_list copy;
+	int len;
+
+	va_copy(copy, ap);
+	len = vsnprintf(buf, sizeof(buf), fmt, copy);
+	va_end(copy);
+	if (len < 0)
+		return;
+	if ((size_t)len < sizeof(buf)) {
+		task_append(task, buf, len);
+		return;
+	}
+	if ((big = up_xalloc(len + 1, 1, 0)) == NULL)
+		return;
+	vsnprintf(big, len + 1, fmt, ap);
+	task_append(task, big, len);
+	free(big);
+}
+
+static void
+task_append(struct up_task *task, const char *text, size_t len)
+{
+	size_t size;
+	char *new;
+
+	if (task->msglen + len > task->msgsize) {
+		size = MAX(task->msgsize * 2, task->msglen + len);
+		if ((new = up_xalloc(size, 1, 0)) == NULL)
+			return;
+		if (task->msglen > 0)
+			memcpy(new, task->msgs, task->msglen);
+		free(task->msgs);
+		task->msgs = new;
+		task->msgsize = size;
+	}
+	memcpy(task->msgs + task->msglen, text, len);
+	task->msglen += len;
 }
 
 int
-printsect(uint64_t num, FILE *stream)
+up_printsect(const struct disk *disk, uint64_t num, FILE *stream)
 {
-	return (printsect_pad(num, 0, stream));
+	return (up_printsect_pad(disk, num, 0, stream));
 }
 
 int
-printsect_pad(uint64_t num, int padding, FILE *stream)
+up_printsect_pad(const struct disk *disk, uint64_t num, int padding,
+    FILE *stream)
 {
-	struct disk *disk;
 	const char *unit;
 	float size;
 
-	if (opts->humansize) {
-		disk = current_disk();
-		size = up_fmtsize(num * (disk == NULL ?
-			512 : UP_DISK_1SECT(disk)), &unit);
+	if (disk->ctx->opts.humansize) {
+		size = up_fmtsize(num * UP_DISK_1SECT(disk), &unit);
 		padding = MAX(0, padding - 2);
 		if (stream == NULL)
 			return (8);
 		return (fprintf(stream, "%*.2f%-2s", padding, size, unit));
 	}
-	else if (opts->printhex) {
+	else if (disk->ctx->opts.printhex) {
 		if (stream == NULL)
 			return (snprintf(NULL, 0, "%#*"PRIx64, padding, num));
 		else
@@ -313,31 +392,20 @@ printsect_pad(uint64_t num, int padding, FILE *stream)
 }
 
 int
-printsect_verbose(uint64_t num, FILE *stream)
+up_printsect_verbose(const struct disk *disk, uint64_t num, FILE *stream)
 {
-	if (!opts->humansize && stream != NULL &&
+	if (!disk->ctx->opts.humansize && stream != NULL &&
 	    fputs("sector ", stream) == EOF)
 		return (-1);
-	return (printsect_pad(num, 0, stream));
+	return (up_printsect_pad(disk, num, 0, stream));
 }
 
-const struct opts *opts = NULL;
-
 void
-init_options(struct opts *opts)
+up_init_options(struct opts *opts)
 {
 	memset(opts, 0, sizeof(*opts));
 }
 
-void
-set_options(const struct opts *new_opts)
-{
-	static struct opts static_opts = { 0 };
-
-	static_opts = *new_opts;
-	opts = &static_opts;
-}
-
 #ifndef HAVE_STRLCPY
 #include "strlcpy.c"
 #endif /* HAVE_STRLCPY */
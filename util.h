@@ -43,7 +43,13 @@
 
 #define UP_ENDIAN_BIG           (4321)
 #define UP_ENDIAN_LITTLE        (1234)
-extern int up_endian;
+/* the machine byte order, read from a constant so threads can share it */
+extern const union up_endian_probe {
+    uint32_t num;
+    uint8_t buf[4];
+} up_endian_probe;
+#define up_endian \
+    (4 == up_endian_probe.buf[0] ? UP_ENDIAN_BIG : UP_ENDIAN_LITTLE)
 
 /* convert NUM from big endian to host byte order */
 #define UP_BETOH16(num) \
@@ -110,7 +116,7 @@ extern int up_endian;
      ((((const uint64_t)(num)) & UINT64_C(0x00ff000000000000)) >> 40) | \
      ((((const uint64_t)(num)) & UINT64_C(0xff00000000000000)) >> 56))
 
-/* determine the current machine byte order */
+/* check that the machine byte order is one which is supported */
 int up_getendian(void);
 
 /*
@@ -138,30 +144,61 @@ int up_scatprintf(char *str, size_t size, const char *format, ...);
 #define XA_ZERO		(1 << 0) /* Zero the allocated memory */
 #define XA_QUIET	(1 << 1) /* Don't print an error message on failure */
 #define XA_FATAL	(1 << 2) /* Exit on failure */
-void	*xalloc(size_t, size_t, unsigned int);
-char	*xstrdup(const char *, unsigned int);
+void	*up_xalloc(size_t, size_t, unsigned int);
+char	*up_xstrdup(const char *, unsigned int);
 
-/* save and retrieve the program name */
-int up_savename(const char *argv0);
-const char *up_getname(void);
+struct up_ctx;
 
-void up_err(const char *fmt, ...) ATTR_PRINTF(1, 2);
-void up_warn(const char *fmt, ...) ATTR_PRINTF(1, 2);
+/* Print a message prefixed with the context's name to its message
+   stream, or hold it in the current task if there is one. */
+void up_err(struct up_ctx *, const char *fmt, ...) ATTR_PRINTF(2, 3);
+void up_warn(struct up_ctx *, const char *fmt, ...) ATTR_PRINTF(2, 3);
 #define UP_MSG_FWARN            (1 << 0)
 #define UP_MSG_FERR             (1 << 1)
 #define UP_MSG_FBARE            (1 << 2)
-void up_msg(unsigned int flags, const char *fmt, ...) ATTR_PRINTF(2, 3);
+/* A warning if the named option is set, otherwise an error. */
+#define UP_MSG_FOPTWARN(ctx, opt) \
+	((ctx)->opts.opt ? UP_MSG_FWARN : UP_MSG_FERR)
+void up_msg(struct up_ctx *, unsigned int flags, const char *fmt, ...)
+    ATTR_PRINTF(3, 4);
+/* Return the number of messages printed so far by this thread, or by
+   the context if no task is current. */
+unsigned long up_msg_count(const struct up_ctx *);
+
+/*
+  State for a piece of work running on its own thread. Messages are
+  held in the task while it is current on a thread, so work done in
+  parallel can be reported in a fixed order by up_task_flush().
+*/
+struct up_task {
+	char *msgs;		/* held messages, not nul-terminated */
+	size_t msglen;
+	size_t msgsize;
+	void *sect;		/* buffer for up_disk_getsect() */
+	size_t sectsize;
+	unsigned long msgcount;	/* messages printed, see up_msg_count() */
+};
+
+/* Return the task current on this thread, or NULL. */
+struct up_task *up_task_get(void);
+/* Make a task current on this thread and return the previous one. */
+struct up_task *up_task_set(struct up_task *);
+/* Print or pass on the held messages and free everything in a task. */
+void up_task_flush(struct up_ctx *, struct up_task *);
 
 #define UP_VERBOSITY_SILENT     -2
 #define UP_VERBOSITY_QUIET      -1
 #define UP_VERBOSITY_NORMAL     0
 #define UP_VERBOSITY_EXTRA      1
 #define UP_VERBOSITY_SPAM       2
-#define UP_NOISY(need)		(opts->verbosity >= UP_VERBOSITY_ ## need)
+#define UP_NOISY(ctx, need) \
+	((ctx)->opts.verbosity >= UP_VERBOSITY_ ## need)
 
-int	printsect(uint64_t, FILE *);
-int	printsect_pad(uint64_t, int, FILE *);
-int	printsect_verbose(uint64_t, FILE *);
+struct disk;
+
+int	up_printsect(const struct disk *, uint64_t, FILE *);
+int	up_printsect_pad(const struct disk *, uint64_t, int, FILE *);
+int	up_printsect_verbose(const struct disk *, uint64_t, FILE *);
 
 /* see strlcpy(3) manpage */
 #ifndef HAVE_STRLCPY
@@ -187,23 +224,42 @@ struct opts
 {
 	const char *serialize;
 	const char *label;
+	const char *classify;	/* map types to look for, see -c */
 	int verbosity;
+	int readtimeout;	/* milliseconds to wait for one read, or 0 */
+	int disktimeout;	/* milliseconds to spend reading a disk, or 0 */
+	int jobs;		/* threads to probe partitions with, or 0 */
+	int maxdepth;		/* levels of maps to load, or 0 for all */
+	int maxnest;		/* levels of maps to ever search, or 0 */
+	int maxmaps;		/* maps to load before giving up, or 0 */
+	int64_t maxsects;	/* most sectors to read, or 0 */
 	unsigned int plainfile : 1;
 	unsigned int relaxed : 1;
 	unsigned int sloppyio : 1;
 	unsigned int printhex : 1;
 	unsigned int humansize : 1;
 	unsigned int swapcols : 1;
+	unsigned int iostats : 1;
+	unsigned int directio : 1;
+	unsigned int progressive : 1; /* print maps as soon as they load */
+	unsigned int strictimg : 1; /* check image data before reading it */
 };
 
-/* Pointer to the global program options, initially NULL. */
-extern const struct opts *opts;
+/*
+  Everything a scan needs which isn't specific to one disk. Each disk
+  keeps a pointer to the context it was opened with, see up_ctx_new().
+*/
+struct up_ctx {
+	struct opts opts;
+	char *name;		/* prefixed to messages */
+	FILE *msgstream;	/* where messages go, stderr by default */
+	FILE *outstream;	/* where progressive maps go, stdout */
+	unsigned long msgcount;	/* messages printed outside of a task */
+	struct map_funcs *types; /* map types, see up_map_register() */
+	struct os_pool *pool;	/* threads for probing, see opts.jobs */
+};
 
 /* Initialize an option struct with sane default values. */
-void	 init_options(struct opts *);
-
-/* Set the global options. The passed-in struct is copied and need not
- * be retained. */
-void	 set_options(const struct opts *);
+void	 up_init_options(struct opts *);
 
 #endif /* HDR_UPART_UTIL */